@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+#include <linux/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "batch.h"
+#include "sftp.h"
+
+/* Jobs are dealt out to the workers in runs, in the order they came, and
+   each works through its own.  A worker that runs out steals the second
+   half of what's left to the busiest one, so that a worker stuck on a big
+   file doesn't hold up the small ones queued behind it.
+ */
+
+/* Map the queues and results for a batch of jobs shared between workers,
+   and deal the jobs out.  Returns false, with errno set, if the memory
+   can't be had. */
+bool batch_init(Batch *b, size_t jobs, int workers) {
+  pthread_mutexattr_t attr;
+  size_t queues = (size_t)workers * sizeof *b->queues;
+  char *p;
+
+  b->size = queues + jobs * sizeof *b->results;
+  p = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+           -1, 0);
+  if (p == MAP_FAILED)
+    return false;
+
+  b->queues = (WorkQueue *)p;
+  b->results = (JobResult *)(p + queues);
+  b->workers = workers;
+  b->jobs = jobs;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  for (int i = 0; i < workers; i++) {
+    pthread_mutex_init(&b->queues[i].lock, &attr);
+    b->queues[i].head = jobs * (size_t)i / (size_t)workers;
+    b->queues[i].tail = jobs * (size_t)(i + 1) / (size_t)workers;
+  }
+  pthread_mutexattr_destroy(&attr);
+  return true;
+}
+
+void batch_free(Batch *b) { munmap(b->queues, b->size); }
+
+/* Take the next job for a worker, stealing some if its own are done.
+   Returns the job's index, or -1 once there are none left anywhere. */
+ssize_t batch_take(Batch *b, int worker) {
+  WorkQueue *mine = &b->queues[worker], *victim;
+  size_t left, most, from, to;
+  ssize_t job = -1;
+
+  pthread_mutex_lock(&mine->lock);
+  if (mine->head < mine->tail)
+    job = (ssize_t)mine->head++;
+  pthread_mutex_unlock(&mine->lock);
+
+  while (job < 0) {
+    /* Find whoever has most left, without locking, then make sure. */
+    victim = NULL;
+    most = 0;
+    for (int i = 0; i < b->workers; i++) {
+      from = __atomic_load_n(&b->queues[i].head, __ATOMIC_RELAXED);
+      to = __atomic_load_n(&b->queues[i].tail, __ATOMIC_RELAXED);
+      if (i != worker && to > from && to - from > most) {
+        victim = &b->queues[i];
+        most = to - from;
+      }
+    }
+    if (victim == NULL)
+      return -1;
+
+    pthread_mutex_lock(&victim->lock);
+    left = victim->tail - victim->head;
+    to = victim->tail;
+    from = victim->tail - left / 2 - left % 2;
+    if (left > 0)
+      victim->tail = from;
+    pthread_mutex_unlock(&victim->lock);
+    if (left == 0)
+      continue;
+
+    /* The first of them is ours to run now, and the rest are queued. */
+    pthread_mutex_lock(&mine->lock);
+    mine->head = from + 1;
+    mine->tail = to;
+    mine->stolen += to - from;
+    pthread_mutex_unlock(&mine->lock);
+    job = (ssize_t)from;
+  }
+  return job;
+}
+
+/* Bytes received and sent, and acknowledged, on a socket, as the kernel
+   counts them. */
+uint64_t socket_bytes(int fd) {
+  struct tcp_info info;
+  socklen_t len = sizeof info;
+
+  memset(&info, 0, sizeof info);
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+    return 0;
+  return info.tcpi_bytes_received + info.tcpi_bytes_acked;
+}
+
+/* Print what the batch came to, having taken nanoseconds in all: how many
+   jobs were done and how fast, then what each worker did and the slowest
+   job, named from names. */
+void batch_summary(Batch *b, FILE *out, char **names, uint64_t nanoseconds) {
+  uint64_t bytes = 0, busy;
+  size_t done = 0, failed = 0, slowest = 0, count;
+  double seconds = (double)nanoseconds / 1e9;
+  JobResult *r;
+
+  for (size_t i = 0; i < b->jobs; i++) {
+    r = &b->results[i];
+    if (!r->done)
+      continue;
+    done++;
+    failed += r->failed;
+    bytes += r->bytes;
+    if (done == 1 || r->nanoseconds > b->results[slowest].nanoseconds)
+      slowest = i;
+  }
+
+  fprintf(out, "%zu jobs: %zu done, %zu failed, %zu not run\n", b->jobs,
+          done - failed, failed, b->jobs - done);
+  fprintf(out, "%llu bytes in %.3fs: %.1fMB/s, %.1f jobs/s\n",
+          (unsigned long long)bytes, seconds,
+          seconds > 0 ? (double)bytes / 1e6 / seconds : 0.0,
+          seconds > 0 ? (double)done / seconds : 0.0);
+
+  for (int w = 0; w < b->workers; w++) {
+    count = 0;
+    bytes = busy = 0;
+    for (size_t i = 0; i < b->jobs; i++) {
+      r = &b->results[i];
+      if (r->done && r->worker == w) {
+        count++;
+        bytes += r->bytes;
+        busy += r->nanoseconds;
+      }
+    }
+    fprintf(out,
+            "connection %d: %zu jobs, %zu stolen, %llu bytes, busy %.3fs\n", w,
+            count, b->queues[w].stolen, (unsigned long long)bytes,
+            (double)busy / 1e9);
+  }
+
+  if (done > 0)
+    fprintf(out, "slowest: %s, %.3fs\n", names[slowest],
+            (double)b->results[slowest].nanoseconds / 1e9);
+}
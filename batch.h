@@ -0,0 +1,44 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* What became of one job of a batch, written by the worker that ran it. */
+typedef struct JobResult_t {
+  uint64_t bytes;       /* Sent and received on the connection for it. */
+  uint64_t nanoseconds; /* From sending the request to the last reply. */
+  int worker;
+  bool done;
+  bool failed; /* The transfer failed, or its connection broke. */
+} JobResult;
+
+/* The jobs a worker still has to run: [head, tail) of the batch.  The
+   worker takes them from the head; others with nothing left steal from the
+   tail.  Each is on a cache line of its own, as every worker takes its
+   jobs from its own queue far more often than anyone steals from it. */
+typedef struct WorkQueue_t {
+  _Alignas(64) pthread_mutex_t lock;
+  size_t head;
+  size_t tail;
+  size_t stolen; /* Jobs this worker took from others. */
+} WorkQueue;
+
+/* A batch of jobs shared out between workers, in memory that the worker
+   processes, forked after it's set up, all share. */
+typedef struct Batch_t {
+  WorkQueue *queues;
+  JobResult *results;
+  int workers;
+  size_t jobs;
+  size_t size; /* Of the mapping. */
+} Batch;
+
+bool batch_init(Batch *, size_t, int);
+void batch_free(Batch *);
+ssize_t batch_take(Batch *, int);
+uint64_t socket_bytes(int);
+void batch_summary(Batch *, FILE *, char **, uint64_t);
@@ -0,0 +1,606 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "benchmark.h"
+#include "sftp.h"
+
+/* Benchmarks the server and client over loopback: GETs and PUTs of files
+   from 1KiB up to 4GiB, LISTs of large directories and connections that
+   only say hello and DONE.  Each benchmark prints a line of JSON with its
+   throughput, the median and 99th percentile time of one operation and the
+   system calls each side makes per operation.
+
+   The times come from the client's -t.  System calls are counted by running
+   the server and client again under ptrace, which slows them too much to
+   time them at the same time, once with the operations and once without, so
+   that starting up and connecting cancel out.
+ */
+
+Options options;
+
+static char server_path[PATH_MAX], client_path[PATH_MAX];
+/* Short enough to put a name after. */
+static char server_dir[PATH_MAX - 32], client_dir[PATH_MAX - 32];
+static char times_path[PATH_MAX - 32];
+static bool made_dir = false;
+static pid_t main_pid;
+
+/* Populate the options with default values. */
+void default_options(Options *opts) {
+  opts->port = BENCH_PORT;
+  opts->dir = NULL;
+  opts->max_size = 4LL * 1024 * 1024 * 1024;
+  opts->count = BENCH_COUNT;
+  opts->event_mode = false;
+  opts->uring = false;
+  opts->compress = false;
+  opts->checksum = true;
+}
+
+/* Print how to call the benchmark and exit. */
+void usage() {
+  fprintf(stderr,
+          "usage: %s [-esuz] [-d dir] [-m max-size] [-n count] [-p port]\n",
+          program_name);
+  exit(EXIT_FAILURE);
+}
+
+/* Fill in the options from the command line. */
+void parse_options(Options *opts, int argc, char *argv[]) {
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:em:n:p:suz")) != -1) {
+    switch (opt) {
+    case 'd':
+      opts->dir = optarg;
+      break;
+    case 'e':
+      opts->event_mode = true;
+      break;
+    case 'm':
+      if ((opts->max_size = parse_size(optarg)) <= 0)
+        usage();
+      break;
+    case 'n':
+      opts->count = atoi(optarg);
+      if (opts->count < 1)
+        usage();
+      break;
+    case 'p':
+      opts->port = optarg;
+      break;
+    case 's':
+      opts->checksum = false;
+      break;
+    case 'u':
+      opts->uring = true;
+      break;
+    case 'z':
+      opts->compress = true;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if (optind != argc)
+    usage();
+}
+
+/* A size in bytes, with an optional K, M or G after it.  Returns -1 if it
+   makes no sense. */
+off_t parse_size(char *arg) {
+  char *end;
+  long long size = strtoll(arg, &end, 10);
+
+  switch (*end) {
+  case 'G':
+    size *= 1024;
+    /* fall through */
+  case 'M':
+    size *= 1024;
+    /* fall through */
+  case 'K':
+    size *= 1024;
+    end++;
+    break;
+  }
+  return *end == '\0' && end != arg ? (off_t)size : -1;
+}
+
+static int remove_entry(const char *path,
+                        __attribute__((unused)) const struct stat *sb,
+                        __attribute__((unused)) int flag,
+                        __attribute__((unused)) struct FTW *ftw) {
+  return remove(path);
+}
+
+/* Remove the directory made for the benchmark, unless it's a child that's
+   exiting. */
+static void clean_up(void) {
+  if (made_dir && getpid() == main_pid)
+    nftw(dirname(server_dir), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/* Write a file of size bytes that won't compress. */
+void make_file(char *path, off_t size) {
+  static uint64_t state = 0x9e3779b97f4a7c15ULL;
+  uint64_t *block;
+  size_t want, done, i, block_size = 1024 * 1024;
+  ssize_t n;
+  int fd;
+
+  if ((block = malloc(block_size)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    log_error("couldn't create %s: %s", path, strerror(errno));
+
+  for (; size > 0; size -= (off_t)want) {
+    for (i = 0; i < block_size / sizeof *block; i++) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      block[i] = state;
+    }
+    want = size < (off_t)block_size ? (size_t)size : block_size;
+    for (done = 0; done < want; done += (size_t)n)
+      if ((n = write(fd, (char *)block + done, want - done)) < 0 &&
+          errno != EINTR)
+        log_error("couldn't write %s: %s", path, strerror(errno));
+      else if (n < 0)
+        n = 0;
+  }
+
+  close(fd);
+  free(block);
+}
+
+/* Make a directory holding entries empty files. */
+void make_directory(char *path, int entries) {
+  char name[PATH_MAX];
+  int fd;
+
+  if (mkdir(path, 0755) != 0 && errno != EEXIST)
+    log_error("couldn't create %s: %s", path, strerror(errno));
+  for (int i = 0; i < entries; i++) {
+    snprintf(name, sizeof name, "%s/entry%07d", path, i);
+    if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+      log_error("couldn't create %s: %s", name, strerror(errno));
+    close(fd);
+  }
+}
+
+/* Is there room on the disk for another size bytes? */
+bool have_room(off_t size) {
+  struct statvfs fs;
+
+  return statvfs(server_dir, &fs) == 0 &&
+         (off_t)(fs.f_bavail * fs.f_frsize) > size;
+}
+
+/* Start the server in its directory, in a process group of its own so that
+   its children can be killed with it.  If traced it's stopped at every
+   system call, as is every process it starts. */
+pid_t start_server(bool traced) {
+  char *argv[6];
+  int argc = 0, status, null_fd;
+  pid_t pid;
+
+  argv[argc++] = server_path;
+  argv[argc++] = "-p";
+  argv[argc++] = options.port;
+  if (options.event_mode)
+    argv[argc++] = "-e";
+  if (options.uring)
+    argv[argc++] = "-u";
+  argv[argc] = NULL;
+
+  if ((pid = fork()) < 0)
+    log_error("fork: %s", strerror(errno));
+
+  if (pid == 0) {
+    setpgid(0, 0);
+    if (chdir(server_dir) != 0 ||
+        (null_fd = open("/dev/null", O_RDWR)) < 0)
+      _exit(EXIT_FAILURE);
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    if (traced) {
+      ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+      raise(SIGSTOP);
+    }
+    execv(server_path, argv);
+    _exit(EXIT_FAILURE);
+  }
+
+  setpgid(pid, pid);
+  if (traced) {
+    if (waitpid(pid, &status, __WALL) != pid || !WIFSTOPPED(status))
+      log_error("couldn't trace the server");
+    ptrace(PTRACE_SETOPTIONS, pid, NULL,
+           PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+               PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+  }
+  return pid;
+}
+
+/* Kill the server and everything it started, and wait for them. */
+void stop_server(pid_t pid) {
+  kill(-pid, SIGKILL);
+  while (waitpid(-1, NULL, __WALL) > 0 || errno == EINTR)
+    ;
+}
+
+/* Wait until the server is listening, by connecting and hanging up. */
+void wait_for_server(void) {
+  struct sockaddr_in addr;
+  int sock_fd;
+
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t)atoi(options.port));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  for (int tries = 0; tries < 500; tries++) {
+    if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+      log_error("socket: %s", strerror(errno));
+    if (connect(sock_fd, (struct sockaddr *)&addr, sizeof addr) == 0) {
+      close(sock_fd);
+      return;
+    }
+    close(sock_fd);
+    usleep(10000);
+  }
+  log_error("server didn't start listening on port %s", options.port);
+}
+
+/* Start what drives a benchmark: the client given the benchmark's command
+   count times, or with no command for churn().  Either way it writes the
+   time each operation took to times_path. */
+pid_t start_driver(Bench *bench, int count, bool traced) {
+  char **argv;
+  int argc = 0, null_fd, times_fd;
+  pid_t pid;
+
+  if ((pid = fork()) < 0)
+    log_error("fork: %s", strerror(errno));
+  if (pid > 0)
+    return pid;
+
+  if (chdir(client_dir) != 0 || (null_fd = open("/dev/null", O_RDWR)) < 0 ||
+      (times_fd = open(times_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    _exit(EXIT_FAILURE);
+  wait_for_server();
+  dup2(null_fd, STDIN_FILENO);
+  dup2(null_fd, STDOUT_FILENO);
+  dup2(times_fd, STDERR_FILENO);
+  if (traced) {
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    raise(SIGSTOP);
+  }
+
+  if (bench->command == NULL) {
+    churn(count);
+    _exit(EXIT_SUCCESS);
+  }
+
+  if ((argv = calloc((size_t)count + 10, sizeof *argv)) == NULL)
+    _exit(EXIT_FAILURE);
+  argv[argc++] = client_path;
+  argv[argc++] = "-t";
+  argv[argc++] = "-p";
+  argv[argc++] = options.port;
+  if (!options.checksum)
+    argv[argc++] = "-s";
+  if (options.uring)
+    argv[argc++] = "-u";
+  if (options.compress)
+    argv[argc++] = "-z";
+  argv[argc++] = "localhost";
+  for (int i = 0; i < count; i++)
+    argv[argc++] = bench->command;
+  /* With no commands the client would read them from standard input. */
+  if (count == 0)
+    argv[argc++] = "done";
+  execv(client_path, argv);
+  _exit(EXIT_FAILURE);
+}
+
+/* Connect, agree on version 2 and say DONE, count times, as the client
+   would print them with -t. */
+void churn(int count) {
+  struct sockaddr_in addr;
+  struct timespec start, end;
+  Connection conn;
+  char *reply, buf[64];
+  int sock_fd;
+
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t)atoi(options.port));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  for (int i = 0; i < count; i++) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        connect(sock_fd, (struct sockaddr *)&addr, sizeof addr) != 0)
+      log_error("connect: %s", strerror(errno));
+    conn_init(&conn, sock_fd);
+    if (dzprintf(sock_fd, "HELLO %d", PROTOCOL_VERSION) < 0 ||
+        recv_message(&conn, &reply) < 0 ||
+        send_frame(sock_fd, OP_DONE, 0, 1, NULL, 0) < 0)
+      log_error("server hung up");
+    /* Wait for the server to hang up in turn. */
+    while (recv(sock_fd, buf, sizeof buf, 0) > 0)
+      ;
+    close(sock_fd);
+    conn_free(&conn);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    fprintf(stderr, "time\t%lld\tchurn\n",
+            (end.tv_sec - start.tv_sec) * 1000000LL +
+                (end.tv_nsec - start.tv_nsec) / 1000);
+  }
+}
+
+/* Run a benchmark count times against a new server and fill in what was
+   found.  Traced, the system calls of the client and of the server are
+   counted as they go.  Returns false if the client failed. */
+bool run(Bench *bench, int count, bool traced, Run *r) {
+  pid_t server, driver, pid;
+  int status, driver_status = 0, sig;
+  bool driver_done = false, driver_seen = false;
+
+  r->client_calls = r->server_calls = 0;
+  server = start_server(traced);
+  driver = start_driver(bench, count, traced);
+
+  while (!traced && waitpid(driver, &driver_status, 0) < 0 && errno == EINTR)
+    ;
+
+  /* Every stop of every traced process comes here, the server's included,
+     so nothing gets anywhere without this loop. */
+  while (traced && !driver_done) {
+    if ((pid = waitpid(-1, &status, __WALL)) < 0) {
+      if (errno == EINTR)
+        continue;
+      log_warn("waitpid: %s", strerror(errno));
+      break;
+    }
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      if (pid == driver) {
+        driver_done = true;
+        driver_status = status;
+      }
+      continue;
+    }
+    if (!WIFSTOPPED(status))
+      continue;
+
+    sig = WSTOPSIG(status);
+    if (sig == (SIGTRAP | 0x80)) {
+      /* Stops come on the way into a system call and out again. */
+      if (pid == driver)
+        r->client_calls++;
+      else
+        r->server_calls++;
+      sig = 0;
+    } else if (sig == SIGTRAP || sig == SIGSTOP) {
+      /* New processes, exec and fork all stop with one of these. */
+      if (pid == driver && !driver_seen) {
+        ptrace(PTRACE_SETOPTIONS, pid, NULL,
+               PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC |
+                   PTRACE_O_EXITKILL);
+        driver_seen = true;
+      }
+      sig = 0;
+    }
+    ptrace(PTRACE_SYSCALL, pid, NULL, sig);
+  }
+  r->client_calls /= 2;
+  r->server_calls /= 2;
+
+  stop_server(server);
+  if (!WIFEXITED(driver_status) || WEXITSTATUS(driver_status) != 0) {
+    log_warn("%s failed, see %s", bench->command ? bench->command : "churn",
+             times_path);
+    return false;
+  }
+  return read_times(r, count);
+}
+
+/* Read the times the driver printed.  Returns false if some are missing. */
+bool read_times(Run *r, int count) {
+  FILE *f;
+  char *line = NULL;
+  size_t len = 0;
+  long long usec;
+
+  r->count = 0;
+  if ((r->times = calloc((size_t)count + 1, sizeof *r->times)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  if ((f = fopen(times_path, "r")) == NULL)
+    log_error("couldn't read %s: %s", times_path, strerror(errno));
+
+  while (getline(&line, &len, f) > 0)
+    if (sscanf(line, "time\t%lld\t", &usec) == 1 && r->count < count)
+      r->times[r->count++] = usec;
+
+  free(line);
+  fclose(f);
+  if (r->count < count) {
+    log_warn("only %d of %d operations finished, see %s", r->count, count,
+             times_path);
+    return false;
+  }
+  return true;
+}
+
+int compare_times(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Run a benchmark, then again traced with fewer operations and with none,
+   and print what it found. */
+void benchmark(Bench *bench) {
+  Run timed, traced, base;
+  int traced_count = bench->count < BENCH_TRACE_COUNT ? bench->count
+                                                      : BENCH_TRACE_COUNT;
+  long long total = 0;
+  double seconds;
+  bool transfer = strcmp(bench->op, "get") == 0 || strcmp(bench->op, "put") == 0;
+
+  log_info("%s %lld, %d times", bench->op, (long long)bench->size,
+           bench->count);
+  timed.times = traced.times = base.times = NULL;
+  if (!run(bench, bench->count, false, &timed)) {
+    free(timed.times);
+    return;
+  }
+  if (!run(bench, traced_count, true, &traced) || !run(bench, 0, true, &base)) {
+    free(timed.times);
+    free(traced.times);
+    free(base.times);
+    return;
+  }
+
+  qsort(timed.times, (size_t)timed.count, sizeof *timed.times, compare_times);
+  for (int i = 0; i < timed.count; i++)
+    total += timed.times[i];
+  seconds = total > 0 ? total / 1e6 : 1e-6;
+
+  printf("{\"op\":\"%s\",\"size\":%lld,\"count\":%d,\"server\":\"%s\","
+         "\"uring\":%s,\"compress\":%s,\"checksum\":%s,",
+         bench->op, (long long)bench->size, bench->count,
+         options.event_mode ? "event" : "fork",
+         options.uring ? "true" : "false", options.compress ? "true" : "false",
+         options.checksum ? "true" : "false");
+  if (transfer)
+    printf("\"mb_per_s\":%.1f,",
+           (double)bench->size * timed.count / seconds / (1024 * 1024));
+  else
+    printf("\"mb_per_s\":null,");
+  printf("\"ops_per_s\":%.1f,\"p50_us\":%lld,\"p99_us\":%lld,"
+         "\"client_syscalls\":%.1f,\"server_syscalls\":%.1f}\n",
+         timed.count / seconds, timed.times[(timed.count - 1) / 2],
+         timed.times[(timed.count * 99 + 99) / 100 - 1],
+         (double)(traced.client_calls - base.client_calls) / traced_count,
+         (double)(traced.server_calls - base.server_calls) / traced_count);
+  fflush(stdout);
+
+  free(timed.times);
+  free(traced.times);
+  free(base.times);
+}
+
+int main(int argc, char *argv[]) {
+  static const off_t sizes[] = {1024,
+                                64 * 1024,
+                                1024 * 1024,
+                                64 * 1024 * 1024,
+                                1024 * 1024 * 1024,
+                                4LL * 1024 * 1024 * 1024};
+  static const int listings[] = {10000, 100000};
+  char self[PATH_MAX - 64], top[PATH_MAX - 64], command[2][64], name[PATH_MAX];
+  ssize_t len;
+  long long count;
+  Bench bench;
+
+  program_name = argv[0];
+  default_options(&options);
+  parse_options(&options, argc, argv);
+
+  /* The server and client are the ones built alongside. */
+  if ((len = readlink("/proc/self/exe", self, sizeof self - 1)) < 0)
+    log_error("couldn't find myself: %s", strerror(errno));
+  self[len] = '\0';
+  snprintf(server_path, sizeof server_path, "%s/server", dirname(self));
+  snprintf(client_path, sizeof client_path, "%s/client", self);
+
+  if (options.dir != NULL) {
+    snprintf(top, sizeof top, "%s", options.dir);
+  } else {
+    snprintf(top, sizeof top, "/tmp/bench.XXXXXX");
+    if (mkdtemp(top) == NULL)
+      log_error("couldn't make a directory: %s", strerror(errno));
+    made_dir = true;
+  }
+  snprintf(server_dir, sizeof server_dir, "%s/server", top);
+  snprintf(client_dir, sizeof client_dir, "%s/client", top);
+  snprintf(times_path, sizeof times_path, "%s/times", top);
+  if ((mkdir(server_dir, 0755) != 0 && errno != EEXIST) ||
+      (mkdir(client_dir, 0755) != 0 && errno != EEXIST))
+    log_error("couldn't make directories in %s: %s", top, strerror(errno));
+  main_pid = getpid();
+  atexit(clean_up);
+
+  for (size_t i = 0; i < sizeof sizes / sizeof *sizes; i++) {
+    if (sizes[i] > options.max_size)
+      break;
+    /* The server's copy, the client's and the one it puts back. */
+    if (!have_room(3 * sizes[i])) {
+      log_warn("not enough room for %lldB files, skipping them",
+               (long long)sizes[i]);
+      continue;
+    }
+
+    count = BENCH_BYTES / sizes[i];
+    count = count < BENCH_MIN_COUNT ? BENCH_MIN_COUNT : count;
+    count = count > options.count ? options.count : count;
+
+    snprintf(name, sizeof name, "%s/file%lld", server_dir, (long long)sizes[i]);
+    make_file(name, sizes[i]);
+    snprintf(command[0], sizeof command[0], "get file%lld", (long long)sizes[i]);
+    snprintf(command[1], sizeof command[1], "put file%lld copy%lld",
+             (long long)sizes[i], (long long)sizes[i]);
+
+    bench = (Bench){"get", sizes[i], (int)count, command[0]};
+    benchmark(&bench);
+    bench = (Bench){"put", sizes[i], (int)count, command[1]};
+    benchmark(&bench);
+
+    unlink(name);
+    snprintf(name, sizeof name, "%s/copy%lld", server_dir, (long long)sizes[i]);
+    unlink(name);
+    snprintf(name, sizeof name, "%s/file%lld", client_dir, (long long)sizes[i]);
+    unlink(name);
+  }
+
+  for (size_t i = 0; i < sizeof listings / sizeof *listings; i++) {
+    snprintf(name, sizeof name, "%s/list%d", server_dir, listings[i]);
+    make_directory(name, listings[i]);
+    snprintf(command[0], sizeof command[0], "list list%d", listings[i]);
+
+    count = 1000000 / listings[i];
+    count = count > options.count ? options.count : count;
+    bench = (Bench){"list", listings[i], (int)count, command[0]};
+    benchmark(&bench);
+  }
+
+  bench = (Bench){"churn", 0, options.count, NULL};
+  benchmark(&bench);
+
+  return EXIT_SUCCESS;
+}
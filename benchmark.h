@@ -0,0 +1,69 @@
+#pragma once
+#include "sftp.h"
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Port the benchmark's server listens on, away from a real one. */
+#define BENCH_PORT "49160"
+
+/* Most times each benchmark is run. */
+#define BENCH_COUNT 1000
+
+/* Bytes to move for each file size, which decides how many times smaller
+   files are fetched, though each is fetched at least BENCH_MIN_COUNT
+   times. */
+#define BENCH_BYTES (256LL * 1024 * 1024)
+#define BENCH_MIN_COUNT 3
+
+/* Most runs traced to count system calls, which are slow. */
+#define BENCH_TRACE_COUNT 16
+
+typedef struct Options_t {
+  char *port;
+  char *dir;
+  off_t max_size;
+  int count;
+  bool event_mode;
+  bool uring;
+  bool compress;
+  bool checksum;
+} Options;
+
+/* What one run of a benchmark found: the microseconds each operation took,
+   and the system calls made by the client and the server if traced. */
+typedef struct Run_t {
+  long long *times;
+  int count;
+  long client_calls;
+  long server_calls;
+} Run;
+
+/* A benchmark: count operations of one kind, each moving size bytes (or
+   listing size entries).  commands are given to the client, or if NULL the
+   benchmark itself connects and says DONE count times. */
+typedef struct Bench_t {
+  char *op;
+  off_t size;
+  int count;
+  char *command;
+} Bench;
+
+void default_options(Options *);
+void parse_options(Options *, int, char *[]);
+void usage(void);
+off_t parse_size(char *);
+
+void make_file(char *, off_t);
+void make_directory(char *, int);
+bool have_room(off_t);
+
+pid_t start_server(bool);
+void stop_server(pid_t);
+void wait_for_server(void);
+pid_t start_driver(Bench *, int, bool);
+void churn(int);
+bool run(Bench *, int, bool, Run *);
+bool read_times(Run *, int);
+
+void benchmark(Bench *);
+int compare_times(const void *, const void *);
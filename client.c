@@ -1,26 +1,161 @@
 #define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "batch.h"
 #include "client.h"
+#include "compress.h"
+#include "delta.h"
+#include "mget.h"
 #include "sftp.h"
+#include "stats.h"
+#include "trace.h"
+#include "transfer.h"
+#include "tree.h"
 
 /* Populate the options with default values. */
 void default_options(Options *opts) {
   opts->port = DEFAULT_PORT;
   opts->hostname = NULL;
+  opts->protocol = PROTOCOL_VERSION;
+  opts->assume_yes = false;
+  opts->depth = 1;
+  opts->connections = 1;
+  opts->resume = false;
+  opts->check = false;
+  opts->delta = false;
+  opts->compress = false;
+  opts->checksum = true;
+  opts->timing = false;
+  opts->trace_file = NULL;
+  opts->manifest = NULL;
+  opts->commands = NULL;
+  opts->command_count = 0;
+}
+
+/* Extra connections to the server for fetching large files in ranges,
+   opened the first time they're needed. */
+static Connection parallel[MAX_CONNECTIONS - 1];
+static int parallel_open = 0;
+
+/* Print how to call the client and exit. */
+void usage() {
+  fprintf(stderr, "usage: %s [-cdrstuvWyz] [-b manifest] [-j depth] [-n connections] [-p port] [-P protocol] [-S writeback-mb] [-T trace-file] hostname [command ...]\n", program_name);
+  exit(EXIT_FAILURE);
+}
+
+/* Fill in the options from the command line. */
+void parse_options(Options *opts, int argc, char *argv[]) {
+  unsigned long mb;
+  char *end;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:cdj:n:p:P:rsS:tT:uvWyz")) != -1) {
+    switch (opt) {
+    case 'b':
+      opts->manifest = optarg;
+      break;
+    case 'c':
+      opts->check = true;
+      break;
+    case 'd':
+      opts->delta = true;
+      break;
+    case 'r':
+      opts->resume = true;
+      break;
+    case 's':
+      opts->checksum = false;
+      break;
+    case 't':
+      opts->timing = true;
+      break;
+    case 'T':
+#ifdef SFTP_TRACE
+      opts->trace_file = optarg;
+#else
+      log_warn("built without tracing, ignoring -T");
+#endif
+      break;
+    case 'p':
+      opts->port = optarg;
+      break;
+    case 'n':
+      opts->connections = atoi(optarg);
+      if (opts->connections < 1 || opts->connections > MAX_CONNECTIONS)
+        usage();
+      break;
+    case 'j':
+      opts->depth = atoi(optarg);
+      if (opts->depth < 1)
+        usage();
+      break;
+    case 'v':
+      log_level = LEVEL_DEBUG;
+      break;
+    case 'y':
+      opts->assume_yes = true;
+      break;
+    case 'z':
+      if (can_compress)
+        opts->compress = true;
+      else
+        log_warn("built without zlib, ignoring -z");
+      break;
+    case 'u':
+#ifdef SFTP_URING
+      use_uring = true;
+#else
+      log_warn("built without io_uring support, ignoring -u");
+#endif
+      break;
+    case 'W':
+      write_behind = true;
+      break;
+    case 'S':
+      mb = strtoul(optarg, &end, 10);
+      if (*end != '\0' || *optarg == '\0')
+        usage();
+      writeback_step = (off_t)mb << 20;
+      write_behind = true;
+      break;
+    case 'P':
+      opts->protocol = atoi(optarg);
+      if (opts->protocol < 1 || opts->protocol > PROTOCOL_VERSION)
+        usage();
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if (optind >= argc)
+    usage();
+  opts->hostname = argv[optind];
+
+  /* Commands given after the hostname are run in turn instead of reading
+     any, and with no one there to answer there's nothing to ask. */
+  if (optind + 1 < argc) {
+    opts->commands = &argv[optind + 1];
+    opts->command_count = argc - optind - 1;
+    opts->assume_yes = true;
+  }
 }
 
 /* Get and connect to the first available socket, based on the hints given. */
@@ -66,32 +201,134 @@ int get_connect_socket(struct addrinfo *hints,
    proper.
  */
 int main(int argc, char *argv[]) {
-  int sock_fd;
-  struct addrinfo hints;
-  char s[INET6_ADDRSTRLEN];
+  Connection conn;
   int err;
 
   program_name = argv[0];
   default_options(&options);
+  parse_options(&options, argc, argv);
+  if (options.trace_file != NULL && !trace_open(options.trace_file))
+    log_error("couldn't start tracing: %s", strerror(errno));
 
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s hostname\n", program_name);
-    exit(EXIT_FAILURE);
+  open_connection(&conn, options.protocol);
+  log_debug("using protocol %d", conn.version);
+
+  if (options.depth > 1 && conn.version < 2) {
+    log_warn("protocol %d can't pipeline requests, ignoring -j",
+             conn.version);
+    options.depth = 1;
+  }
+  if (options.connections > 1 && conn.version < 2 &&
+      options.manifest == NULL) {
+    log_warn("protocol %d can't fetch ranges, ignoring -n", conn.version);
+    options.connections = 1;
+  }
+  if (options.resume && conn.version < 2) {
+    log_warn("protocol %d can't resume transfers, ignoring -r", conn.version);
+    options.resume = false;
+  }
+  if (options.delta && conn.version < 2) {
+    log_warn("protocol %d can't send deltas, ignoring -d", conn.version);
+    options.delta = false;
+  }
+  if (options.compress && conn.version < 2) {
+    log_warn("protocol %d can't compress transfers, ignoring -z",
+             conn.version);
+    options.compress = false;
+  }
+  if (options.timing && options.depth > 1) {
+    log_warn("pipelined requests can't be timed, ignoring -t");
+    options.timing = false;
+  }
+  if (options.delta && options.depth > 1) {
+    log_warn("delta PUTs can't be pipelined, ignoring -d");
+    options.delta = false;
+  }
+  if (options.manifest != NULL && options.depth > 1) {
+    log_warn("batches aren't pipelined, ignoring -j");
+    options.depth = 1;
   }
-  options.hostname = argv[1];
+  if (options.manifest != NULL)
+    err = client_batch(&conn);
+  else if (options.depth > 1)
+    err = client_pipelined(&conn, options.depth);
+  else
+    err = client(&conn);
+
+  close_parallel();
+  close(conn.fd);
+  conn_free(&conn);
+  return err;
+}
+
+/* Connect to the server and agree a protocol version no newer than the one
+   given. */
+void open_connection(Connection *conn, int version) {
+  struct addrinfo hints;
+  char s[INET6_ADDRSTRLEN];
+  int sock_fd;
 
   memset(&hints, 0, sizeof hints);
   hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
 
   sock_fd = get_connect_socket(&hints, s);
-
   log_info("connecting to %s", s);
 
-  err = client(sock_fd);
+  conn_init(conn, sock_fd);
+  if (version >= 2 && !negotiate(conn, version)) {
+    /* Servers that only speak version 1 hang up on a HELLO. */
+    log_info("server doesn't speak protocol %d, reconnecting", version);
+    close(sock_fd);
+    conn_free(conn);
+    sock_fd = get_connect_socket(&hints, s);
+    conn_init(conn, sock_fd);
+  }
+}
 
-  close(sock_fd);
-  return err;
+/* Ask the server to speak the given protocol version.  Returns false if the
+   server hung up, in which case the connection can't be used any more. */
+bool negotiate(Connection *conn, int version) {
+  char *reply = NULL;
+  int agreed;
+
+  if (dzprintf(conn->fd, "HELLO %d", version) < 0 ||
+      recv_message(conn, &reply) < 0)
+    return false;
+
+  if (sscanf(reply, "HELLO %d", &agreed) != 1 || agreed < 1 ||
+      agreed > version)
+    log_error("bad reply to HELLO: %s", reply);
+
+  conn->version = agreed;
+  return true;
+}
+
+/* Make sure the extra connections for fetching ranges are open.  Returns
+   false if the server won't speak version 2 on them. */
+bool open_parallel(void) {
+  while (parallel_open < options.connections - 1) {
+    open_connection(&parallel[parallel_open], PROTOCOL_VERSION);
+    if (parallel[parallel_open].version < 2) {
+      close(parallel[parallel_open].fd);
+      conn_free(&parallel[parallel_open]);
+      log_warn("couldn't open another version 2 connection");
+      return false;
+    }
+    parallel_open++;
+  }
+  return true;
+}
+
+/* Say goodbye on the extra connections and close them. */
+void close_parallel(void) {
+  while (parallel_open > 0) {
+    Connection *conn = &parallel[--parallel_open];
+
+    send_frame(conn->fd, OP_DONE, 0, ++conn->next_id, NULL, 0);
+    close(conn->fd);
+    conn_free(conn);
+  }
 }
 
 /* Test if a socket is still receiving okay */
@@ -105,62 +342,539 @@ bool socket_up(int socket) {
     return true;
 }
 
-/* Main client application communicating over a file descriptor fd.  Handle and
+/* Main client application communicating over the connection.  Handle and
    parse commands and run appropriate actions.
  */
-int client(int fd) {
+int client(Connection *conn) {
   Command c;
   ssize_t err;
-  char *input = NULL;
+  char *input = NULL, *line = NULL;
   size_t len = 0;
+  struct timespec start;
+  bool interactive = options.commands == NULL && isatty(STDIN_FILENO);
 
   while (true) {
-    printf("$ ");
-    err = getline(&input, &len, stdin);
+    if (interactive)
+      printf("$ ");
+    err = read_input(&input, &len);
     if (err <= 0) break;
     
     input = strip(input);
 
     if (!strcmp(input, ""))
       continue;
+    if (options.timing && (line = strdup(input)) == NULL)
+      log_error("couldn't allocate memory: %s", strerror(errno));
     if (!parse_command(input, &c)) {
       log_warn("couldn't parse input");
+      free(line);
+      line = NULL;
       continue;
     }
 
-    if (! socket_up(fd)) {
+    if (! socket_up(conn->fd)) {
       log_info("Connection closed");
       break;
     }
 
-    if (!do_command(fd, &c))
+    if (options.timing)
+      clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!do_command(conn, &c))
       break;
+    if (options.timing) {
+      print_time(line, &start);
+      free(line);
+      line = NULL;
+    }
 
-    if (! socket_up(fd)) {
+    if (! socket_up(conn->fd)) {
       log_info("Connection closed");
       break;
     }
   }
-  if (err < 0)
+  if (err < 0 && ferror(stdin))
     log_error("client input failed: %s", strerror(errno));
 
+  /* Running out of commands ends the session as done would. */
+  if (err <= 0 && socket_up(conn->fd))
+    do_done(conn, &c);
+
+  free(line);
   if (input != NULL)
     free(input);
 
   return EXIT_SUCCESS;
 }
 
-/* Handle the command passed by calling the appropriate do_ method. */
-bool do_command(int fd, Command *c) {
+/* Get the next command: the next one given on the command line if there
+   were any, or else a line of standard input.  Works as getline() does, and
+   returns -1 when there are no more. */
+ssize_t read_input(char **input, size_t *len) {
+  static int next = 0;
+  size_t size;
+
+  if (options.commands == NULL)
+    return getline(input, len, stdin);
+  if (next == options.command_count)
+    return -1;
+
+  size = strlen(options.commands[next]) + 1;
+  if (size > *len) {
+    if ((*input = realloc(*input, size)) == NULL)
+      log_error("couldn't allocate memory: %s", strerror(errno));
+    *len = size;
+  }
+  memcpy(*input, options.commands[next++], size);
+  return (ssize_t)size - 1;
+}
+
+/* With -t, say how long the command took, on a line of its own that a script
+   can pick out: "time", the microseconds and the command, split by tabs. */
+void print_time(char *command, struct timespec *start) {
+  struct timespec now;
+  long long usec;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  usec = (now.tv_sec - start->tv_sec) * 1000000LL +
+         (now.tv_nsec - start->tv_nsec) / 1000;
+  fprintf(stderr, "time\t%lld\t%s\n", usec, command);
+}
+
+/* Client that doesn't wait for each reply before sending the next request,
+   keeping up to depth requests in flight over the one connection.  Replies
+   are matched to their requests by id.  Nothing is confirmed: GETs are
+   written straight out and PUTs send their data along with the request.
+
+   The server answers requests in turn, so it may be busy sending us a file
+   while we try to send it one.  To keep either side from blocking on the
+   other, replies that carry data are all read before a PUT sends its file.
+ */
+int client_pipelined(Connection *conn, int depth) {
+  Command c;
+  Request *requests, *slot;
+  ssize_t err;
+  char *input = NULL;
+  size_t len = 0;
+
+  if ((requests = calloc((size_t)depth, sizeof *requests)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+
+  while (true) {
+    err = read_input(&input, &len);
+    if (err <= 0)
+      break;
+
+    input = strip(input);
+    if (!strcmp(input, ""))
+      continue;
+    if (!parse_command(input, &c)) {
+      log_warn("couldn't parse input");
+      continue;
+    }
+    if (c.type == DONE)
+      break;
+
+    /* Make room, and before a PUT drain everything that may send data. */
+    while ((slot = find_request(requests, depth, 0)) == NULL ||
+           (c.type == PUT && count_requests(requests, depth, true) > 0))
+      handle_reply(conn, requests, depth);
+
+    if (!start_request(conn, &c, slot))
+      break;
+  }
+  if (err < 0 && ferror(stdin))
+    log_warn("client input failed: %s", strerror(errno));
+
+  while (count_requests(requests, depth, false) > 0)
+    handle_reply(conn, requests, depth);
+
+  do_done(conn, &c);
+  free(requests);
+  free(input);
+  return EXIT_SUCCESS;
+}
+
+/* With -b, run the transfers listed in a manifest over a pool of -n
+   connections: this one, and one more for each worker process forked to
+   use them.  Whole files are moved on each, none split across them, and
+   nothing is confirmed.  A summary of how it went is printed at the end.
+   Returns EXIT_FAILURE if any job failed or was never run.
+ */
+int client_batch(Connection *conn) {
+  pid_t children[MAX_CONNECTIONS - 1];
+  struct timespec start, end;
+  Batch batch;
+  char **jobs = NULL;
+  size_t count, ok = 0;
+  int workers = options.connections, i, status;
+
+  count = read_manifest(options.manifest, &jobs);
+  if (count == 0) {
+    log_warn("no transfers in %s", options.manifest);
+    do_done(conn, NULL);
+    free(jobs);
+    return EXIT_SUCCESS;
+  }
+  if ((size_t)workers > count)
+    workers = (int)count;
+  options.connections = 1;
+  options.assume_yes = true;
+  if (!batch_init(&batch, count, workers))
+    log_error("couldn't map memory for the batch: %s", strerror(errno));
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  fflush(stdout);
+  for (i = 1; i < workers; i++) {
+    children[i - 1] = fork();
+    if (children[i - 1] == 0) {
+      transfer_forked();
+      close(conn->fd);
+      conn_free(conn);
+      open_connection(conn, options.protocol);
+      run_jobs(conn, &batch, i, jobs);
+      trace_flush();
+      log_flush();
+      _exit(EXIT_SUCCESS);
+    }
+    if (children[i - 1] < 0)
+      log_error("fork: %s", strerror(errno));
+  }
+
+  run_jobs(conn, &batch, 0, jobs);
+
+  for (i = 1; i < workers; i++) {
+    while (waitpid(children[i - 1], &status, 0) < 0)
+      if (errno != EINTR)
+        log_error("waitpid: %s", strerror(errno));
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+      log_warn("connection %d's worker failed", i);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  batch_summary(&batch, stdout, jobs,
+                (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 +
+                    (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec);
+  for (size_t j = 0; j < count; j++) {
+    ok += batch.results[j].done && !batch.results[j].failed;
+    free(jobs[j]);
+  }
+  free(jobs);
+  batch_free(&batch);
+  return ok == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Read the jobs of a batch from the manifest at path, or standard input if
+   it's "-": a get, put or mget command on each line, as it would be typed.
+   Blank lines and lines starting with # are skipped, and so is anything
+   that isn't a transfer.  Returns how many jobs there are, in jobs.
+ */
+size_t read_manifest(char *path, char ***jobs) {
+  FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  char *input = NULL, *line, *copy;
+  size_t len = 0, count = 0, size = 0, number = 0;
+  Command c;
+  bool transfer;
+
+  if (f == NULL)
+    log_error("couldn't open %s: %s", path, strerror(errno));
+
+  while (getline(&input, &len, f) > 0) {
+    number++;
+    line = strip(input);
+    if (*line == '\0' || *line == '#')
+      continue;
+
+    /* Parsing takes the line apart, so keep it whole for running later. */
+    if ((copy = strdup(line)) == NULL)
+      log_error("couldn't allocate memory: %s", strerror(errno));
+    transfer = parse_command(copy, &c) &&
+               (c.type == GET || c.type == PUT || c.type == MGET);
+    free(copy);
+    if (!transfer) {
+      log_warn("%s:%zu: not a transfer: %s", path, number, line);
+      continue;
+    }
+
+    if (count == size) {
+      size = size ? size * 2 : 64;
+      if ((*jobs = reallocarray(*jobs, size, sizeof **jobs)) == NULL)
+        log_error("couldn't allocate memory: %s", strerror(errno));
+    }
+    if (((*jobs)[count++] = strdup(line)) == NULL)
+      log_error("couldn't allocate memory: %s", strerror(errno));
+  }
+  if (ferror(f))
+    log_error("couldn't read %s: %s", path, strerror(errno));
+
+  if (f != stdin)
+    fclose(f);
+  free(input);
+  return count;
+}
+
+/* Run jobs of a batch as the given worker, until there are none left to it
+   or to steal, and record how each went.  A job fails if do_transfer() says
+   so or its connection breaks; then the next job gets a new connection.
+ */
+void run_jobs(Connection *conn, Batch *batch, int worker, char **jobs) {
+  struct timespec start, end;
+  JobResult *r;
+  Command c;
+  uint64_t before, after;
+  ssize_t job;
+  char *line;
+  bool ok, alive;
+
+  while ((job = batch_take(batch, worker)) >= 0) {
+    if (conn->fd < 0)
+      open_connection(conn, options.protocol);
+    if ((line = strdup(jobs[job])) == NULL)
+      log_error("couldn't allocate memory: %s", strerror(errno));
+    parse_command(line, &c);
+
+    before = socket_bytes(conn->fd);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ok = do_transfer(conn, &c);
+    alive = conn->fd >= 0 && socket_up(conn->fd);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    after = socket_bytes(conn->fd);
+
+    r = &batch->results[job];
+    r->bytes = after > before ? after - before : 0;
+    r->nanoseconds = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 +
+                     (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec;
+    r->worker = worker;
+    r->failed = !ok || !alive;
+    r->done = true;
+    free(line);
+
+    if (!alive && conn->fd >= 0) {
+      close(conn->fd);
+      conn_free(conn);
+      conn->fd = -1;
+    }
+    if (!alive)
+      log_warn("connection lost, reconnecting");
+  }
+
+  if (conn->fd >= 0)
+    do_done(conn, NULL);
+}
+
+/* Send the request for a command and fill in slot to await its reply.  A PUT
+   sends its whole file here.  Returns false if the connection has failed. */
+bool start_request(Connection *conn, Command *c, Request *slot) {
+  char *request = NULL;
+  size_t path_len;
+  uint64_t size;
+  int to_send = -1;
+  off_t sent;
+  struct stat fs;
+  bool ok = true;
+
+  memset(slot, 0, sizeof *slot);
+  slot->id = ++conn->next_id;
+  slot->type = c->type;
+  slot->flags = c->flags;
+
+  if (c->flags & FLAG_TREE) {
+    log_warn("rget and rput can't be pipelined");
+    goto done;
+  }
+
+  switch (c->type) {
+  case LIST:
+    slot->path = strdup(c->list.path);
+    if (send_frame(conn->fd, OP_LIST, c->flags, slot->id, c->list.path,
+                   strlen(c->list.path) + 1) < 0)
+      ok = false;
+    break;
+  case GET:
+    slot->path = strdup(c->get.path);
+    slot->local = strdup(c->get.into);
+    if (send_frame(conn->fd, OP_GET, data_flags(), slot->id, c->get.path,
+                   strlen(c->get.path) + 1) < 0)
+      ok = false;
+    break;
+  case PUT:
+    to_send = open(c->put.from, O_RDONLY);
+    if (to_send < 0 || fstat(to_send, &fs) != 0) {
+      log_warn("cannot put %s: %s", c->put.from, strerror(errno));
+      goto done;
+    }
+    slot->path = strdup(c->put.path);
+    slot->local = strdup(c->put.from);
+
+    path_len = strlen(c->put.path) + 1;
+    if ((request = malloc(sizeof size + path_len)) == NULL)
+      log_error("couldn't allocate memory: %s", strerror(errno));
+    size = htobe64((uint64_t)fs.st_size);
+    memcpy(request, &size, sizeof size);
+    memcpy(request + sizeof size, c->put.path, path_len);
+
+    if (send_frame(conn->fd, OP_PUT, FLAG_NOWAIT, slot->id, request,
+                   sizeof size + path_len) < 0 ||
+        send_header(conn->fd, OP_DATA, 0, slot->id, (uint64_t)fs.st_size,
+                    MSG_MORE) < 0) {
+      ok = false;
+      break;
+    }
+    advise_sequential(to_send, 0, fs.st_size);
+    sent = send_file(conn->fd, to_send, 0, fs.st_size);
+    if (sent != fs.st_size) {
+      log_warn("transfer failed after %lld/%lldB: %s", (long long)sent,
+               (long long)fs.st_size, strerror(errno));
+      ok = false;
+    }
+    break;
+  case STATS:
+    log_warn("stats can't be pipelined");
+    goto done;
+  case MGET:
+    log_warn("mget can't be pipelined");
+    goto done;
+  default:
+    log_warn("unrecognised command: %d", c->type);
+    goto done;
+  }
+
+  if (slot->path == NULL || (c->type != LIST && slot->local == NULL))
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  if (!ok)
+    log_warn("could not send request: %s", strerror(errno));
+  slot->active = ok;
+
+done:
+  if (!slot->active)
+    finish_request(slot);
+  free(request);
+  if (to_send >= 0)
+    close(to_send);
+  return ok;
+}
+
+/* Forget about a request once its reply is all in. */
+void finish_request(Request *r) {
+  free(r->path);
+  free(r->local);
+  memset(r, 0, sizeof *r);
+}
+
+/* The request in flight with the given id, or with id 0 a free slot. */
+Request *find_request(Request *requests, int depth, uint32_t id) {
+  for (int i = 0; i < depth; i++)
+    if (id == 0 ? !requests[i].active
+                : requests[i].active && requests[i].id == id)
+      return &requests[i];
+  return NULL;
+}
+
+/* How many requests are in flight, or with data_only how many of them will
+   get a reply carrying data: a listing or a file. */
+int count_requests(Request *requests, int depth, bool data_only) {
+  int n = 0;
+
+  for (int i = 0; i < depth; i++)
+    if (requests[i].active &&
+        (!data_only || requests[i].type == GET || requests[i].type == LIST))
+      n++;
+  return n;
+}
+
+/* Read the next reply from the server and act on it for whichever request it
+   answers. */
+void handle_reply(Connection *conn, Request *requests, int depth) {
+  Header header;
+  Request *r;
+  char *payload = NULL;
+  ssize_t len = 0;
+  off_t received;
+  int dest_fd;
+
+  if (recv_header(conn, &header) < 0)
+    log_error("could not receive response: %s", strerror(errno));
+  if (header.opcode != OP_DATA &&
+      (len = recv_payload(conn, &header, &payload)) < 0)
+    log_error("could not receive response: %s", strerror(errno));
+
+  if ((r = find_request(requests, depth, header.id)) == NULL)
+    log_error("reply 0x%x for unknown request %u", header.opcode, header.id);
+
+  switch (header.opcode) {
+  case OP_ENTRIES:
+    if (r->type != LIST)
+      break;
+    print_entries(payload, (size_t)len, r->flags);
+    return;
+  case OP_OK:
+    if (r->type == GET)
+      break;
+    if (r->type == PUT)
+      log_info("put %s completed", r->local);
+    finish_request(r);
+    return;
+  case OP_ERROR:
+    log_warn("%s: %s", r->path,
+             payload_string(&header, payload) ? payload : "request failed");
+    finish_request(r);
+    return;
+  case OP_DATA:
+    if (r->type != GET)
+      break;
+    dest_fd = open(r->local, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (dest_fd == -1) {
+      log_warn("couldn't open %s for getting: %s", r->local, strerror(errno));
+      received = recv_data(conn, &header, -1, 0);
+    } else {
+      received = recv_data(conn, &header, dest_fd, 0);
+      close(dest_fd);
+    }
+    if (received < 0 && errno == EBADMSG) {
+      log_warn("get %s failed: checksum mismatch", r->path);
+      finish_request(r);
+      return;
+    }
+    if (received != (off_t)header.length)
+      log_error("transfer failed after %lld/%lluB: %s", (long long)received,
+                (unsigned long long)header.length, strerror(errno));
+    if (dest_fd != -1)
+      log_info("get %s completed", r->path);
+    finish_request(r);
+    return;
+  }
+
+  log_error("unexpected reply 0x%x to request %u", header.opcode, header.id);
+}
+
+/* The flags asking for the data of a GET or PUT to be sent the way the
+   options say. */
+uint16_t data_flags(void) {
+  return (options.compress ? FLAG_COMPRESS : 0) |
+         (options.checksum ? FLAG_CHECKSUM : 0);
+}
+
+/* Handle the command passed by calling the appropriate do_ method.  Returns
+   false once the session is over. */
+bool do_command(Connection *conn, Command *c) {
   switch (c->type) {
   case DONE:
-    return do_done(fd, c);
+    return do_done(conn, c);
   case LIST:
-    return do_list(fd, c);
+    return conn->version >= 2 ? do_list_v2(conn, c) : do_list(conn, c);
   case GET:
-    return do_get(fd, c);
   case PUT:
-    return do_put(fd, c);
+  case MGET:
+    do_transfer(conn, c);
+    return true;
+  case STATS:
+    if (conn->version < 2) {
+      log_warn("protocol %d can't ask for the server's counters",
+               conn->version);
+      return true;
+    }
+    return do_stats_v2(conn, c);
+  case HELLO:
+  case STAT:
   case ERROR:
     log_warn("unrecognised command: %d", c->type);
   }
@@ -168,19 +882,78 @@ bool do_command(int fd, Command *c) {
   return true;
 }
 
-bool do_done(int fd, __attribute__((unused)) Command *c) {
-  dzprintf(fd, "DONE");
+/* Run a GET, PUT or MGET with the do_ method for it and the options.  The
+   do_ methods for transfers, unlike the others, return whether the transfer
+   succeeded; one that breaks the connection gives up with transfer_lost().
+   Returns that. */
+bool do_transfer(Connection *conn, Command *c) {
+  if (c->type == MGET) {
+    if (conn->version < 2) {
+      log_warn("protocol %d can't fetch many files at once", conn->version);
+      return false;
+    }
+    return do_mget_v2(conn, c);
+  }
+
+  if ((c->flags & FLAG_TREE) && conn->version < 2) {
+    log_warn("protocol %d can't move whole trees", conn->version);
+    return false;
+  }
+  if (c->flags & FLAG_TREE)
+    return c->type == GET ? do_get_tree(conn, c) : do_put_tree(conn, c);
+  if (c->type == GET && conn->version < 2)
+    return do_get(conn, c);
+  if (c->type == GET)
+    return options.resume ? do_get_resume(conn, c) : do_get_v2(conn, c);
+  if (conn->version < 2)
+    return do_put(conn, c);
+  if (options.delta)
+    return do_put_delta(conn, c);
+  return options.resume ? do_put_resume(conn, c) : do_put_v2(conn, c);
+}
+
+/* Give up on a transfer that has lost its connection, or can no longer tell
+   where it's up to on it, saying why.  On its own that's the end of the
+   session, and this exits.  In a batch it's one job failed: the connection
+   is closed, for run_jobs() to start another, and this returns false.
+ */
+bool transfer_lost(Connection *conn, char *message, ...) {
+  char text[LOG_TEXT];
+  va_list argp;
+
+  va_start(argp, message);
+  vsnprintf(text, sizeof text, message, argp);
+  va_end(argp);
+  if (options.manifest == NULL)
+    log_error("%s", text);
+
+  log_warn("%s", text);
+  if (conn->fd >= 0) {
+    close(conn->fd);
+    conn_free(conn);
+    conn->fd = -1;
+  }
+  return false;
+}
+
+bool do_done(Connection *conn, __attribute__((unused)) Command *c) {
+  if (conn->version >= 2)
+    send_frame(conn->fd, OP_DONE, 0, ++conn->next_id, NULL, 0);
+  else
+    dzprintf(conn->fd, "DONE");
   return false;
 }
 
-bool do_list(int fd, Command *c) {
+bool do_list(Connection *conn, Command *c) {
   char *buffer = NULL;
   ssize_t len;
   unsigned int lines;
 
-  dzprintf(fd, "LIST %s", c->list.path);
+  dzprintf(conn->fd, "LIST %s", c->list.path);
 
-  len = recv_all(fd, &buffer);
+  len = recv_message(conn, &buffer);
+  if (len < 0)
+    log_error("could not receive response: %s", strerror(errno));
   if (!strncmp(buffer, "ERROR", 5)) {
     log_warn("%s", buffer + 6);
     goto done;
@@ -188,10 +961,9 @@ bool do_list(int fd, Command *c) {
 
   sscanf(buffer, "%u", &lines);
   while (lines--) {
-    len = recv_all(fd, &buffer);
+    len = recv_message(conn, &buffer);
     if (len < 0)
       log_error("could not receive response: %s", strerror(errno));
-    buffer[len] = '\0';
 
     printf("%s\n", buffer);
   }
@@ -200,37 +972,42 @@ done:
   return true;
 }
 
-bool do_get(int fd, Command *c) {
+bool do_get(Connection *conn, Command *c) {
   char *msg = NULL;
+  char *prompt = NULL;
   char *dest = NULL;
   int dest_fd;
   int err;
-  bool ok;
+  bool ok, completed = false;
   ssize_t len;
-  ssize_t received;
-  ssize_t written;
-  ssize_t n;
-  ssize_t want;
-  ssize_t remaining;
-  char buf[MAXDATASIZE];
+  off_t received;
 
   log_debug("get %s %s", c->get.path, c->get.into);
 
-  dzprintf(fd, "GET %s", c->get.path);
+  dzprintf(conn->fd, "GET %s", c->get.path);
 
-  recv_all(fd, &msg);
+  if (recv_message(conn, &msg) < 0) {
+    transfer_lost(conn, "could not receive response: %s", strerror(errno));
+    goto done;
+  }
+  if (!strncmp(msg, "ERROR", 5)) {
+    log_warn("%s", msg + 6);
+    goto done;
+  }
   sscanf(msg, "%zd", &len);
-  free(msg);
-  msg = NULL;
 
-  err = asprintf(&msg, "Okay to receive %luB?", len);
-  if (err == -1) log_error("memory allocation failed: asprintf");
-  ok = y_or_n_p(msg);
-  free(msg);
-  msg = NULL;
+  if (options.assume_yes) {
+    ok = true;
+  } else {
+    err = asprintf(&prompt, "Okay to receive %luB?", len);
+    if (err == -1) log_error("memory allocation failed: asprintf");
+    ok = y_or_n_p(prompt);
+    free(prompt);
+    prompt = NULL;
+  }
 
   if (!ok) {
-    dzprintf(fd, "NO");
+    dzprintf(conn->fd, "NO");
     goto done;
   }
 
@@ -238,48 +1015,36 @@ bool do_get(int fd, Command *c) {
   dest_fd = open(dest, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
   if (dest_fd == -1) {
     log_warn("couldn't open file for getting: %s", strerror(errno));
-    dzprintf(fd, "NO");
+    dzprintf(conn->fd, "NO");
     goto done;
   }
 
   log_info("starting the transfer of %uB to %s", len, dest);
-  dzprintf(fd, "OK");
-
-  received = 0;
-  while (received < len) {
-    remaining = len - received;
-    want = (MAXDATASIZE < remaining) ? MAXDATASIZE : remaining;
-    n = recv(fd, &buf, (size_t)want, MSG_WAITALL);
-
-    if (n < 0)
-      log_error("error receiving file: %s", strerror(errno));
-    if (n == 0)
-      log_error("connection with server ended abruptly");
-
-    received += n;
+  dzprintf(conn->fd, "OK");
 
-    written = write(dest_fd, buf, (size_t)want);
-    if (written < 0)
-      log_error("write failed: %s", strerror(errno));
-
-    if (written != want)
-      log_warn("tried to write %uB but only wrote %uB", want, written);
+  received = recv_file(conn, dest_fd, 0, len);
+  close(dest_fd);
+  if (received != len) {
+    transfer_lost(conn, "transfer failed after %lld/%lldB: %s",
+                  (long long)received, (long long)len, strerror(errno));
+    goto done;
   }
   log_info("transfer completed");
+  completed = true;
 
 done:
-  return true;
+  return completed;
 }
 
-bool do_put(int fd, Command *c) {
+bool do_put(Connection *conn, Command *c) {
   log_debug("put %s %s", c->put.from, c->put.path);
 
   char *msg = NULL;
-  char buf[MAXDATASIZE];
   int err;
   int to_send = -1;
+  bool completed = false;
   off_t len;
-  ssize_t n, sent, chunk_sent, chunk_read;
+  off_t sent;
   struct stat fs;
 
   err = stat(c->put.from, &fs);
@@ -297,54 +1062,877 @@ bool do_put(int fd, Command *c) {
   }
   log_debug("opened file for sending");
 
-  dzprintf(fd, "PUT %s", c->put.path);
+  dzprintf(conn->fd, "PUT %s", c->put.path);
 
-  recv_all(fd, &msg);
+  if (recv_message(conn, &msg) < 0) {
+    transfer_lost(conn, "could not receive response: %s", strerror(errno));
+    goto done;
+  }
   if (strcmp(msg, "OK") != 0) {
     log_warn("put refused: %s", msg);
     goto done;
   }
-  free(msg);
-  msg = NULL;
   log_debug("server accepted send in principle");
 
   len = fs.st_size;
-  dzprintf(fd, "%lld", len);
+  dzprintf(conn->fd, "%lld", len);
   log_debug("sent file length: %lld", len);
 
-  recv_all(fd, &msg);
+  if (recv_message(conn, &msg) < 0) {
+    transfer_lost(conn, "could not receive response: %s", strerror(errno));
+    goto done;
+  }
   if (strcmp(msg, "OK") != 0) {
     log_warn("put refused: %s", msg);
     goto done;
   }
-  free(msg);
-  msg = NULL;
 
   log_info("sending %uB", len);
 
-  sent = 0;
-  while (sent < len) {
-    chunk_read = read(to_send, &buf, MAXDATASIZE);
-    chunk_sent = 0;
-    log_debug("read %lldB", chunk_read);
-    while (chunk_sent < chunk_read) {
-      n = send(fd, buf + chunk_sent, (size_t)(chunk_read - chunk_sent), 0);
-      log_debug("sent %lld", n);
-      sent += n;
-      chunk_sent += n;
-    }
-    log_debug("sent %u/%uB", sent, len);
+  advise_sequential(to_send, 0, len);
+  sent = send_file(conn->fd, to_send, 0, len);
+  if (sent != len) {
+    transfer_lost(conn, "transfer failed after %lld/%lldB: %s",
+                  (long long)sent, (long long)len, strerror(errno));
+    goto done;
   }
   log_info("transfer completed");
+  completed = true;
 
 done:
-  if (msg != NULL)
-    free(msg);
   if (to_send > 0)
     close(to_send);
+  return completed;
+}
+
+/* Version 2 LIST: print the entries from each ENTRIES frame until the OK. */
+bool do_list_v2(Connection *conn, Command *c) {
+  Header header;
+  char *payload;
+  ssize_t len;
+  uint32_t id = ++conn->next_id;
+  uint64_t started = trace_start();
+
+  if (send_frame(conn->fd, OP_LIST, c->flags, id, c->list.path,
+                 strlen(c->list.path) + 1) < 0)
+    log_error("could not send request: %s", strerror(errno));
+
+  while (true) {
+    if ((len = recv_frame(conn, &header, &payload)) < 0)
+      log_error("could not receive response: %s", strerror(errno));
+
+    switch (header.opcode) {
+    case OP_ENTRIES:
+      print_entries(payload, (size_t)len, c->flags);
+      break;
+    case OP_OK:
+      trace_end(TRACE_LIST, id, 0, started);
+      return true;
+    case OP_ERROR:
+      log_warn("%s", payload_string(&header, payload) ? payload : "LIST failed");
+      return true;
+    default:
+      log_error("unexpected reply to LIST: 0x%x", header.opcode);
+    }
+  }
+}
+
+/* Print the entries packed in an ENTRIES payload, one per line.  With
+   FLAG_STAT each has its type, size and mtime in front, which go in front of
+   the name as ls -l would put them. */
+void print_entries(char *payload, size_t len, uint16_t flags) {
+  size_t fixed = flags & FLAG_STAT ? LIST_STAT_FIXED : 0;
+  char *p = payload, *name, when[32];
+  uint64_t size, mtime;
+  struct tm tm;
+  time_t secs;
+
+  while (p + fixed < payload + len) {
+    name = p + fixed;
+    if (memchr(name, '\0', (size_t)(payload + len - name)) == NULL) {
+      log_warn("ENTRIES payload is cut short");
+      return;
+    }
+
+    if (fixed == 0) {
+      printf("%s\n", name);
+    } else {
+      memcpy(&size, p + 1, 8);
+      memcpy(&mtime, p + 9, 8);
+      secs = (time_t)(be64toh(mtime) / 1000000000);
+      if (localtime_r(&secs, &tm) == NULL ||
+          strftime(when, sizeof when, "%Y-%m-%d %H:%M", &tm) == 0)
+        strcpy(when, "?");
+      printf("%c %12llu %s %s\n", p[0], (unsigned long long)be64toh(size),
+             when, name);
+    }
+    p = name + strlen(name) + 1;
+  }
+}
+
+/* Version 2 GET: ask for the size first so the user can confirm, then write
+   out the DATA frame that follows.  With -y there's nobody to ask, so the
+   server sends the DATA frame straight away, unless we need the size to split
+   a large file across several connections. */
+bool do_get_v2(Connection *conn, Command *c) {
+  Header header;
+  char *payload;
+  char *prompt = NULL;
+  uint64_t size;
+  uint32_t id = ++conn->next_id;
+  uint16_t flags =
+      (options.assume_yes && options.connections == 1 ? 0 : FLAG_CONFIRM) |
+      data_flags();
+  int dest_fd = -1;
+  off_t received;
+  bool ok;
+  uint64_t started = trace_start(), phase;
+
+  log_debug("get %s %s", c->get.path, c->get.into);
+
+  if (send_frame(conn->fd, OP_GET, flags, id, c->get.path,
+                 strlen(c->get.path) + 1) < 0)
+    return transfer_lost(conn, "could not send request: %s", strerror(errno));
+
+  phase = trace_start();
+  if (recv_header(conn, &header) < 0)
+    return transfer_lost(conn, "could not receive response: %s",
+                         strerror(errno));
+  trace_end(TRACE_HANDSHAKE, id, 0, phase);
+  if (header.opcode != OP_DATA &&
+      recv_payload(conn, &header, &payload) < 0)
+    return transfer_lost(conn, "could not receive response: %s",
+                         strerror(errno));
+  if (header.opcode == OP_ERROR) {
+    log_warn("%s", payload_string(&header, payload) ? payload : "GET failed");
+    return false;
+  }
+
+  if (flags & FLAG_CONFIRM) {
+    if (header.opcode != OP_SIZE || header.length != sizeof size)
+      return transfer_lost(conn, "unexpected reply to GET: 0x%x",
+                           header.opcode);
+    memcpy(&size, payload, sizeof size);
+    size = be64toh(size);
+
+    ok = true;
+    if (!options.assume_yes) {
+      if (asprintf(&prompt, "Okay to receive %lluB?",
+                   (unsigned long long)size) == -1)
+        log_error("memory allocation failed: asprintf");
+      ok = y_or_n_p(prompt);
+      free(prompt);
+      prompt = NULL;
+    }
+
+    if (ok) {
+      phase = trace_start();
+      dest_fd =
+          open(c->get.into, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR);
+      trace_end(TRACE_OPEN, id, 0, phase);
+      if (dest_fd == -1)
+        log_warn("couldn't open file for getting: %s", strerror(errno));
+    }
+    if (dest_fd == -1) {
+      send_frame(conn->fd, OP_NO, 0, id, NULL, 0);
+      return false;
+    }
+
+    if (options.connections > 1 && size >= PARALLEL_MIN && open_parallel()) {
+      /* Turn down the whole file and fetch it in ranges instead. */
+      if (send_frame(conn->fd, OP_NO, 0, id, NULL, 0) < 0) {
+        close(dest_fd);
+        return transfer_lost(conn, "could not send request: %s",
+                             strerror(errno));
+      }
+      log_info("starting the transfer of %lluB to %s over %d connections",
+               (unsigned long long)size, c->get.into, parallel_open + 1);
+      received = get_ranges(conn, c->get.path, dest_fd, (off_t)size);
+      close(dest_fd);
+      if (received != (off_t)size)
+        log_warn("transfer of %s failed", c->get.into);
+      else
+        log_info("transfer completed");
+      trace_end(TRACE_GET, id, received > 0 ? (uint64_t)received : 0,
+                started);
+      return received == (off_t)size;
+    }
+
+    log_info("starting the transfer of %lluB to %s", (unsigned long long)size,
+             c->get.into);
+    phase = trace_start();
+    if (send_frame(conn->fd, OP_OK, 0, id, NULL, 0) < 0 ||
+        recv_header(conn, &header) < 0) {
+      close(dest_fd);
+      return transfer_lost(conn, "could not receive response: %s",
+                           strerror(errno));
+    }
+    trace_end(TRACE_HANDSHAKE, id, 0, phase);
+  } else {
+    phase = trace_start();
+    dest_fd = open(c->get.into, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR);
+    trace_end(TRACE_OPEN, id, 0, phase);
+    if (dest_fd == -1)
+      log_warn("couldn't open file for getting: %s", strerror(errno));
+  }
+  if (header.opcode != OP_DATA) {
+    if (dest_fd >= 0)
+      close(dest_fd);
+    return transfer_lost(conn, "unexpected reply to GET: 0x%x",
+                         header.opcode);
+  }
+
+  if (dest_fd == -1) {
+    if (recv_data(conn, &header, -1, 0) != (off_t)header.length)
+      return transfer_lost(conn, "could not receive response: %s",
+                           strerror(errno));
+    return false;
+  }
+
+  received = recv_data(conn, &header, dest_fd, 0);
+  phase = trace_start();
+  close(dest_fd);
+  trace_end(TRACE_CLOSE, id, 0, phase);
+  if (received < 0 && errno == EBADMSG) {
+    log_warn("transfer failed: checksum mismatch");
+    return false;
+  }
+  if (received != (off_t)header.length)
+    return transfer_lost(conn, "transfer failed after %lld/%lluB: %s",
+                         (long long)received,
+                         (unsigned long long)header.length, strerror(errno));
+  log_info("transfer completed");
+  trace_end(TRACE_GET, id, (uint64_t)received, started);
+
+  return true;
+}
+
+/* GET that carries on from however much of the file we already have.  The
+   file is stamped with the server's mtime, so with -c we can tell next time
+   whether what we have is the start of the same file; if not, or if it's
+   longer than the server's, we start again from the beginning.
+ */
+bool do_get_resume(Connection *conn, Command *c) {
+  struct stat fs;
+  char *prompt = NULL;
+  off_t size, offset;
+  int64_t mtime;
+  int dest_fd;
+  bool ok = true, completed = false;
+
+  log_debug("get %s %s, resuming", c->get.path, c->get.into);
+
+  if (!remote_attrs(conn, c->get.path, &size, &mtime))
+    return false;
+
+  dest_fd = open(c->get.into, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  if (dest_fd == -1 || fstat(dest_fd, &fs) != 0) {
+    log_warn("couldn't open file for getting: %s", strerror(errno));
+    goto done;
+  }
+
+  offset = fs.st_size;
+  if (offset > size || (options.check && mtime_ns(&fs) != mtime)) {
+    log_info("%s has changed, starting again", c->get.into);
+    offset = 0;
+  }
+
+  if (!options.assume_yes) {
+    if (asprintf(&prompt, "Okay to receive %lldB of %lldB?",
+                 (long long)(size - offset), (long long)size) == -1)
+      log_error("memory allocation failed: asprintf");
+    ok = y_or_n_p(prompt);
+    free(prompt);
+  }
+  if (!ok)
+    goto done;
+
+  /* Anything past the offset is either there already or can't be trusted. */
+  if (ftruncate(dest_fd, offset) != 0) {
+    log_warn("couldn't truncate %s: %s", c->get.into, strerror(errno));
+    goto done;
+  }
+  set_mtime(dest_fd, mtime);
+
+  log_info("starting the transfer of %lldB from %lld to %s",
+           (long long)(size - offset), (long long)offset, c->get.into);
+  ok = offset == size || fetch_range(conn, ++conn->next_id, c->get.path,
+                                     dest_fd, offset, size - offset);
+  set_mtime(dest_fd, mtime);
+  if (!ok) {
+    transfer_lost(conn, "transfer failed, GET again with -r to resume");
+    goto done;
+  }
+  log_info("transfer completed");
+  completed = true;
+
+done:
+  if (dest_fd >= 0)
+    close(dest_fd);
+  return completed;
+}
+
+/* PUT that carries on from however much of the file the server already has,
+   with the same checks as do_get_resume() the other way round: the server
+   stamps its copy with our file's mtime.
+ */
+bool do_put_resume(Connection *conn, Command *c) {
+  Header header;
+  char *payload;
+  char *request = NULL;
+  size_t path_len = strlen(c->put.path) + 1;
+  uint64_t resume[3];
+  off_t size, offset, sent;
+  int64_t mtime;
+  int to_send = -1;
+  bool completed = false;
+  uint32_t id;
+  struct stat fs;
+
+  log_debug("put %s %s, resuming", c->put.from, c->put.path);
+
+  to_send = open(c->put.from, O_RDONLY);
+  if (to_send < 0 || fstat(to_send, &fs) != 0) {
+    log_warn("cannot put %s: %s", c->put.from, strerror(errno));
+    goto done;
+  }
+
+  /* If the server hasn't got the file at all we start from the beginning. */
+  offset = 0;
+  if (remote_attrs(conn, c->put.path, &size, &mtime)) {
+    offset = size;
+    if (offset > fs.st_size || (options.check && mtime != mtime_ns(&fs))) {
+      log_info("%s has changed, starting again", c->put.path);
+      offset = 0;
+    }
+  }
+
+  if ((request = malloc(sizeof resume + path_len)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  resume[0] = htobe64((uint64_t)fs.st_size);
+  resume[1] = htobe64((uint64_t)offset);
+  resume[2] = htobe64((uint64_t)mtime_ns(&fs));
+  memcpy(request, resume, sizeof resume);
+  memcpy(request + sizeof resume, c->put.path, path_len);
+
+  id = ++conn->next_id;
+  if (send_frame(conn->fd, OP_PUT, FLAG_RESUME | data_flags(), id, request,
+                 sizeof resume + path_len) < 0) {
+    transfer_lost(conn, "could not send request: %s", strerror(errno));
+    goto done;
+  }
+  if (recv_frame(conn, &header, &payload) < 0) {
+    transfer_lost(conn, "could not receive response: %s", strerror(errno));
+    goto done;
+  }
+  if (header.opcode != OP_OK) {
+    log_warn("put refused: %s",
+             payload_string(&header, payload) ? payload : "unknown reason");
+    goto done;
+  }
+
+  log_info("sending %lldB from %lld", (long long)(fs.st_size - offset),
+           (long long)offset);
+  sent = send_data(conn->fd, id, header.flags, to_send, offset,
+                   fs.st_size - offset);
+  if (sent < 0) {
+    transfer_lost(conn, "could not send file: %s", strerror(errno));
+    goto done;
+  }
+  if (sent != fs.st_size - offset) {
+    transfer_lost(conn,
+                  "transfer failed after %lld/%lldB, PUT again with -r to "
+                  "resume",
+                  (long long)(offset + sent), (long long)fs.st_size);
+    goto done;
+  }
+
+  if (recv_frame(conn, &header, &payload) < 0) {
+    transfer_lost(conn, "could not receive response: %s", strerror(errno));
+    goto done;
+  }
+  completed = header.opcode == OP_OK;
+  if (!completed)
+    log_warn("put failed: %s",
+             payload_string(&header, payload) ? payload : "unknown reason");
+  else
+    log_info("transfer completed");
+
+done:
+  free(request);
+  if (to_send >= 0)
+    close(to_send);
+  return completed;
+}
+
+/* MGET: fetch every file the patterns match on the server in one request,
+   each saved under its name here as it streams in. */
+bool do_mget_v2(Connection *conn, Command *c) {
+  Header end;
+  char *payload;
+  ssize_t count, failed;
+  uint32_t id = ++conn->next_id;
+
+  log_debug("mget %s", c->mget.patterns);
+
+  if (c->mget.length > DEFAULT_MAX_MESSAGE) {
+    log_warn("too many patterns for one MGET");
+    return false;
+  }
+  if (send_frame(conn->fd, OP_MGET, 0, id, c->mget.patterns,
+                 c->mget.length) < 0)
+    return transfer_lost(conn, "could not send request: %s", strerror(errno));
+
+  count = recv_mget(conn, &end, &payload, &failed);
+  if (count < 0)
+    return transfer_lost(conn, "transfer failed: %s", strerror(errno));
+  if (end.opcode == OP_ERROR)
+    log_warn("%s", payload_string(&end, payload) ? payload : "MGET failed");
+  else if (end.opcode != OP_OK)
+    return transfer_lost(conn, "unexpected reply to MGET: 0x%x", end.opcode);
+  else if (failed > 0)
+    log_warn("received %zd files, %zd couldn't be had", count, failed);
+  else
+    log_info("received %zd files", count);
+
+  return end.opcode == OP_OK && failed == 0;
+}
+
+/* GET a whole directory tree, recreating it under the local path as its
+   entries stream in. */
+bool do_get_tree(Connection *conn, Command *c) {
+  Header end;
+  char *payload;
+  ssize_t failed;
+  int root_fd;
+  uint32_t id = ++conn->next_id;
+
+  log_debug("rget %s %s", c->get.path, c->get.into);
+
+  if ((root_fd = tree_mkroot(c->get.into)) < 0) {
+    log_warn("couldn't make %s: %s", c->get.into, strerror(errno));
+    return false;
+  }
+
+  if (send_frame(conn->fd, OP_GET, FLAG_TREE, id, c->get.path,
+                 strlen(c->get.path) + 1) < 0) {
+    close(root_fd);
+    return transfer_lost(conn, "could not send request: %s", strerror(errno));
+  }
+
+  failed = recv_tree(conn, root_fd, &end, &payload);
+  close(root_fd);
+  if (failed < 0)
+    return transfer_lost(conn, "transfer failed: %s", strerror(errno));
+  if (end.opcode == OP_ERROR)
+    log_warn("%s", payload_string(&end, payload) ? payload : "GET failed");
+  else if (end.opcode != OP_OK)
+    return transfer_lost(conn, "unexpected reply to GET: 0x%x", end.opcode);
+  else if (failed > 0)
+    log_warn("%zd entries couldn't be written", failed);
+  else
+    log_info("transfer completed");
+
+  return end.opcode == OP_OK && failed == 0;
+}
+
+/* PUT a whole directory tree: once the server has made the directory, stream
+   every file and directory under ours and end with OK. */
+bool do_put_tree(Connection *conn, Command *c) {
+  TreeWalk walk;
+  Header header;
+  char *payload;
+  ssize_t count;
+  uint32_t id = ++conn->next_id;
+
+  log_debug("rput %s %s", c->put.from, c->put.path);
+
+  if (!tree_open(&walk, c->put.from)) {
+    log_warn("cannot put %s: %s", c->put.from, strerror(errno));
+    return false;
+  }
+
+  if (send_frame(conn->fd, OP_PUT, FLAG_TREE, id, c->put.path,
+                 strlen(c->put.path) + 1) < 0) {
+    tree_close(&walk);
+    return transfer_lost(conn, "could not send request: %s", strerror(errno));
+  }
+  if (recv_frame(conn, &header, &payload) < 0) {
+    tree_close(&walk);
+    return transfer_lost(conn, "could not receive response: %s",
+                         strerror(errno));
+  }
+  if (header.opcode != OP_OK) {
+    log_warn("put refused: %s",
+             payload_string(&header, payload) ? payload : "unknown reason");
+    tree_close(&walk);
+    return false;
+  }
+
+  count = send_tree(conn->fd, id, &walk);
+  tree_close(&walk);
+  if (count < 0 || send_frame(conn->fd, OP_OK, 0, id, NULL, 0) < 0)
+    return transfer_lost(conn, "transfer failed: %s", strerror(errno));
+  log_info("sent %zd entries", count);
+
+  if (recv_frame(conn, &header, &payload) < 0)
+    return transfer_lost(conn, "could not receive response: %s",
+                         strerror(errno));
+  if (header.opcode != OP_OK)
+    log_warn("put failed: %s",
+             payload_string(&header, payload) ? payload : "unknown reason");
+  else
+    log_info("transfer completed");
+
+  return header.opcode == OP_OK;
+}
+
+/* Ask the server for the size and mtime of a file.  Returns false if it
+   hasn't got one there. */
+bool remote_attrs(Connection *conn, char *path, off_t *size, int64_t *mtime) {
+  Header header;
+  char *payload;
+
+  if (send_frame(conn->fd, OP_STAT, 0, ++conn->next_id, path,
+                 strlen(path) + 1) < 0)
+    return transfer_lost(conn, "could not send request: %s", strerror(errno));
+  if (recv_frame(conn, &header, &payload) < 0)
+    return transfer_lost(conn, "could not receive response: %s",
+                         strerror(errno));
+
+  if (header.opcode == OP_ERROR) {
+    log_info("%s: %s", path,
+             payload_string(&header, payload) ? payload : "STAT failed");
+    return false;
+  }
+  if (header.opcode != OP_ATTRS || header.length != ATTRS_SIZE)
+    return transfer_lost(conn, "unexpected reply to STAT: 0x%x",
+                         header.opcode);
+
+  unpack_attrs(size, mtime, payload);
+  return true;
+}
+
+/* Ask for the server's counters and print them, a line for each. */
+bool do_stats_v2(Connection *conn, __attribute__((unused)) Command *c) {
+  uint64_t counters[STATS_COUNTERS];
+  Header header;
+  char *payload, *text;
+
+  if (send_frame(conn->fd, OP_STATS, 0, ++conn->next_id, NULL, 0) < 0 ||
+      recv_frame(conn, &header, &payload) < 0) {
+    log_warn("STATS failed: %s", strerror(errno));
+    return false;
+  }
+
+  if (header.opcode == OP_ERROR) {
+    log_warn("STATS failed: %s",
+             payload_string(&header, payload) ? payload : "unknown error");
+    return true;
+  }
+  if (header.opcode != OP_COUNTERS) {
+    log_warn("unexpected reply to STATS: 0x%x", header.opcode);
+    return false;
+  }
+
+  stats_unpack(counters, payload, header.length);
+  text = stats_format(counters);
+  fputs(text, stdout);
+  free(text);
   return true;
 }
 
+/* Give a file the modification time, in nanoseconds, of the one it's a copy
+   of. */
+void set_mtime(int fd, int64_t mtime) {
+  struct timespec times[2] = {
+      {.tv_nsec = UTIME_OMIT},
+      {.tv_sec = mtime / 1000000000, .tv_nsec = mtime % 1000000000}};
+
+  if (futimens(fd, times) != 0)
+    log_warn("couldn't set mtime: %s", strerror(errno));
+}
+
+/* Fetch a file of the given size into dest_fd in equal ranges, one over each
+   connection at once.  The ranges over the extra connections are each
+   fetched by a child process, all writing into the same file at their own
+   offsets.  Returns the size if everything arrived, or -1.  If any range
+   failed the extra connections are closed, as we can't tell what state
+   they're in; they're opened again for the next file.
+ */
+off_t get_ranges(Connection *conn, char *path, int dest_fd, off_t size) {
+  pid_t children[MAX_CONNECTIONS - 1];
+  int n = parallel_open + 1;
+  off_t chunk = (size + n - 1) / n;
+  off_t offset;
+  int i, status;
+  bool ok;
+
+  /* Size the file up front so the ranges can land in any order. */
+  if (ftruncate(dest_fd, size) != 0)
+    log_warn("couldn't size %lldB file: %s", (long long)size, strerror(errno));
+
+  fflush(stdout);
+  for (i = 1; i < n; i++) {
+    offset = i * chunk < size ? i * chunk : size;
+    children[i - 1] = fork();
+    if (children[i - 1] == 0) {
+      transfer_forked();
+      ok = fetch_range(&parallel[i - 1], ++parallel[i - 1].next_id, path,
+                       dest_fd, offset,
+                       size - offset < chunk ? size - offset : chunk);
+      trace_flush();
+      log_flush();
+      _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (children[i - 1] < 0)
+      log_error("fork: %s", strerror(errno));
+  }
+
+  ok = fetch_range(conn, ++conn->next_id, path, dest_fd, 0,
+                   size < chunk ? size : chunk);
+
+  for (i = 1; i < n; i++) {
+    while (waitpid(children[i - 1], &status, 0) < 0)
+      if (errno != EINTR)
+        log_error("waitpid: %s", strerror(errno));
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+      ok = false;
+  }
+
+  if (!ok) {
+    close_parallel();
+    return -1;
+  }
+  return size;
+}
+
+/* Ask for len bytes of path from offset and write them at the same offset of
+   dest_fd. */
+bool fetch_range(Connection *conn, uint32_t id, char *path, int dest_fd,
+                 off_t offset, off_t len) {
+  Header header;
+  char *payload;
+  char *request;
+  size_t path_len = strlen(path) + 1;
+  uint64_t range[2];
+  off_t received = 0;
+  bool ok = false;
+  uint64_t started = trace_start();
+
+  if ((request = malloc(sizeof range + path_len)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  range[0] = htobe64((uint64_t)offset);
+  range[1] = htobe64((uint64_t)len);
+  memcpy(request, range, sizeof range);
+  memcpy(request + sizeof range, path, path_len);
+
+  if (send_frame(conn->fd, OP_GET, FLAG_RANGE | data_flags(), id, request,
+                 sizeof range + path_len) < 0 ||
+      recv_header(conn, &header) < 0) {
+    log_warn("could not fetch range: %s", strerror(errno));
+    goto done;
+  }
+  if (header.opcode != OP_DATA) {
+    if (recv_payload(conn, &header, &payload) >= 0 &&
+        header.opcode == OP_ERROR && payload_string(&header, payload))
+      log_warn("%s", payload);
+    else
+      log_warn("unexpected reply to GET: 0x%x", header.opcode);
+    goto done;
+  }
+  if ((off_t)header.length != len) {
+    log_warn("asked for %lldB, got %lluB: has the file changed?",
+             (long long)len, (unsigned long long)header.length);
+    recv_data(conn, &header, -1, 0);
+    goto done;
+  }
+
+  received = recv_data(conn, &header, dest_fd, offset);
+  if (received < 0 && errno == EBADMSG) {
+    log_warn("range at %lld failed: checksum mismatch", (long long)offset);
+    goto done;
+  }
+  if (received != len) {
+    log_warn("range at %lld failed after %lld/%lldB: %s", (long long)offset,
+             (long long)received, (long long)len, strerror(errno));
+    goto done;
+  }
+  ok = true;
+
+done:
+  free(request);
+  trace_end(TRACE_GET, id, received > 0 ? (uint64_t)received : 0, started);
+  return ok;
+}
+
+/* Version 2 PUT: offer the file with its size, send it as a DATA frame once
+   the server accepts and wait for the server to say it's all written. */
+bool do_put_v2(Connection *conn, Command *c) {
+  Header header;
+  char *payload;
+  char *request = NULL;
+  size_t path_len = strlen(c->put.path) + 1;
+  uint64_t size;
+  uint32_t id = ++conn->next_id;
+  int to_send = -1;
+  bool completed = false;
+  off_t sent = 0;
+  struct stat fs;
+  uint64_t started = trace_start(), phase;
+
+  log_debug("put %s %s", c->put.from, c->put.path);
+
+  phase = trace_start();
+  to_send = open(c->put.from, O_RDONLY);
+  trace_end(TRACE_OPEN, id, 0, phase);
+  phase = trace_start();
+  if (to_send < 0 || fstat(to_send, &fs) != 0) {
+    log_warn("cannot put %s: %s", c->put.from, strerror(errno));
+    goto done;
+  }
+  trace_end(TRACE_STAT, id, 0, phase);
+
+  /* The request is the size of the file followed by its path. */
+  if ((request = malloc(sizeof size + path_len)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  size = htobe64((uint64_t)fs.st_size);
+  memcpy(request, &size, sizeof size);
+  memcpy(request + sizeof size, c->put.path, path_len);
+
+  phase = trace_start();
+  if (send_frame(conn->fd, OP_PUT, data_flags(), id, request,
+                 sizeof size + path_len) < 0) {
+    transfer_lost(conn, "could not send request: %s", strerror(errno));
+    goto done;
+  }
+  if (recv_frame(conn, &header, &payload) < 0) {
+    transfer_lost(conn, "could not receive response: %s", strerror(errno));
+    goto done;
+  }
+  trace_end(TRACE_HANDSHAKE, id, 0, phase);
+  if (header.opcode != OP_OK) {
+    log_warn("put refused: %s",
+             payload_string(&header, payload) ? payload : "unknown reason");
+    goto done;
+  }
+
+  /* The server's OK says how it will take the file. */
+  log_info("sending %lldB", (long long)fs.st_size);
+  sent = send_data(conn->fd, id, header.flags, to_send, 0, fs.st_size);
+  if (sent < 0) {
+    transfer_lost(conn, "could not send file: %s", strerror(errno));
+    goto done;
+  }
+  if (sent != fs.st_size) {
+    transfer_lost(conn, "transfer failed after %lld/%lldB: %s",
+                  (long long)sent, (long long)fs.st_size, strerror(errno));
+    goto done;
+  }
+
+  if (recv_frame(conn, &header, &payload) < 0) {
+    transfer_lost(conn, "could not receive response: %s", strerror(errno));
+    goto done;
+  }
+  completed = header.opcode == OP_OK;
+  if (!completed)
+    log_warn("put failed: %s",
+             payload_string(&header, payload) ? payload : "unknown reason");
+  else
+    log_info("transfer completed");
+
+done:
+  free(request);
+  if (to_send >= 0)
+    close(to_send);
+  trace_end(TRACE_PUT, id, sent > 0 ? (uint64_t)sent : 0, started);
+  return completed;
+}
+
+/* Delta PUT: the server sends the signatures of the blocks of its copy, and
+   we send only the parts of our file that aren't among them, referring to
+   its blocks for the rest.  It rebuilds the file and puts it in place of its
+   copy once it's all there.
+ */
+bool do_put_delta(Connection *conn, Command *c) {
+  Header header;
+  char *payload;
+  char *request = NULL;
+  size_t path_len = strlen(c->put.path) + 1;
+  uint64_t size;
+  uint32_t id = ++conn->next_id;
+  Signatures sigs = {0};
+  ssize_t literal;
+  int to_send = -1;
+  bool completed = false;
+  struct stat fs;
+
+  log_debug("put %s %s, as a delta", c->put.from, c->put.path);
+
+  to_send = open(c->put.from, O_RDONLY);
+  if (to_send < 0 || fstat(to_send, &fs) != 0) {
+    log_warn("cannot put %s: %s", c->put.from, strerror(errno));
+    goto done;
+  }
+
+  if ((request = malloc(sizeof size + path_len)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  size = htobe64((uint64_t)fs.st_size);
+  memcpy(request, &size, sizeof size);
+  memcpy(request + sizeof size, c->put.path, path_len);
+
+  if (send_frame(conn->fd, OP_PUT, FLAG_DELTA, id, request,
+                 sizeof size + path_len) < 0) {
+    transfer_lost(conn, "could not send request: %s", strerror(errno));
+    goto done;
+  }
+
+  for (;;) {
+    if (recv_frame(conn, &header, &payload) < 0) {
+      transfer_lost(conn, "could not receive response: %s", strerror(errno));
+      goto done;
+    }
+    if (header.opcode == OP_OK)
+      break;
+    if (header.opcode == OP_ERROR) {
+      log_warn("put refused: %s",
+               payload_string(&header, payload) ? payload : "unknown reason");
+      goto done;
+    }
+    if (header.opcode != OP_SIGS ||
+        !unpack_sigs(&sigs, payload, (size_t)header.length)) {
+      transfer_lost(conn, "unexpected reply to PUT: 0x%x", header.opcode);
+      goto done;
+    }
+  }
+
+  log_info("server has %zu blocks of %uB", sigs.count, sigs.block);
+  if ((literal = send_delta(conn->fd, id, to_send, fs.st_size, &sigs)) < 0 ||
+      send_frame(conn->fd, OP_OK, 0, id, NULL, 0) < 0) {
+    transfer_lost(conn, "transfer failed: %s", strerror(errno));
+    goto done;
+  }
+
+  if (recv_frame(conn, &header, &payload) < 0) {
+    transfer_lost(conn, "could not receive response: %s", strerror(errno));
+    goto done;
+  }
+  completed = header.opcode == OP_OK;
+  if (!completed)
+    log_warn("put failed: %s",
+             payload_string(&header, payload) ? payload : "unknown reason");
+  else
+    log_info("transfer completed, sending %zdB of %lldB", literal,
+             (long long)fs.st_size);
+
+done:
+  free(sigs.sig);
+  free(request);
+  if (to_send >= 0)
+    close(to_send);
+  return completed;
+}
+
 /* Prompt for a y/n response. */
 bool y_or_n_p(char *prompt) {
   char *response = NULL;
@@ -389,15 +1977,28 @@ char *strip(char *in) {
 */
 bool parse_command(char *input, Command *c) {
   input = strip(input);
+  c->flags = 0;
 
+  if (!strncasecmp(input, "rget ", 5)) {
+    c->flags = FLAG_TREE;
+    return parse_get(input + 5, c);
+  }
+  if (!strncasecmp(input, "rput ", 5)) {
+    c->flags = FLAG_TREE;
+    return parse_put(input + 5, c);
+  }
   if (!strncasecmp(input, "done", 4))
     return parse_done(input + 4, c);
   if (!strncasecmp(input, "list", 4))
     return parse_list(input + 4, c);
   if (!strncasecmp(input, "get ", 4))
     return parse_get(input + 4, c);
+  if (!strncasecmp(input, "mget ", 5))
+    return parse_mget(input + 5, c);
   if (!strncasecmp(input, "put ", 4))
     return parse_put(input + 4, c);
+  if (!strncasecmp(input, "stats", 5))
+    return parse_stats(input + 5, c);
 
   return false;
 }
@@ -414,10 +2015,68 @@ bool parse_done(char *input, Command *c) {
   }
 }
 
+bool parse_stats(char *input, Command *c) {
+  input = strip(input);
+  if (strcmp(input, "") == 0) {
+    c->type = STATS;
+    return true;
+  }
+  log_warn("trailing junk in STATS: '%s'", input);
+  c->type = ERROR;
+  return false;
+}
+
+/* MGET pattern ...: the patterns are separated by spaces, and go to the
+   server nil terminated, one after another. */
+bool parse_mget(char *input, Command *c) {
+  size_t i, fp;
+
+  input = strip(input);
+  c->type = MGET;
+  if (*input == '\0') {
+    log_warn("MGET needs at least one path");
+    c->type = ERROR;
+    return false;
+  }
+
+  for (i = 0, fp = 0; input[i] != '\0'; i++) {
+    if (!isspace(input[i]))
+      input[fp++] = input[i];
+    else if (fp > 0 && input[fp - 1] != '\0')
+      input[fp++] = '\0';
+  }
+  input[fp++] = '\0';
+  c->mget.patterns = input;
+  c->mget.length = fp;
+  return true;
+}
+
+/* LIST [-lu] [path]: -l gives the type, size and mtime of each entry, and
+   -u leaves them in whatever order the directory has them, which for a big
+   directory saves the server reading all of it before sending anything. */
 bool parse_list(char *input, Command *c) {
+  size_t i;
+
   input = strip(input);
 
   c->type = LIST;
+  c->flags = FLAG_SORT;
+  while (input[0] == '-') {
+    for (i = 1; input[i] == 'l' || input[i] == 'u'; i++) {
+      if (input[i] == 'l')
+        c->flags |= FLAG_STAT;
+      else
+        c->flags &= ~FLAG_SORT;
+    }
+    if (i == 1 || (input[i] != '\0' && input[i] != ' ')) {
+      log_warn("unknown option to LIST: '%s'", input);
+      c->type = ERROR;
+      return false;
+    }
+    for (input += i; *input == ' '; input++)
+      ;
+  }
+
   /* If path missing, assume ".". */
   if (strcmp(input, "") == 0)
     c->list.path = ".";
@@ -1,28 +1,96 @@
 #pragma once
 
+#include "batch.h"
 #include "sftp.h"
 #include <netdb.h>
 #include <stdbool.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
+
+/* Most connections a GET may be split across. */
+#define MAX_CONNECTIONS 64
+
+/* Files smaller than this are always fetched over one connection. */
+#define PARALLEL_MIN (8 * 1024 * 1024)
 
 typedef struct Options_t {
   char *port;
   char *hostname;
+  int protocol;
+  bool assume_yes;
+  int depth;
+  int connections;
+  bool resume;
+  bool check;
+  bool delta;
+  bool compress;
+  bool checksum;
+  bool timing;
+  char *trace_file; /* Where to trace to, before the pid, or NULL. */
+  char *manifest;   /* Transfers to run with -b, or NULL. */
+  char **commands; /* Run instead of reading standard input, if not NULL. */
+  int command_count;
 } Options;
 
+/* A request sent while pipelining whose reply hasn't all arrived yet.  The
+   paths are copies, as the command they came from is long gone by then. */
+typedef struct Request_t {
+  bool active;
+  uint32_t id;
+  int type;
+  uint16_t flags;
+  char *path;
+  char *local;
+} Request;
+
 static Options options;
 
 void default_options(Options *);
+void parse_options(Options *, int, char *[]);
+void usage(void);
 int get_connect_socket(struct addrinfo *, char[INET6_ADDRSTRLEN]);
+void open_connection(Connection *, int);
+bool negotiate(Connection *, int);
+bool open_parallel(void);
+void close_parallel(void);
 bool socket_up(int);
-int client(int);
+int client(Connection *);
+ssize_t read_input(char **, size_t *);
+void print_time(char *, struct timespec *);
+int client_pipelined(Connection *, int);
+int client_batch(Connection *);
+size_t read_manifest(char *, char ***);
+void run_jobs(Connection *, Batch *, int, char **);
+bool start_request(Connection *, Command *, Request *);
+void finish_request(Request *);
+Request *find_request(Request *, int, uint32_t);
+int count_requests(Request *, int, bool);
+void handle_reply(Connection *, Request *, int);
+uint16_t data_flags(void);
 
-bool do_command(int, Command *);
-bool do_done(int, Command *);
-bool do_list(int, Command *);
-bool do_get(int, Command *);
-bool do_put(int, Command *);
+bool do_command(Connection *, Command *);
+bool do_transfer(Connection *, Command *);
+bool transfer_lost(Connection *, char *, ...);
+bool do_done(Connection *, Command *);
+bool do_list(Connection *, Command *);
+bool do_get(Connection *, Command *);
+bool do_put(Connection *, Command *);
+bool do_list_v2(Connection *, Command *);
+void print_entries(char *, size_t, uint16_t);
+bool do_get_v2(Connection *, Command *);
+bool do_put_v2(Connection *, Command *);
+bool do_put_delta(Connection *, Command *);
+bool do_get_tree(Connection *, Command *);
+bool do_put_tree(Connection *, Command *);
+bool do_get_resume(Connection *, Command *);
+bool do_put_resume(Connection *, Command *);
+bool remote_attrs(Connection *, char *, off_t *, int64_t *);
+bool do_stats_v2(Connection *, Command *);
+bool do_mget_v2(Connection *, Command *);
+void set_mtime(int, int64_t);
+off_t get_ranges(Connection *, char *, int, off_t);
+bool fetch_range(Connection *, uint32_t, char *, int, off_t, off_t);
 
 bool y_or_n_p(char *);
 char *strip(char *);
@@ -32,3 +100,5 @@ bool parse_done(char *, Command *);
 bool parse_list(char *, Command *);
 bool parse_get(char *, Command *);
 bool parse_put(char *, Command *);
+bool parse_stats(char *, Command *);
+bool parse_mget(char *, Command *);
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef SFTP_ZLIB
+#include <zlib.h>
+#endif
+
+#include "compress.h"
+#include "crc32c.h"
+#include "sftp.h"
+#include "transfer.h"
+
+#ifdef SFTP_ZLIB
+const bool can_compress = true;
+
+/* The streams and buffers used for chunks, made on first use and kept for
+   the life of the thread, as setting up a deflate stream costs far more than
+   resetting one. */
+static __thread z_stream deflater;
+static __thread bool have_deflater = false;
+static __thread z_stream inflater;
+static __thread bool have_inflater = false;
+#else
+const bool can_compress = false;
+#endif
+
+static __thread char *chunk_buf;
+static __thread char *scratch;
+
+static void get_buffers(void) {
+  if (chunk_buf == NULL &&
+      ((chunk_buf = malloc(CHUNK_HEADER + COMPRESS_CHUNK)) == NULL ||
+       (scratch = malloc(COMPRESS_CHUNK)) == NULL))
+    log_error("couldn't allocate memory: %s", strerror(errno));
+}
+
+/* Should the next chunk be compressed, or sent as it is without trying? */
+bool packer_try(Packer *p) {
+  if (!can_compress)
+    return false;
+  if (p->wait > 0) {
+    p->wait--;
+    return false;
+  }
+  return true;
+}
+
+void pack_chunk_header(char buf[CHUNK_HEADER], size_t raw, size_t packed) {
+  uint32_t n[2] = {htonl((uint32_t)raw), htonl((uint32_t)packed)};
+
+  memcpy(buf, n, sizeof n);
+}
+
+/* Compress the raw bytes of a chunk sitting after room for its header in
+   buf, in place, if they come out enough smaller to be worth it, and fill in
+   the header.  Returns the bytes of the chunk to send, header and all.
+
+   Deflate is told to stop once it has used all the room a worthwhile result
+   could take, so a chunk that won't compress costs no more than that.
+ */
+size_t pack_chunk(Packer *p, char *buf, size_t raw) {
+  size_t packed = raw;
+
+#ifdef SFTP_ZLIB
+  size_t limit = raw - raw / COMPRESS_MIN_SAVING;
+  int status;
+
+  get_buffers();
+  if (!have_deflater) {
+    /* Raw deflate at the fastest level: the network is what we're saving,
+       not the disk, so it only has to beat the link. */
+    if (deflateInit2(&deflater, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) !=
+        Z_OK)
+      log_error("couldn't set up compression");
+    have_deflater = true;
+  } else {
+    deflateReset(&deflater);
+  }
+
+  deflater.next_in = (unsigned char *)buf + CHUNK_HEADER;
+  deflater.avail_in = (unsigned)raw;
+  deflater.next_out = (unsigned char *)scratch;
+  deflater.avail_out = (unsigned)limit;
+  status = deflate(&deflater, Z_FINISH);
+
+  if (status == Z_STREAM_END && deflater.total_out < raw) {
+    packed = deflater.total_out;
+    memcpy(buf + CHUNK_HEADER, scratch, packed);
+    p->skip = 0;
+  } else {
+    p->skip = p->skip == 0 ? 1 : p->skip * 2;
+    if (p->skip > COMPRESS_SKIP_MAX)
+      p->skip = COMPRESS_SKIP_MAX;
+    p->wait = p->skip;
+  }
+#else
+  (void)p;
+#endif
+
+  pack_chunk_header(buf, raw, packed);
+  return CHUNK_HEADER + packed;
+}
+
+/* Read a chunk's header, checking it makes sense when at most left bytes of
+   the file are still to come. */
+bool unpack_chunk_header(char buf[CHUNK_HEADER], off_t left, size_t *raw,
+                         size_t *packed) {
+  uint32_t n[2];
+
+  memcpy(n, buf, sizeof n);
+  *raw = ntohl(n[0]);
+  *packed = ntohl(n[1]);
+  return *raw > 0 && *raw <= COMPRESS_CHUNK && (off_t)*raw <= left &&
+         *packed > 0 && *packed <= *raw;
+}
+
+/* Decompress the packed bytes of a chunk into out, which they must fill
+   exactly. */
+bool unpack_chunk(char *in, size_t packed, char *out, size_t raw) {
+#ifdef SFTP_ZLIB
+  int status;
+
+  if (!have_inflater) {
+    if (inflateInit2(&inflater, -15) != Z_OK)
+      log_error("couldn't set up decompression");
+    have_inflater = true;
+  } else {
+    inflateReset(&inflater);
+  }
+
+  inflater.next_in = (unsigned char *)in;
+  inflater.avail_in = (unsigned)packed;
+  inflater.next_out = (unsigned char *)out;
+  inflater.avail_out = (unsigned)raw;
+  status = inflate(&inflater, Z_FINISH);
+
+  return status == Z_STREAM_END && inflater.total_out == raw &&
+         inflater.avail_in == 0;
+#else
+  (void)in, (void)packed, (void)out, (void)raw;
+  return false;
+#endif
+}
+
+/* send_file() for a DATA frame with FLAG_COMPRESS: len bytes of file_fd from
+   offset, as a run of chunks.  Chunks that aren't worth trying to compress
+   are still sent with sendfile().  Unless crc is NULL it's carried on over
+   the bytes sent.  Returns the bytes of the file sent, which is only less
+   than len if an error occurred (errno is set).
+ */
+off_t send_compressed(int sock_fd, int file_fd, off_t offset, off_t len,
+                      uint32_t *crc) {
+  Packer packer = {0, 0};
+  off_t sent = 0;
+  size_t raw, got, size;
+  ssize_t n;
+
+  get_buffers();
+  while (sent < len) {
+    raw = len - sent < COMPRESS_CHUNK ? (size_t)(len - sent) : COMPRESS_CHUNK;
+
+    if (!packer_try(&packer)) {
+      pack_chunk_header(chunk_buf, raw, raw);
+      for (got = 0; got < CHUNK_HEADER; got += (size_t)n) {
+        n = send(sock_fd, chunk_buf + got, CHUNK_HEADER - got, MSG_MORE);
+        if (n < 0 && errno == EINTR)
+          n = 0;
+        else if (n < 0) {
+          log_warn("send: %s", strerror(errno));
+          return sent;
+        }
+      }
+      if (send_file(sock_fd, file_fd, offset + sent, (off_t)raw) < (off_t)raw ||
+          (crc != NULL &&
+           !crc32c_file(crc, file_fd, offset + sent, (off_t)raw)))
+        return sent;
+      sent += raw;
+      continue;
+    }
+
+    for (got = 0; got < raw; got += (size_t)n) {
+      n = pread(file_fd, chunk_buf + CHUNK_HEADER + got, raw - got,
+                offset + sent + got);
+      if (n < 0 && errno == EINTR) {
+        n = 0;
+        continue;
+      }
+      if (n <= 0) {
+        if (n == 0) {
+          log_warn("file truncated while sending: %lld/%lldB",
+                   (long long)sent, (long long)len);
+          errno = EIO;
+        } else {
+          log_warn("read: %s", strerror(errno));
+        }
+        return sent;
+      }
+    }
+
+    if (crc != NULL)
+      *crc = crc32c(*crc, chunk_buf + CHUNK_HEADER, raw);
+    size = pack_chunk(&packer, chunk_buf, raw);
+    if (send_all(sock_fd, chunk_buf, size) != (ssize_t)size) {
+      log_warn("send: %s", strerror(errno));
+      return sent;
+    }
+    sent += raw;
+    log_debug("sent %lld/%lldB, %zuB on the wire", (long long)sent,
+              (long long)len, size);
+  }
+
+  return sent;
+}
+
+/* Take the next chunk of a compressed DATA payload out of the connection's
+   buffer without reading from the socket, when at most left bytes of the
+   file are still to come.  A compressed chunk is taken whole and data is
+   pointed at what it decompresses to, which is valid until the next call.
+   For a chunk sent as it is only the header is taken and data is set to
+   NULL: its bytes follow in the buffer, or are yet to arrive.
+
+   Returns the bytes of the file in the chunk, or -1 with errno set to EAGAIN
+   if not enough has arrived yet, or EPROTO if the chunk makes no sense.
+ */
+ssize_t take_chunk(Connection *conn, off_t left, char **data) {
+  char *buf = conn->buf + conn->start;
+  size_t raw, packed;
+
+  if (conn_buffered(conn) < CHUNK_HEADER) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (!unpack_chunk_header(buf, left, &raw, &packed)) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  if (packed == raw) {
+    conn->start += CHUNK_HEADER;
+    *data = NULL;
+    return (ssize_t)raw;
+  }
+
+  if (conn_buffered(conn) < CHUNK_HEADER + packed) {
+    errno = EAGAIN;
+    return -1;
+  }
+  get_buffers();
+  if (!unpack_chunk(buf + CHUNK_HEADER, packed, scratch, raw)) {
+    errno = EPROTO;
+    return -1;
+  }
+  conn->start += CHUNK_HEADER + packed;
+  *data = scratch;
+  return (ssize_t)raw;
+}
+
+/* recv_file() for a DATA frame with FLAG_COMPRESS: the chunks making up len
+   bytes of a file, written to file_fd at offset, or thrown away if file_fd
+   is -1.  Chunks sent as they are still go through recv_file().  Unless crc
+   is NULL it's carried on over the bytes written.
+
+   Returns the bytes of the file received, which is less than len if
+   something went wrong (errno is set).  The stream can't be followed after
+   a bad chunk, which is reported as EPROTO.
+ */
+off_t recv_compressed(Connection *conn, int file_fd, off_t offset, off_t len,
+                      uint32_t *crc) {
+  off_t received = 0;
+  char *data;
+  size_t done;
+  ssize_t n, written;
+
+  while (received < len) {
+    if ((n = take_chunk(conn, len - received, &data)) < 0) {
+      if (errno != EAGAIN) {
+        log_warn("bad compressed data after %lld/%lldB", (long long)received,
+                 (long long)len);
+        return received;
+      }
+      if (conn_need(conn, conn_buffered(conn) + 1) < 0)
+        return received;
+      continue;
+    }
+
+    if (data == NULL) {
+      if ((file_fd < 0 ? discard_data(conn, n)
+                       : recv_file(conn, file_fd, offset + received, n)) < n)
+        return received;
+      if (crc != NULL && file_fd >= 0 &&
+          !crc32c_file(crc, file_fd, offset + received, n))
+        return received;
+      received += n;
+      continue;
+    }
+
+    if (crc != NULL)
+      *crc = crc32c(*crc, data, (size_t)n);
+
+    for (done = 0; file_fd >= 0 && done < (size_t)n; done += (size_t)written) {
+      written = pwrite(file_fd, data + done, (size_t)n - done,
+                       offset + received + (off_t)done);
+      if (written < 0 && errno == EINTR) {
+        written = 0;
+        continue;
+      }
+      if (written <= 0) {
+        log_warn("write: %s", written < 0 ? strerror(errno) : "short write");
+        return received + (off_t)done;
+      }
+    }
+    received += n;
+    log_debug("received %lld/%lldB", (long long)received, (long long)len);
+  }
+
+  return received;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sftp.h"
+
+/* Most bytes of a file compressed as one chunk.  A chunk that doesn't
+   compress goes as it is, so with its header it still fits in a connection's
+   smallest buffer. */
+#define COMPRESS_CHUNK (60 * 1024)
+
+/* The header in front of each chunk: its size before and after compression,
+   4 bytes each.  The same size twice means it went as it is. */
+#define CHUNK_HEADER 8
+
+/* A chunk has to come out at least 1/COMPRESS_MIN_SAVING smaller to be worth
+   sending compressed. */
+#define COMPRESS_MIN_SAVING 16
+
+/* Most chunks sent as they are, without trying, after one that didn't
+   compress. */
+#define COMPRESS_SKIP_MAX 64
+
+/* Whether this build can compress at all. */
+extern const bool can_compress;
+
+/* How a file being sent compressed is getting on.  After a chunk that
+   doesn't compress the next skip chunks go without trying, and skip doubles
+   each time that happens in a row, so that data that's already compressed
+   costs little more than sending it raw.
+ */
+typedef struct Packer_t {
+  unsigned skip;
+  unsigned wait; /* Chunks still to send before trying again. */
+} Packer;
+
+bool packer_try(Packer *);
+void pack_chunk_header(char[CHUNK_HEADER], size_t, size_t);
+size_t pack_chunk(Packer *, char *, size_t);
+bool unpack_chunk_header(char[CHUNK_HEADER], off_t, size_t *, size_t *);
+bool unpack_chunk(char *, size_t, char *, size_t);
+ssize_t take_chunk(Connection *, off_t, char **);
+
+off_t send_compressed(int, int, off_t, off_t, uint32_t *);
+off_t recv_compressed(Connection *, int, off_t, off_t, uint32_t *);
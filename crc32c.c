@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "crc32c.h"
+#include "sftp.h"
+
+/* The Castagnoli polynomial, bit reversed, as the CRC is worked out least
+   significant bit first. */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc_table[8][256];
+static uint32_t lane_shift; /* x^(8 * CRC_LANE) mod P. */
+
+static uint32_t crc_slice8(uint32_t, const unsigned char *, size_t);
+static uint32_t shift_lane(uint32_t);
+static uint32_t (*crc_update)(uint32_t, const unsigned char *,
+                              size_t) = crc_slice8;
+static uint32_t (*crc_shift)(uint32_t) = shift_lane;
+
+static __thread unsigned char *file_buf;
+
+/* Multiply two polynomials modulo P, both bit reversed as the CRC is. */
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+  uint32_t m = 1u << 31, p = 0;
+
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0)
+        break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+/* x^n modulo P. */
+static uint32_t xnmodp(uint64_t n) {
+  uint32_t p = 1u << 31, sq = 1u << 30;
+
+  for (; n > 0; n >>= 1) {
+    if (n & 1)
+      p = multmodp(sq, p);
+    sq = multmodp(sq, sq);
+  }
+  return p;
+}
+
+/* The portable CRC, eight bytes at a time through eight tables. */
+static uint32_t crc_slice8(uint32_t crc, const unsigned char *p, size_t len) {
+  uint32_t lo, hi;
+
+  for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+    crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+  for (; len >= 8; len -= 8, p += 8) {
+    lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+                (uint32_t)p[3] << 24);
+    hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 |
+         (uint32_t)p[7] << 24;
+    crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+          crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+          crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+          crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+  }
+
+  for (; len > 0; len--)
+    crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+/* Move a CRC on past CRC_LANE zero bytes, to combine it with the CRC of the
+   lane after it. */
+static uint32_t shift_lane(uint32_t crc) { return multmodp(lane_shift, crc); }
+
+#if defined(__x86_64__)
+static uint64_t lane_clmul; /* x^(8 * CRC_LANE - 33) mod P. */
+
+/* shift_lane() with a carry-less multiply: the product is 64 bits of a
+   polynomial that the CRC instruction then reduces modulo P, multiplying it
+   by x^33 on the way, which lane_clmul allows for. */
+__attribute__((target("sse4.2,pclmul"))) static uint32_t
+shift_lane_clmul(uint32_t crc) {
+  __m128i a = _mm_cvtsi32_si128((int)crc);
+  __m128i b = _mm_cvtsi64_si128((long long)lane_clmul);
+  __m128i product = _mm_clmulepi64_si128(a, b, 0);
+
+  return (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(product));
+}
+
+/* The CRC with the SSE4.2 instruction.  It takes three cycles to give an
+   answer but can start one each cycle, so long runs are split into three
+   lanes worked on side by side and then combined.
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+crc_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t c0 = crc, c1, c2, w0, w1, w2;
+  const unsigned char *end;
+
+  for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+    c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+
+  for (; len >= 3 * CRC_LANE; len -= 3 * CRC_LANE, p += 2 * CRC_LANE) {
+    c1 = c2 = 0;
+    for (end = p + CRC_LANE; p < end; p += 8) {
+      memcpy(&w0, p, sizeof w0);
+      memcpy(&w1, p + CRC_LANE, sizeof w1);
+      memcpy(&w2, p + 2 * CRC_LANE, sizeof w2);
+      c0 = _mm_crc32_u64(c0, w0);
+      c1 = _mm_crc32_u64(c1, w1);
+      c2 = _mm_crc32_u64(c2, w2);
+    }
+    c0 = crc_shift((uint32_t)c0) ^ (uint32_t)c1;
+    c0 = crc_shift((uint32_t)c0) ^ (uint32_t)c2;
+  }
+
+  for (; len >= 8; len -= 8, p += 8) {
+    memcpy(&w0, p, sizeof w0);
+    c0 = _mm_crc32_u64(c0, w0);
+  }
+  for (; len > 0; len--)
+    c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+  return (uint32_t)c0;
+}
+#endif
+
+/* Fill in the tables, and pick the fastest way the CPU has. */
+__attribute__((constructor)) static void crc32c_init(void) {
+  uint32_t crc;
+
+  for (unsigned n = 0; n < 256; n++) {
+    crc = n;
+    for (int k = 0; k < 8; k++)
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    crc_table[0][n] = crc;
+  }
+  for (unsigned n = 0; n < 256; n++)
+    for (int k = 1; k < 8; k++)
+      crc_table[k][n] = (crc_table[k - 1][n] >> 8) ^
+                        crc_table[0][crc_table[k - 1][n] & 0xff];
+  lane_shift = xnmodp(8 * (uint64_t)CRC_LANE);
+
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc_update = crc_sse42;
+    if (__builtin_cpu_supports("pclmul")) {
+      lane_clmul = xnmodp(8 * (uint64_t)CRC_LANE - 33);
+      crc_shift = shift_lane_clmul;
+    }
+  }
+#endif
+}
+
+/* Carry on the CRC-32C crc, of whatever came before, over len bytes at buf.
+   Start with 0. */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+  return ~crc_update(~crc, buf, len);
+}
+
+/* Carry on *crc over len bytes of the file at offset.  Just after they've
+   been sent or received they're in the page cache, so this only costs a
+   copy.  Returns false if they couldn't be read (errno is set).
+ */
+bool crc32c_file(uint32_t *crc, int fd, off_t offset, off_t len) {
+  size_t want;
+  ssize_t n;
+
+  if (file_buf == NULL && (file_buf = malloc(CRC_READ)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+
+  while (len > 0) {
+    want = len < CRC_READ ? (size_t)len : CRC_READ;
+    n = pread(fd, file_buf, want, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (n == 0)
+        errno = EIO;
+      log_warn("read: %s", strerror(errno));
+      return false;
+    }
+    *crc = crc32c(*crc, file_buf, (size_t)n);
+    offset += n;
+    len -= n;
+  }
+
+  return true;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Bytes of each of the three streams the CRC is worked out in at once with
+   SSE4.2, which are then combined into one. */
+#define CRC_LANE 4096
+
+/* Most bytes of a file read at once to check it. */
+#define CRC_READ (128 * 1024)
+
+/* Size of a CHECKSUM payload: the CRC-32C of a DATA frame's file bytes. */
+#define CHECKSUM_SIZE 4
+
+uint32_t crc32c(uint32_t, const void *, size_t);
+bool crc32c_file(uint32_t *, int, off_t, off_t);
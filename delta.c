@@ -0,0 +1,517 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "delta.h"
+#include "sftp.h"
+#include "transfer.h"
+
+/* How much of the old file is read at a time to sign it. */
+#define SIGN_READ (1024 * 1024)
+
+/* A delta being worked out and sent by the client.  The server's blocks are
+   chained by the low bits of their weak sums from heads through next.  Runs
+   of blocks the server already has are gathered in refs, with the latest run
+   still open in first and count, and are sent before any literal data that
+   follows them.
+ */
+typedef struct Sender_t {
+  int sock;
+  uint32_t id;
+  int fd;
+  Signatures *sigs;
+  int32_t *heads;
+  int32_t *next;
+  size_t mask;
+  char refs[DELTA_BATCH];
+  size_t used;
+  uint64_t first;
+  uint32_t count;
+  off_t literal;
+} Sender;
+
+static bool sign_file(Delta *, off_t);
+static bool delta_fail(Delta *, char *);
+static ssize_t find_block(Sender *, uint32_t, const unsigned char *, ssize_t);
+static bool add_ref(Sender *, uint64_t);
+static bool flush_refs(Sender *, bool);
+static bool send_literal(Sender *, off_t, off_t);
+
+/* Pick the block size for a file: about the square root of its size, so
+   that the signatures and the data missed around each change grow together. */
+uint32_t delta_block_size(off_t size) {
+  uint64_t block = 1;
+
+  while (block * block < (uint64_t)size)
+    block <<= 1;
+  if (block < DELTA_MIN_BLOCK)
+    return DELTA_MIN_BLOCK;
+  if (block > DELTA_MAX_BLOCK)
+    return DELTA_MAX_BLOCK;
+  return (uint32_t)block;
+}
+
+/* The weak sum of a block, as rsync has it: two 16 bit sums, the second
+   weighting each byte by how far it is from the end, so that the sum of the
+   next block along can be had from this one in a few steps. */
+uint32_t weak_sum(const unsigned char *buf, size_t len) {
+  uint32_t a = 0, b = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    a += buf[i];
+    b += (uint32_t)(len - i) * buf[i];
+  }
+  return (a & 0xffff) | (b << 16);
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+/* The strong hash of a block: 128 bit MurmurHash3.  It isn't cryptographic,
+   but the client only ever matches its own data against it, and a block has
+   to match the weak sum as well. */
+void strong_sum(const void *key, size_t len, unsigned char out[STRONG_SIZE]) {
+  const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+  const unsigned char *data = key, *tail = data + (len & ~(size_t)15);
+  uint64_t h1 = 0, h2 = 0, k1, k2;
+  size_t i;
+
+  for (const unsigned char *p = data; p < tail; p += 16) {
+    memcpy(&k1, p, 8);
+    memcpy(&k2, p + 8, 8);
+    k1 = le64toh(k1) * c1;
+    h1 ^= rotl64(k1, 31) * c2;
+    h1 = (rotl64(h1, 27) + h2) * 5 + 0x52dce729;
+    k2 = le64toh(k2) * c2;
+    h2 ^= rotl64(k2, 33) * c1;
+    h2 = (rotl64(h2, 31) + h1) * 5 + 0x38495ab5;
+  }
+
+  k1 = k2 = 0;
+  for (i = len & 15; i > 8; i--)
+    k2 ^= (uint64_t)tail[i - 1] << ((i - 9) * 8);
+  if ((len & 15) > 8)
+    h2 ^= rotl64(k2 * c2, 33) * c1;
+  for (i = (len & 15) > 8 ? 8 : len & 15; i > 0; i--)
+    k1 ^= (uint64_t)tail[i - 1] << ((i - 1) * 8);
+  if ((len & 15) > 0)
+    h1 ^= rotl64(k1 * c1, 31) * c2;
+
+  h1 ^= len;
+  h2 ^= len;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+
+  h1 = htobe64(h1);
+  h2 = htobe64(h2);
+  memcpy(out, &h1, 8);
+  memcpy(out + 8, &h2, 8);
+}
+
+/* Pack as many signatures as fit into a SIGS payload of up to size bytes,
+   starting from *next, after the block size.  Returns the bytes packed, or 0
+   once they've all gone. */
+size_t pack_sigs(Signatures *sigs, size_t *next, char *buf, size_t size) {
+  uint32_t be;
+  size_t used = 4;
+
+  if (*next >= sigs->count)
+    return 0;
+
+  be = htobe32(sigs->block);
+  memcpy(buf, &be, 4);
+  for (; *next < sigs->count && used + SIG_SIZE <= size; (*next)++) {
+    be = htobe32(sigs->sig[*next].weak);
+    memcpy(buf + used, &be, 4);
+    memcpy(buf + used + 4, sigs->sig[*next].strong, STRONG_SIZE);
+    used += SIG_SIZE;
+  }
+  return used;
+}
+
+/* Add the signatures in a SIGS payload to sigs.  Returns false if it's
+   malformed. */
+bool unpack_sigs(Signatures *sigs, char *payload, size_t len) {
+  uint32_t be, block;
+  size_t n;
+  Signature *sig;
+
+  if (len < 4 || (len - 4) % SIG_SIZE != 0)
+    return false;
+  memcpy(&be, payload, 4);
+  block = be32toh(be);
+  if (block < DELTA_MIN_BLOCK || block > DELTA_MAX_BLOCK ||
+      (sigs->count > 0 && block != sigs->block))
+    return false;
+  sigs->block = block;
+
+  n = (len - 4) / SIG_SIZE;
+  if ((sig = realloc(sigs->sig, (sigs->count + n) * sizeof *sig)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  sigs->sig = sig;
+  for (size_t i = 0; i < n; i++) {
+    memcpy(&be, payload + 4 + i * SIG_SIZE, 4);
+    sig[sigs->count].weak = be32toh(be);
+    memcpy(sig[sigs->count].strong, payload + 8 + i * SIG_SIZE, STRONG_SIZE);
+    sigs->count++;
+  }
+  return true;
+}
+
+/* Start a delta PUT to path: sign the old copy, if there is one, and make the
+   temp file to rebuild it in next to it, with the same permissions.  Returns
+   false, with errno set, if either can't be done.
+ */
+bool delta_open(Delta *d, char *path) {
+  char dir[PATH_MAX], base[PATH_MAX], temp[PATH_MAX];
+  struct stat fs = {0};
+  int err;
+
+  memset(d, 0, sizeof *d);
+  d->out_fd = -1;
+  if (strlen(path) >= sizeof d->path) {
+    d->old_fd = -1;
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(d->path, path);
+
+  if ((d->old_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 && errno != ENOENT)
+    return false;
+  if (d->old_fd >= 0) {
+    if (fstat(d->old_fd, &fs) != 0)
+      goto fail;
+    if (!S_ISREG(fs.st_mode)) {
+      errno = S_ISDIR(fs.st_mode) ? EISDIR : EINVAL;
+      goto fail;
+    }
+    if (!sign_file(d, fs.st_size))
+      goto fail;
+  }
+
+  strncpy(dir, path, sizeof dir - 1);
+  dir[sizeof dir - 1] = '\0';
+  strncpy(base, path, sizeof base - 1);
+  base[sizeof base - 1] = '\0';
+  if (snprintf(temp, sizeof temp, "%s/.%s.XXXXXX", dirname(dir),
+               basename(base)) >= (int)sizeof temp) {
+    errno = ENAMETOOLONG;
+    goto fail;
+  }
+  if ((d->out_fd = mkostemp(temp, O_CLOEXEC)) < 0)
+    goto fail;
+  memcpy(d->temp, temp, sizeof temp);
+  if (d->old_fd >= 0 && fchmod(d->out_fd, fs.st_mode & 07777) != 0)
+    log_warn("%s: couldn't copy permissions: %s", d->temp, strerror(errno));
+  return true;
+
+fail:
+  err = errno;
+  delta_close(d);
+  errno = err;
+  return false;
+}
+
+/* Work out the signatures of every whole block of the old copy.  Whatever is
+   left over at the end is short of a block, so the client sends it. */
+static bool sign_file(Delta *d, off_t size) {
+  size_t block = delta_block_size(size);
+  size_t want = SIGN_READ - SIGN_READ % block, len;
+  char *buf;
+  ssize_t n;
+  off_t offset = 0;
+
+  d->sigs.block = (uint32_t)block;
+  d->sigs.count = 0;
+  if ((d->sigs.sig = malloc((size_t)(size / (off_t)block + 1) *
+                            sizeof *d->sigs.sig)) == NULL ||
+      (d->buf = malloc(block)) == NULL || (buf = malloc(want)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  posix_fadvise(d->old_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  while (offset + (off_t)block <= size) {
+    len = size - offset < (off_t)want ? (size_t)(size - offset) : want;
+    if ((n = pread(d->old_fd, buf, len - len % block, offset)) < 0) {
+      if (errno == EINTR)
+        continue;
+      free(buf);
+      return false;
+    }
+    if ((size_t)n < block)
+      break;
+    for (size_t i = 0; i + block <= (size_t)n; i += block) {
+      Signature *sig = &d->sigs.sig[d->sigs.count++];
+      sig->weak = weak_sum((unsigned char *)buf + i, block);
+      strong_sum(buf + i, block, sig->strong);
+    }
+    offset += (off_t)(n - n % block);
+  }
+
+  free(buf);
+  return true;
+}
+
+/* Note the first thing to go wrong with a delta PUT. */
+static bool delta_fail(Delta *d, char *why) {
+  if (d->failure == NULL)
+    d->failure = why;
+  return false;
+}
+
+/* Copy the runs of old blocks in a BLOCKS payload to the end of the new file.
+   Each block is checked against its signature first, in case the old copy
+   has changed since it was signed. */
+void delta_copy(Delta *d, char *payload, size_t len) {
+  uint64_t first;
+  uint32_t count;
+  size_t block = d->sigs.block;
+  unsigned char strong[STRONG_SIZE];
+  ssize_t n;
+
+  if (d->failure != NULL)
+    return;
+  if (len % BLOCK_REF_SIZE != 0) {
+    delta_fail(d, "bad block references");
+    return;
+  }
+
+  for (size_t i = 0; i < len; i += BLOCK_REF_SIZE) {
+    memcpy(&first, payload + i, 8);
+    memcpy(&count, payload + i + 8, 4);
+    first = be64toh(first);
+    count = be32toh(count);
+    if (first >= d->sigs.count || count > d->sigs.count - first) {
+      delta_fail(d, "bad block references");
+      return;
+    }
+
+    for (uint64_t b = first; b < first + count; b++) {
+      n = pread(d->old_fd, d->buf, block, (off_t)(b * block));
+      if (n >= 0 && (size_t)n == block)
+        strong_sum(d->buf, block, strong);
+      if (n < 0 || (size_t)n != block ||
+          memcmp(strong, d->sigs.sig[b].strong, STRONG_SIZE) != 0) {
+        delta_fail(d, "file changed while being rebuilt");
+        return;
+      }
+      if (pwrite(d->out_fd, d->buf, block, d->offset) != (ssize_t)block) {
+        delta_fail(d, strerror(errno));
+        return;
+      }
+      d->offset += (off_t)block;
+    }
+  }
+}
+
+/* Put the rebuilt file in place of the old one, if it's all there.  Returns
+   false if not, with the reason in failure. */
+bool delta_commit(Delta *d, off_t size) {
+  if (d->failure != NULL)
+    return false;
+  if (d->offset != size)
+    return delta_fail(d, "file is the wrong size");
+  if (rename(d->temp, d->path) != 0)
+    return delta_fail(d, strerror(errno));
+  d->temp[0] = '\0';
+  return true;
+}
+
+/* Finish with a delta PUT, throwing the temp file away unless it was put in
+   place. */
+void delta_close(Delta *d) {
+  if (d->temp[0] != '\0' && unlink(d->temp) != 0)
+    log_warn("%s: %s", d->temp, strerror(errno));
+  if (d->old_fd >= 0)
+    close(d->old_fd);
+  if (d->out_fd >= 0)
+    close(d->out_fd);
+  free(d->sigs.sig);
+  free(d->buf);
+  memset(d, 0, sizeof *d);
+  d->old_fd = d->out_fd = -1;
+}
+
+/* Find a block of the server's with the given weak sum and the same contents
+   as data, trying the one after the last match first as files mostly carry
+   on as they were.  Returns its index, or -1.  The strong hash is only worked
+   out once there's a weak match.
+ */
+static ssize_t find_block(Sender *s, uint32_t weak, const unsigned char *data,
+                          ssize_t hint) {
+  Signature *sig = s->sigs->sig;
+  unsigned char strong[STRONG_SIZE];
+  bool have_strong = false;
+
+  if (hint >= 0 && (size_t)hint < s->sigs->count && sig[hint].weak == weak) {
+    strong_sum(data, s->sigs->block, strong);
+    have_strong = true;
+    if (!memcmp(strong, sig[hint].strong, STRONG_SIZE))
+      return hint;
+  }
+
+  for (int32_t i = s->heads[weak & s->mask]; i >= 0; i = s->next[i]) {
+    if (sig[i].weak != weak)
+      continue;
+    if (!have_strong) {
+      strong_sum(data, s->sigs->block, strong);
+      have_strong = true;
+    }
+    if (!memcmp(strong, sig[i].strong, STRONG_SIZE))
+      return i;
+  }
+  return -1;
+}
+
+/* Add a block the server has to the delta, extending the open run if it
+   follows on from it. */
+static bool add_ref(Sender *s, uint64_t block) {
+  if (s->count > 0 && block == s->first + s->count && s->count < UINT32_MAX) {
+    s->count++;
+    return true;
+  }
+  if (!flush_refs(s, false))
+    return false;
+  s->first = block;
+  s->count = 1;
+  return true;
+}
+
+/* Close the open run, and send the runs gathered so far if there's no room
+   for more, or if all is set because something else has to follow them. */
+static bool flush_refs(Sender *s, bool all) {
+  uint64_t first = htobe64(s->first);
+  uint32_t count = htobe32(s->count);
+
+  if (s->count > 0) {
+    if (s->used + BLOCK_REF_SIZE > sizeof s->refs && !flush_refs(s, true))
+      return false;
+    memcpy(s->refs + s->used, &first, 8);
+    memcpy(s->refs + s->used + 8, &count, 4);
+    s->used += BLOCK_REF_SIZE;
+    s->count = 0;
+  }
+  if ((all || s->used + BLOCK_REF_SIZE > sizeof s->refs) && s->used > 0) {
+    if (send_frame(s->sock, OP_BLOCKS, 0, s->id, s->refs, s->used) < 0)
+      return false;
+    s->used = 0;
+  }
+  return true;
+}
+
+/* Send len bytes of the file from offset as they are, after the blocks
+   before them. */
+static bool send_literal(Sender *s, off_t offset, off_t len) {
+  if (len == 0)
+    return true;
+  if (!flush_refs(s, true) ||
+      send_header(s->sock, OP_DATA, 0, s->id, (uint64_t)len, MSG_MORE) < 0 ||
+      send_file(s->sock, s->fd, offset, len) != len)
+    return false;
+  s->literal += len;
+  return true;
+}
+
+/* Send the client's side of a delta PUT of the size bytes of fd: a DATA
+   frame for each stretch the server hasn't got, and BLOCKS frames referring
+   to runs of the server's blocks for the rest, found by rolling the weak sum
+   along the file a byte at a time.  The file is mapped rather than read so
+   the window can roll over it freely.  Returns how many bytes went as
+   literal data, or -1 if sending failed.
+ */
+ssize_t send_delta(int sock, uint32_t id, int fd, off_t size,
+                   Signatures *sigs) {
+  Sender s = {.sock = sock, .id = id, .fd = fd, .sigs = sigs};
+  size_t block = sigs->block;
+  unsigned char *data = NULL;
+  uint32_t a = 0, b = 0, out;
+  ssize_t found, hint = -1;
+  off_t pos = 0, start = 0;
+  bool ok = false;
+
+  if (sigs->count == 0 || size < (off_t)block || sigs->count > INT32_MAX)
+    goto tail;
+
+  data = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    log_warn("mmap: %s", strerror(errno));
+    data = NULL;
+    goto tail;
+  }
+  madvise(data, (size_t)size, MADV_SEQUENTIAL);
+
+  while (s.mask + 1 < sigs->count * 2)
+    s.mask = s.mask * 2 + 1;
+  if ((s.heads = malloc((s.mask + 1) * sizeof *s.heads)) == NULL ||
+      (s.next = malloc(sigs->count * sizeof *s.next)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  memset(s.heads, 0xff, (s.mask + 1) * sizeof *s.heads);
+  for (size_t i = sigs->count; i-- > 0;) {
+    s.next[i] = s.heads[sigs->sig[i].weak & s.mask];
+    s.heads[sigs->sig[i].weak & s.mask] = (int32_t)i;
+  }
+
+  /* start is where the literal data not sent yet begins. */
+  while (pos + (off_t)block <= size) {
+    if (pos == start) {
+      a = b = 0;
+      for (size_t i = 0; i < block; i++) {
+        a += data[pos + i];
+        b += (uint32_t)(block - i) * data[pos + i];
+      }
+    }
+
+    found = find_block(&s, (a & 0xffff) | (b << 16), data + pos, hint);
+    if (found >= 0) {
+      if (!send_literal(&s, start, pos - start) ||
+          !add_ref(&s, (uint64_t)found))
+        goto done;
+      hint = found + 1;
+      pos += (off_t)block;
+      start = pos;
+      continue;
+    }
+
+    if (pos + (off_t)block == size)
+      break;
+    out = data[pos];
+    a += data[pos + block] - out;
+    b += a - (uint32_t)block * out;
+    pos++;
+  }
+
+tail:
+  if (!send_literal(&s, start, size - start) || !flush_refs(&s, true))
+    goto done;
+  ok = true;
+
+done:
+  if (data != NULL)
+    munmap(data, (size_t)size);
+  free(s.heads);
+  free(s.next);
+  return ok ? (ssize_t)s.literal : -1;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Smallest and largest blocks a file is split into for a delta PUT. */
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK (128 * 1024)
+
+/* Bytes of a block's strong hash, and of its whole signature on the wire:
+   the weak rolling sum and then the strong hash. */
+#define STRONG_SIZE 16
+#define SIG_SIZE (4 + STRONG_SIZE)
+
+/* Bytes of a reference to a run of blocks in a BLOCKS payload: the index of
+   the first block and how many follow it. */
+#define BLOCK_REF_SIZE 12
+
+/* Most bytes of signatures or block references packed into one frame. */
+#define DELTA_BATCH (32 * 1024)
+
+/* One block of the server's copy of a file. */
+typedef struct Signature_t {
+  uint32_t weak;
+  unsigned char strong[STRONG_SIZE];
+} Signature;
+
+/* The signatures of every whole block of a file. */
+typedef struct Signatures_t {
+  uint32_t block;
+  size_t count;
+  Signature *sig;
+} Signatures;
+
+/* The server's side of a delta PUT: the file is rebuilt into temp from the
+   blocks of the old copy the client refers to and the literal data it sends,
+   and then renamed over the old copy at path.  Once something goes wrong,
+   failure says what, and the rest of what the client sends is thrown away. */
+typedef struct Delta_t {
+  int old_fd;
+  int out_fd;
+  char path[PATH_MAX];
+  char temp[PATH_MAX];
+  Signatures sigs;
+  off_t offset; /* Bytes of the new file written so far. */
+  char *buf;    /* Room for one block. */
+  char *failure;
+} Delta;
+
+uint32_t delta_block_size(off_t);
+uint32_t weak_sum(const unsigned char *, size_t);
+void strong_sum(const void *, size_t, unsigned char[STRONG_SIZE]);
+
+size_t pack_sigs(Signatures *, size_t *, char *, size_t);
+bool unpack_sigs(Signatures *, char *, size_t);
+
+bool delta_open(Delta *, char *);
+void delta_copy(Delta *, char *, size_t);
+bool delta_commit(Delta *, off_t);
+void delta_close(Delta *);
+
+ssize_t send_delta(int, uint32_t, int, off_t, Signatures *);
@@ -0,0 +1,275 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "dircache.h"
+#include "sftp.h"
+
+/* Anything that could change what a LIST of the directory says.  Changes to
+   a file's contents matter as well as to the names, since a listing with
+   FLAG_STAT has sizes and mtimes in it. */
+#define DIRCACHE_EVENTS                                                        \
+  (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MODIFY |            \
+   IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+static size_t limit;
+static size_t used;
+static int inotify_fd = -1;
+
+static CachedList *lists[DIRCACHE_BUCKETS];
+static DirWatch *watches[DIRCACHE_BUCKETS];
+static CachedList *lru_first; /* Most recently used. */
+static CachedList *lru_last;
+
+static unsigned hash_list(char *, uint16_t);
+static DirWatch **find_watch(int);
+static void lru_unlink(CachedList *);
+static void lru_push(CachedList *);
+static void uncache(CachedList *);
+static void invalidate(DirWatch *);
+
+/* Keep up to limit bytes of listings.  With a limit of 0 nothing is cached.
+
+   Each process has its own cache, made when it first lists something, so it
+   pays off most in the event server where one process serves many sessions.
+   Listings are dropped on any inotify event for their directory, and the
+   events are read before every lookup.  The kernel queues them during the
+   system call that makes the change, so once a PUT has been answered, even
+   from another process, the next LIST can't be served the old listing.
+   Moving a directory's parent isn't noticed, as only the directory itself is
+   watched.
+ */
+void dircache_init(size_t bytes) { limit = bytes; }
+
+/* Would a listing taking size bytes fit in the cache at all? */
+bool dircache_fits(size_t size) { return limit > 0 && size <= limit; }
+
+static unsigned hash_list(char *path, uint16_t flags) {
+  unsigned h = 2166136261u ^ flags;
+
+  for (; *path != '\0'; path++)
+    h = (h ^ (unsigned char)*path) * 16777619u;
+  return h % DIRCACHE_BUCKETS;
+}
+
+/* Find the slot pointing at the watch with descriptor wd, or at the end of
+   its bucket if there is none. */
+static DirWatch **find_watch(int wd) {
+  DirWatch **w = &watches[(unsigned)wd % DIRCACHE_BUCKETS];
+
+  while (*w != NULL && (*w)->wd != wd)
+    w = &(*w)->next;
+  return w;
+}
+
+static void lru_unlink(CachedList *list) {
+  if (list->lru_prev != NULL)
+    list->lru_prev->lru_next = list->lru_next;
+  else
+    lru_first = list->lru_next;
+  if (list->lru_next != NULL)
+    list->lru_next->lru_prev = list->lru_prev;
+  else
+    lru_last = list->lru_prev;
+  list->lru_prev = list->lru_next = NULL;
+}
+
+static void lru_push(CachedList *list) {
+  list->lru_next = lru_first;
+  if (lru_first != NULL)
+    lru_first->lru_prev = list;
+  else
+    lru_last = list;
+  lru_first = list;
+}
+
+/* Look up the listing of path with the given flags, after catching up with
+   whatever has changed.  Returns it with a reference the caller must give
+   back with dircache_release(), or NULL if it isn't cached. */
+CachedList *dircache_find(char *path, uint16_t flags) {
+  CachedList *list;
+
+  if (limit == 0)
+    return NULL;
+  dircache_drain();
+
+  for (list = lists[hash_list(path, flags)]; list != NULL;
+       list = list->hash_next)
+    if (list->flags == flags && !strcmp(list->path, path))
+      break;
+  if (list == NULL)
+    return NULL;
+
+  lru_unlink(list);
+  lru_push(list);
+  list->refs++;
+  return list;
+}
+
+/* Give back a reference to a listing, freeing it if it was the last. */
+void dircache_release(CachedList *list) {
+  if (--list->refs > 0)
+    return;
+  free(list->path);
+  free(list->data);
+  free(list->ends);
+  free(list);
+}
+
+/* Start watching the directory at path, before reading it to make a listing
+   for the cache.  Returns NULL if there's no cache, or it can't be watched. */
+DirWatch *dircache_watch(char *path) {
+  DirWatch **slot, *w;
+  int wd;
+
+  if (limit == 0)
+    return NULL;
+  if (inotify_fd < 0 &&
+      (inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+    log_warn("not caching listings: inotify_init1: %s", strerror(errno));
+    limit = 0;
+    return NULL;
+  }
+
+  if ((wd = inotify_add_watch(inotify_fd, path, DIRCACHE_EVENTS)) < 0)
+    return NULL;
+
+  slot = find_watch(wd);
+  if ((w = *slot) == NULL) {
+    if ((w = calloc(1, sizeof *w)) == NULL)
+      log_error("couldn't allocate memory: %s", strerror(errno));
+    w->wd = wd;
+    *slot = w;
+  }
+  w->users++;
+  return w;
+}
+
+/* Stop using a watch, removing it once nothing else does. */
+void dircache_unwatch(DirWatch *w) {
+  DirWatch **slot;
+
+  if (--w->users > 0)
+    return;
+  if (w->wd >= 0) {
+    slot = find_watch(w->wd);
+    *slot = w->next;
+    inotify_rm_watch(inotify_fd, w->wd);
+  }
+  free(w);
+}
+
+/* Cache the listing made under watch w, unless the directory changed while
+   it was being read.  The cache takes over data and ends, and the caller's
+   use of the watch.  The least recently used listings are dropped to make
+   room for it.
+ */
+void dircache_add(DirWatch *w, char *path, uint16_t flags, char *data,
+                  size_t *ends, size_t batches, size_t count) {
+  CachedList *list, **bucket = &lists[hash_list(path, flags)];
+  size_t cost = sizeof *list + strlen(path) + 1 +
+                (batches > 0 ? ends[batches - 1] : 0) +
+                batches * sizeof *ends;
+
+  dircache_drain();
+  for (list = *bucket; list != NULL; list = list->hash_next)
+    if (list->flags == flags && !strcmp(list->path, path))
+      break;
+
+  /* Another session may have cached the same listing meanwhile. */
+  if (w->wd < 0 || list != NULL || !dircache_fits(cost)) {
+    free(data);
+    free(ends);
+    dircache_unwatch(w);
+    return;
+  }
+
+  while (used + cost > limit)
+    uncache(lru_last);
+
+  if ((list = calloc(1, sizeof *list)) == NULL ||
+      (list->path = strdup(path)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  list->flags = flags;
+  list->data = data;
+  list->ends = ends;
+  list->batches = batches;
+  list->count = count;
+  list->cost = cost;
+  list->refs = 1;
+  list->cached = true;
+  list->watch = w;
+
+  list->hash_next = *bucket;
+  *bucket = list;
+  list->watch_next = w->lists;
+  w->lists = list;
+  lru_push(list);
+  used += cost;
+}
+
+/* Drop a listing from the cache.  Sessions still sending it keep it until
+   they're done. */
+static void uncache(CachedList *list) {
+  CachedList **p;
+  DirWatch *w = list->watch;
+
+  for (p = &lists[hash_list(list->path, list->flags)]; *p != list;
+       p = &(*p)->hash_next)
+    ;
+  *p = list->hash_next;
+  for (p = &w->lists; *p != list; p = &(*p)->watch_next)
+    ;
+  *p = list->watch_next;
+  lru_unlink(list);
+
+  used -= list->cost;
+  list->cached = false;
+  list->watch = NULL;
+  dircache_release(list);
+  dircache_unwatch(w);
+}
+
+/* Something changed in a watched directory: drop everything listed from it,
+   and stop watching it.  Listings still being made from it won't be cached. */
+static void invalidate(DirWatch *w) {
+  *find_watch(w->wd) = w->next;
+  inotify_rm_watch(inotify_fd, w->wd);
+  w->wd = -1;
+
+  w->users++;
+  while (w->lists != NULL)
+    uncache(w->lists);
+  dircache_unwatch(w);
+}
+
+/* Read whatever inotify has queued, and drop the listings it makes stale. */
+void dircache_drain(void) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *event;
+  DirWatch *w;
+  ssize_t n;
+
+  if (inotify_fd < 0)
+    return;
+
+  while ((n = read(inotify_fd, buf, sizeof buf)) > 0) {
+    for (char *p = buf; p < buf + n; p += sizeof *event + event->len) {
+      event = (struct inotify_event *)p;
+      if (event->mask & IN_Q_OVERFLOW) {
+        /* We've lost track, so nothing cached can be trusted. */
+        for (int i = 0; i < DIRCACHE_BUCKETS; i++)
+          while (watches[i] != NULL)
+            invalidate(watches[i]);
+      } else if ((w = *find_watch(event->wd)) != NULL) {
+        invalidate(w);
+      }
+    }
+  }
+  if (n < 0 && errno != EAGAIN && errno != EINTR)
+    log_warn("reading inotify events: %s", strerror(errno));
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Default limit on the memory the LIST cache takes, in megabytes. */
+#define DIRCACHE_DEFAULT_MB 64
+
+/* Buckets in the tables of listings and of watches. */
+#define DIRCACHE_BUCKETS 1024
+
+struct DirWatch_t;
+
+/* A LIST reply kept for reuse: the batches listing_pack() made from one
+   directory with one set of flags, back to back in data.  Sessions sending it
+   hold a reference, so it outlives being dropped from the cache.
+ */
+typedef struct CachedList_t {
+  char *path;
+  uint16_t flags;
+  char *data;
+  size_t *ends; /* Where each batch ends in data. */
+  size_t batches;
+  size_t count; /* Entries in the directory, for version 1. */
+  size_t cost;  /* Bytes charged against the cache's limit. */
+  int refs;
+  bool cached;
+
+  struct DirWatch_t *watch;
+  struct CachedList_t *hash_next;
+  struct CachedList_t *watch_next;
+  struct CachedList_t *lru_prev;
+  struct CachedList_t *lru_next;
+} CachedList;
+
+/* An inotify watch on a directory that listings are cached for, or being
+   made for.  Any event on it drops them all and removes the watch. */
+typedef struct DirWatch_t {
+  int wd;
+  int users; /* Cached listings, and listings being made. */
+  CachedList *lists;
+  struct DirWatch_t *next;
+} DirWatch;
+
+void dircache_init(size_t);
+bool dircache_fits(size_t);
+CachedList *dircache_find(char *, uint16_t);
+void dircache_release(CachedList *);
+DirWatch *dircache_watch(char *);
+void dircache_unwatch(DirWatch *);
+void dircache_add(DirWatch *, char *, uint16_t, char *, size_t *, size_t,
+                  size_t);
+void dircache_drain(void);
@@ -0,0 +1,1299 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "crc32c.h"
+#include "delta.h"
+#include "event.h"
+#include "server.h"
+#include "sftp.h"
+#include "stats.h"
+#include "trace.h"
+#include "transfer.h"
+
+/* Serve every connection from one process with epoll, instead of forking a
+   process per connection.  Each session is a state machine that is moved
+   along as its socket becomes readable or writable, so nothing blocks on the
+   network (reading and writing files still blocks).
+ */
+int event_server(int sock_fds[], int n_socks) {
+  struct epoll_event ev, events[MAX_EVENTS];
+  uint32_t want;
+  Session *s;
+  int epoll_fd, n;
+
+  /* A client hanging up mustn't take every other session down with it. */
+  signal(SIGPIPE, SIG_IGN);
+
+  if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    log_error("epoll_create1: %s", strerror(errno));
+
+  /* Listeners are told apart from sessions by pointing into sock_fds. */
+  for (int i = 0; i < n_socks; i++) {
+    if (fcntl(sock_fds[i], F_SETFL, fcntl(sock_fds[i], F_GETFL) | O_NONBLOCK) ==
+        -1)
+      log_error("fcntl: %s", strerror(errno));
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &sock_fds[i];
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fds[i], &ev) == -1)
+      log_error("epoll_ctl: %s", strerror(errno));
+  }
+
+  for (;;) {
+    n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      log_error("epoll_wait: %s", strerror(errno));
+    }
+
+    for (int i = 0; i < n; i++) {
+      if ((int *)events[i].data.ptr >= sock_fds &&
+          (int *)events[i].data.ptr < sock_fds + n_socks) {
+        accept_sessions(epoll_fd, *(int *)events[i].data.ptr);
+        continue;
+      }
+      s = events[i].data.ptr;
+
+      if (!session_event(s, events[i].events)) {
+        log_info("%s: session ended", s->peer);
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->conn.fd, NULL);
+        session_free(s);
+        continue;
+      }
+
+      /* Only read more once everything we owe the client has been sent. */
+      want = session_pending(s) ? EPOLLOUT : EPOLLIN;
+      if (want != s->events) {
+        ev.events = want;
+        ev.data.ptr = s;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->conn.fd, &ev) == -1)
+          log_warn("epoll_ctl: %s", strerror(errno));
+        s->events = want;
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/* Accept every pending connection on the listener and start a session for
+   each. */
+void accept_sessions(int epoll_fd, int sock_fd) {
+  struct sockaddr_storage their_addr;
+  struct epoll_event ev;
+  char from[INET6_ADDRSTRLEN];
+  socklen_t sin_size;
+  Session *s;
+  int new_fd;
+
+  for (;;) {
+    sin_size = sizeof their_addr;
+    new_fd = accept4(sock_fd, (struct sockaddr *)&their_addr, &sin_size,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (new_fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        log_warn("accept: %s", strerror(errno));
+      return;
+    }
+
+    inet_ntop(their_addr.ss_family,
+              get_in_addr((struct sockaddr *)&their_addr), from, sizeof from);
+    log_info("got connection from %s", from);
+
+    s = session_new(new_fd, from);
+    ev.events = s->events;
+    ev.data.ptr = s;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_fd, &ev) == -1) {
+      log_warn("epoll_ctl: %s", strerror(errno));
+      session_free(s);
+    }
+  }
+}
+
+/* Start a session on a newly accepted, non-blocking socket. */
+Session *session_new(int fd, char peer[INET6_ADDRSTRLEN]) {
+  Session *s;
+
+  if ((s = calloc(1, sizeof *s)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+
+  conn_init(&s->conn, fd);
+  s->conn.max_message = options.max_message;
+  s->state = S_COMMAND;
+  s->file_fd = -1;
+  s->tree_fd = -1;
+  s->events = EPOLLIN;
+  strncpy(s->peer, peer, sizeof s->peer - 1);
+  stats_add(STATS_SESSIONS, 1);
+  stats_add(STATS_SESSIONS_TOTAL, 1);
+
+  return s;
+}
+
+/* Hang up and throw the session away. */
+void session_free(Session *s) {
+  session_counted(s);
+  trace_flush();
+  stats_add(STATS_SESSIONS, -1);
+  close(s->conn.fd);
+  if (s->delta != NULL) {
+    /* Literal data is written straight to the delta's temp file. */
+    delta_close(s->delta);
+    free(s->delta);
+    s->file_fd = -1;
+  }
+  if (s->cached != NULL)
+    filecache_release(s->cached);
+  if (s->file_fd >= 0 && s->command.type == PUT)
+    close_put(s->file_fd, &s->command);
+  else if (s->file_fd >= 0)
+    close(s->file_fd);
+  if (s->listing != NULL)
+    listing_close(s->listing);
+  free(s->listing);
+  if (s->files != NULL)
+    mget_close(s->files);
+  free(s->files);
+  if (s->walk != NULL)
+    tree_close(s->walk);
+  if (s->tree_fd >= 0)
+    close(s->tree_fd);
+  free(s->walk);
+  free(s->entry);
+  conn_free(&s->conn);
+  free(s->out);
+  free(s);
+}
+
+/* Handle events on the session's socket.  Returns false when the session is
+   over, either because it has finished or because something went wrong. */
+bool session_event(Session *s, uint32_t events) {
+  if (events & EPOLLERR)
+    return false;
+  if ((events & EPOLLOUT) && !session_flush(s))
+    return false;
+  if ((events & (EPOLLIN | EPOLLHUP)) && !session_pending(s) &&
+      !session_read(s))
+    return false;
+  if (!session_process(s))
+    return false;
+
+  return !(s->state == S_CLOSING && !session_pending(s));
+}
+
+/* Is there still something to send to the client? */
+bool session_pending(Session *s) {
+  return s->out_sent < s->out_len || s->send_left > 0;
+}
+
+/* Send as much of the queued replies, then the file being sent, as the socket
+   will take without blocking.  Returns false if the socket failed. */
+bool session_flush(Session *s) {
+  char buf[MAXDATASIZE];
+  size_t want;
+  ssize_t n;
+
+  for (;;) {
+    while (s->out_sent < s->out_len) {
+      n = send(s->conn.fd, s->out + s->out_sent, s->out_len - s->out_sent,
+               s->send_left > 0 ? MSG_MORE : 0);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return true;
+        log_warn("%s: send: %s", s->peer, strerror(errno));
+        return false;
+      }
+      s->out_sent += (size_t)n;
+    }
+    s->out_sent = s->out_len = 0;
+
+    if (s->send_left == 0)
+      return true;
+    if ((s->send_flags & FLAG_COMPRESS) && s->send_chunk == 0) {
+      if (!queue_chunk(s))
+        return false;
+      continue;
+    }
+
+    want = s->send_left < SENDFILE_CHUNK ? (size_t)s->send_left
+                                         : SENDFILE_CHUNK;
+    if ((s->send_flags & FLAG_COMPRESS) && (off_t)want > s->send_chunk)
+      want = (size_t)s->send_chunk;
+    if (s->cached != NULL) {
+      /* Its checksum was worked out when it was cached. */
+      if ((n = filecache_send(s->conn.fd, s->cached, s->file_off, want, 0)) > 0)
+        s->file_off += n;
+    } else {
+      n = sendfile(s->conn.fd, s->file_fd, &s->file_off, want);
+      if (n > 0 && (s->send_flags & FLAG_CHECKSUM) &&
+          !crc32c_file(&s->send_crc, s->file_fd, s->file_off - n, (off_t)n))
+        return false;
+    }
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      if (errno != EINVAL && errno != ENOSYS) {
+        log_warn("%s: sendfile: %s", s->peer, strerror(errno));
+        return false;
+      }
+
+      /* Can't sendfile this: queue a chunk through memory instead. */
+      want = want < sizeof buf ? want : sizeof buf;
+      if ((n = pread(s->file_fd, buf, want, s->file_off)) > 0) {
+        queue_bytes(s, buf, (size_t)n);
+        s->file_off += n;
+        if (s->send_flags & FLAG_CHECKSUM)
+          s->send_crc = crc32c(s->send_crc, buf, (size_t)n);
+      }
+    }
+    if (n <= 0) {
+      log_warn("%s: file truncated while sending", s->peer);
+      return false;
+    }
+
+    s->send_left -= n;
+    if (s->send_flags & FLAG_COMPRESS)
+      s->send_chunk -= n;
+    send_done(s);
+  }
+}
+
+/* Queue the next chunk of a file being sent compressed.  One that isn't
+   worth trying to compress only has its header queued, and the rest is left
+   to sendfile().  Returns false if the file couldn't be read.
+ */
+bool queue_chunk(Session *s) {
+  size_t raw, got, size;
+  char *chunk;
+  ssize_t n;
+
+  raw = s->send_left < COMPRESS_CHUNK ? (size_t)s->send_left : COMPRESS_CHUNK;
+  if (!packer_try(&s->packer)) {
+    pack_chunk_header(queue_space(s, CHUNK_HEADER), raw, raw);
+    s->send_chunk = (off_t)raw;
+    return true;
+  }
+
+  chunk = queue_space(s, CHUNK_HEADER + raw);
+  for (got = 0; got < raw; got += (size_t)n) {
+    n = pread(s->file_fd, chunk + CHUNK_HEADER + got, raw - got,
+              s->file_off + (off_t)got);
+    if (n < 0 && errno == EINTR) {
+      n = 0;
+      continue;
+    }
+    if (n <= 0) {
+      log_warn("%s: file truncated while sending", s->peer);
+      return false;
+    }
+  }
+
+  if (s->send_flags & FLAG_CHECKSUM)
+    s->send_crc = crc32c(s->send_crc, chunk + CHUNK_HEADER, raw);
+  size = pack_chunk(&s->packer, chunk, raw);
+  s->out_len -= CHUNK_HEADER + raw - size;
+  s->file_off += (off_t)raw;
+  s->send_left -= (off_t)raw;
+  send_done(s);
+  return true;
+}
+
+/* Close the file being sent once the last of it has gone, and follow it
+   with its checksum if it has one. */
+void send_done(Session *s) {
+  uint32_t crc = htonl(s->send_crc);
+
+  if (s->send_left > 0)
+    return;
+  if (s->send_flags & FLAG_CHECKSUM)
+    queue_frame(s, OP_CHECKSUM, 0, s->command.id, &crc, sizeof crc);
+  s->send_flags = 0;
+  if (s->cached != NULL) {
+    log_debug("%s: sent %lldB from the cache", s->peer, (long long)s->file_off);
+    filecache_release(s->cached);
+    s->cached = NULL;
+  }
+  if (s->file_fd >= 0) {
+    log_debug("%s: sent %lldB", s->peer, (long long)s->file_off);
+    close(s->file_fd);
+    s->file_fd = -1;
+  }
+}
+
+/* Read whatever has arrived into the session's buffer.  Returns false if the
+   client hung up or the socket failed. */
+bool session_read(Session *s) {
+  ssize_t n = conn_fill(&s->conn);
+
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return true;
+    log_warn("%s: recv: %s", s->peer, strerror(errno));
+    return false;
+  }
+  if (n == 0) {
+    if (s->state != S_COMMAND || conn_buffered(&s->conn) > 0)
+      log_warn("%s: connection ended abruptly", s->peer);
+    return false;
+  }
+
+  return true;
+}
+
+/* Move the session along as far as the input buffered so far allows,
+   sending replies as we go.  Returns false if the session should end. */
+bool session_process(Session *s) {
+  int progress;
+
+  for (;;) {
+    if (session_pending(s)) {
+      if (!session_flush(s))
+        return false;
+      if (session_pending(s))
+        return true;
+    }
+
+    switch (s->state) {
+    case S_COMMAND:
+      if (s->in_request)
+        session_counted(s);
+      progress = session_command(s);
+      break;
+    case S_GET_CONFIRM:
+      progress = session_get_confirm(s);
+      break;
+    case S_PUT_SIZE:
+      progress = session_put_size(s);
+      break;
+    case S_PUT_HEADER:
+      progress = session_put_header(s);
+      break;
+    case S_PUT_DATA:
+      progress = session_put_data(s);
+      break;
+    case S_PUT_CHECKSUM:
+      progress = session_put_checksum(s);
+      break;
+    case S_LIST_SEND:
+      progress = session_list_send(s);
+      break;
+    case S_TREE_SEND:
+      progress = session_tree_send(s);
+      break;
+    case S_MGET_SEND:
+      progress = session_mget_send(s);
+      break;
+    case S_TREE_RECV:
+      progress = session_tree_recv(s);
+      break;
+    case S_DELTA_RECV:
+      progress = session_delta_recv(s);
+      break;
+    case S_CLOSING:
+    default:
+      return true;
+    }
+
+    if (progress < 0)
+      return false;
+    if (progress == 0)
+      return true;
+  }
+}
+
+/* Make room for len more bytes at the end of the replies waiting to be sent,
+   for the caller to fill in. */
+char *queue_space(Session *s, size_t len) {
+  size_t size;
+  char *out;
+
+  if (s->out_len + len > s->out_size) {
+    for (size = s->out_size ? s->out_size : MAXDATASIZE;
+         size < s->out_len + len; size *= 2)
+      ;
+    if ((out = realloc(s->out, size)) == NULL)
+      log_error("couldn't allocate memory: %s", strerror(errno));
+    s->out = out;
+    s->out_size = size;
+  }
+
+  s->out_len += len;
+  return s->out + s->out_len - len;
+}
+
+/* Add bytes to the replies waiting to be sent. */
+void queue_bytes(Session *s, void *buf, size_t len) {
+  memcpy(queue_space(s, len), buf, len);
+}
+
+/* Queue a nil terminated version 1 message, formatted like printf. */
+void queue_message(Session *s, char *format, ...) {
+  va_list argp;
+  char *buf = NULL;
+  int len;
+
+  va_start(argp, format);
+  len = vasprintf(&buf, format, argp);
+  va_end(argp);
+
+  if (len < 0)
+    log_error("memory allocation failed: vasprintf");
+  queue_bytes(s, buf, (size_t)len + 1);
+  free(buf);
+}
+
+/* Queue a version 2 frame. */
+void queue_frame(Session *s, uint16_t opcode, uint16_t flags, uint32_t id,
+                 void *payload, size_t len) {
+  Header header = {opcode, flags, id, len};
+  char buf[HEADER_SIZE];
+
+  pack_header(buf, &header);
+  queue_bytes(s, buf, HEADER_SIZE);
+  if (len > 0)
+    queue_bytes(s, payload, len);
+}
+
+/* Queue an error reply to the current command, in whichever protocol the
+   session speaks. */
+void queue_error(Session *s, char *format, ...) {
+  va_list argp;
+  char *buf = NULL;
+  int len;
+
+  va_start(argp, format);
+  len = vasprintf(&buf, format, argp);
+  va_end(argp);
+
+  if (len < 0)
+    log_error("memory allocation failed: vasprintf");
+  stats_add(STATS_ERRORS, 1);
+  if (s->conn.version >= 2)
+    queue_frame(s, OP_ERROR, 0, s->command.id, buf, (size_t)len + 1);
+  else
+    queue_message(s, "ERROR %s", buf);
+  free(buf);
+}
+
+/* Each step below takes what it needs from the session's buffer.  They
+   return 1 if they made progress, 0 if they need more input first, or -1 if
+   the session should end.
+ */
+
+/* Count the end of the last request, and the traffic so far, once its
+   replies have all been sent or at the end of the session.  Only whole
+   GETs, PUTs and LISTs are traced here, as their phases are spread over
+   many events. */
+void session_counted(Session *s) {
+  if (s->in_request && (s->command.type == GET || s->command.type == PUT ||
+                        s->command.type == MGET))
+    stats_add(STATS_TRANSFERS, -1);
+  if (s->in_request && (s->command.type == GET || s->command.type == MGET))
+    trace_end(TRACE_GET, s->command.id, 0, s->started);
+  else if (s->in_request && s->command.type == PUT)
+    trace_end(TRACE_PUT, s->command.id, 0, s->started);
+  else if (s->in_request && s->command.type == LIST)
+    trace_end(TRACE_LIST, s->command.id, 0, s->started);
+  s->in_request = false;
+  stats_socket(s->conn.fd, &s->traffic);
+}
+
+/* Start the next command, if it has arrived. */
+int session_command(Session *s) {
+  Header header;
+  char *buffer;
+  int version;
+
+  if (s->conn.version >= 2) {
+    if (take_frame(&s->conn, &header, &buffer) < 0) {
+      if (errno == EAGAIN)
+        return 0;
+      log_warn("%s: message too long", s->peer);
+      return -1;
+    }
+    if (!parse_frame(&s->command, &header, buffer)) {
+      log_warn("%s: unparseable request: 0x%x", s->peer, header.opcode);
+      queue_error(s, "unrecognised request");
+      return 1;
+    }
+  } else {
+    if (take_message(&s->conn, &buffer) < 0) {
+      if (errno == EAGAIN)
+        return 0;
+      log_warn("%s: message too long", s->peer);
+      return -1;
+    }
+    if (!parse_command(&s->command, buffer)) {
+      log_warn("%s: unparseable command: %s", s->peer, buffer);
+      return -1;
+    }
+  }
+
+  s->in_request = true;
+  s->started = trace_start();
+  stats_add(STATS_REQUESTS, 1);
+  if (s->command.type == GET || s->command.type == PUT ||
+      s->command.type == MGET) {
+    stats_add(STATS_TRANSFERS, 1);
+    stats_add(STATS_TRANSFERS_TOTAL, 1);
+  }
+
+  switch (s->command.type) {
+  case DONE:
+    log_info("%s: DONE", s->peer);
+    s->state = S_CLOSING;
+    return 1;
+  case HELLO:
+    log_info("%s: HELLO %d", s->peer, s->command.hello.version);
+    version = s->command.hello.version < PROTOCOL_VERSION
+                  ? s->command.hello.version
+                  : PROTOCOL_VERSION;
+    queue_message(s, "HELLO %d", version);
+    s->conn.version = version;
+    return 1;
+  case LIST:
+    return session_list(s);
+  case GET:
+    return session_get(s);
+  case PUT:
+    return session_put(s);
+  case STAT:
+    return session_stat(s);
+  case STATS:
+    return session_stats(s);
+  case MGET:
+    return session_mget(s);
+  case ERROR:
+    break;
+  }
+
+  return -1;
+}
+
+/* Open a directory to be listed, a batch at a time from session_list_send().
+   Version 1 only ever lists in order, after the number of entries. */
+int session_list(Session *s) {
+  bool with_stat = false, sort = true;
+
+  log_info("%s: LIST %s", s->peer, s->command.list.path);
+
+  if (s->conn.version >= 2) {
+    with_stat = s->command.flags & FLAG_STAT;
+    sort = s->command.flags & FLAG_SORT;
+  }
+  if ((s->listing = malloc(sizeof *s->listing)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  if (!listing_open(s->listing, s->command.list.path, with_stat, sort)) {
+    log_warn("cannot open directory for reading: %s", s->command.list.path);
+    queue_error(s, "can't open directory: %s", strerror(errno));
+    free(s->listing);
+    s->listing = NULL;
+    return 1;
+  }
+
+  if (s->conn.version < 2)
+    queue_message(s, "%zu", s->listing->count);
+  s->state = S_LIST_SEND;
+  return 1;
+}
+
+/* Once everything queued has gone, queue the next batch of a listing, packed
+   in place: bare names for version 1, an ENTRIES frame for version 2.  OK ends
+   a version 2 listing.
+ */
+int session_list_send(Session *s) {
+  size_t head = s->conn.version >= 2 ? HEADER_SIZE : 0;
+  size_t offset = s->out_len;
+  char *out = queue_space(s, head + LIST_BATCH);
+  size_t used = listing_pack(s->listing, out + head, LIST_BATCH);
+  Header header = {OP_ENTRIES, 0, s->command.id, used};
+
+  s->out_len = offset;
+  if (used > 0) {
+    if (head > 0)
+      pack_header(out, &header);
+    s->out_len += head + used;
+    return 1;
+  }
+
+  listing_close(s->listing);
+  free(s->listing);
+  s->listing = NULL;
+  if (s->conn.version >= 2)
+    queue_frame(s, OP_OK, 0, s->command.id, NULL, 0);
+  s->state = S_COMMAND;
+  return 1;
+}
+
+/* Open the file and offer its size, or send it straight away for a version 2
+   GET that didn't ask to confirm.  Version 2 GETs of small files are sent
+   from the file cache, if they're there, and added to it if not. */
+int session_get(Session *s) {
+  struct stat fs;
+  uint64_t size;
+  char *why = NULL;
+
+  if (s->conn.version >= 2 && (s->command.flags & FLAG_TREE))
+    return session_get_tree(s);
+
+  log_info("%s: GET %s", s->peer, s->command.get.path);
+
+  if (s->conn.version >= 2 && filecache_wanted(s->command.flags) &&
+      (s->cached = filecache_find(s->command.get.path)) != NULL) {
+    fs.st_size = s->cached->size;
+  } else {
+    /* Not blocking, or a FIFO would stop the loop until it had a writer. */
+    s->file_fd =
+        open(s->command.get.path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (s->file_fd < 0 || fstat(s->file_fd, &fs) != 0)
+      why = strerror(errno);
+    else if (!S_ISREG(fs.st_mode))
+      why = "not a regular file";
+    if (why != NULL) {
+      log_warn("%s: GET failed: %s", s->peer, why);
+      queue_error(s, "%s", why);
+      if (s->file_fd >= 0)
+        close(s->file_fd);
+      s->file_fd = -1;
+      return 1;
+    }
+    if (s->conn.version >= 2 && filecache_wanted(s->command.flags))
+      filecache_add(s->command.get.path, s->file_fd, &fs);
+  }
+  /* From here on file_size is how much of the file we send. */
+  get_range(&s->command, fs.st_size, &s->file_off, &s->file_size);
+
+  if (s->conn.version < 2) {
+    queue_message(s, "%llu", (unsigned long long)fs.st_size);
+    s->state = S_GET_CONFIRM;
+  } else if (s->command.flags & FLAG_CONFIRM) {
+    size = htobe64((uint64_t)fs.st_size);
+    queue_frame(s, OP_SIZE, 0, s->command.id, &size, sizeof size);
+    s->state = S_GET_CONFIRM;
+  } else {
+    s->state = S_GET_CONFIRM;
+    return session_get_confirm(s);
+  }
+
+  return 1;
+}
+
+/* Send the file if the client said OK. */
+int session_get_confirm(Session *s) {
+  Header header;
+  char *msg;
+  bool ok;
+
+  if (s->conn.version < 2 || (s->command.flags & FLAG_CONFIRM)) {
+    if (s->conn.version < 2 ? take_message(&s->conn, &msg) < 0
+                            : take_frame(&s->conn, &header, &msg) < 0) {
+      if (errno == EAGAIN)
+        return 0;
+      log_warn("%s: message too long", s->peer);
+      return -1;
+    }
+    ok = s->conn.version < 2 ? strcmp(msg, "OK") == 0
+                             : header.opcode == OP_OK;
+  } else {
+    ok = true;
+  }
+
+  s->state = S_COMMAND;
+  if (!ok) {
+    log_info("%s: cancelled GET", s->peer);
+    if (s->file_fd >= 0)
+      close(s->file_fd);
+    s->file_fd = -1;
+    if (s->cached != NULL)
+      filecache_release(s->cached);
+    s->cached = NULL;
+    return 1;
+  }
+
+  s->send_flags = s->conn.version >= 2 ? s->command.flags & DATA_FLAGS : 0;
+  s->packer = (Packer){0, 0};
+  s->send_chunk = 0;
+  s->send_crc = s->cached != NULL ? s->cached->crc : 0;
+  if (s->cached == NULL)
+    advise_sequential(s->file_fd, s->file_off, s->file_size);
+
+  log_info("%s: sending %lldB%s", s->peer, (long long)s->file_size,
+           s->send_flags & FLAG_COMPRESS ? ", compressed" : "");
+  if (s->conn.version >= 2) {
+    Header data = {OP_DATA, s->send_flags, s->command.id,
+                   (uint64_t)s->file_size};
+    char buf[HEADER_SIZE];
+
+    pack_header(buf, &data);
+    queue_bytes(s, buf, HEADER_SIZE);
+  }
+  s->send_left = s->file_size;
+  send_done(s);
+
+  return 1;
+}
+
+/* Reply with the size and mtime of a file. */
+int session_stat(Session *s) {
+  struct stat fs;
+  char attrs[ATTRS_SIZE];
+
+  log_info("%s: STAT %s", s->peer, s->command.stat.path);
+
+  if (stat(s->command.stat.path, &fs) != 0)
+    queue_error(s, "%s", strerror(errno));
+  else if (!S_ISREG(fs.st_mode))
+    queue_error(s, "not a regular file");
+  else {
+    pack_attrs(attrs, fs.st_size, mtime_ns(&fs));
+    queue_frame(s, OP_ATTRS, 0, s->command.id, attrs, sizeof attrs);
+  }
+
+  return 1;
+}
+
+/* Version 2 STATS: the counters, in a COUNTERS frame. */
+int session_stats(Session *s) {
+  char counters[STATS_SIZE];
+
+  log_info("%s: STATS", s->peer);
+  stats_pack(counters);
+  queue_frame(s, OP_COUNTERS, 0, s->command.id, counters, sizeof counters);
+  return 1;
+}
+
+/* Open the file to receive into and say whether we'll take it.  For a
+   version 2 PUT with FLAG_NOWAIT the file is coming anyway, so we say nothing
+   until it has all arrived.
+ */
+int session_put(Session *s) {
+  bool nowait = s->conn.version >= 2 && (s->command.flags & FLAG_NOWAIT);
+
+  if (s->conn.version >= 2 && (s->command.flags & FLAG_TREE))
+    return session_put_tree(s);
+  if (s->conn.version >= 2 && (s->command.flags & FLAG_DELTA))
+    return session_put_delta(s);
+
+  log_info("%s: PUT %s", s->peer, s->command.put.path);
+
+  s->put_error = 0;
+  s->file_fd = open_put(&s->command);
+  if (s->file_fd == -1) {
+    s->put_error = errno;
+    log_warn("%s: couldn't open file for PUT: %s", s->peer, strerror(errno));
+    if (nowait) {
+      s->state = S_PUT_HEADER;
+      return 1;
+    }
+    if (s->conn.version >= 2)
+      queue_error(s, "%s", strerror(errno));
+    else
+      queue_message(s, "NO: %s", strerror(errno));
+    stats_add(STATS_ERRORS, 1);
+    return 1;
+  }
+  s->file_off = s->command.put.offset;
+
+  if (s->conn.version >= 2) {
+    if (!nowait)
+      queue_frame(s, OP_OK, s->command.flags & DATA_FLAGS, s->command.id,
+                  NULL, 0);
+    s->state = S_PUT_HEADER;
+  } else {
+    queue_message(s, "OK");
+    s->state = S_PUT_SIZE;
+  }
+
+  return 1;
+}
+
+/* Version 1: get the size of the file being put. */
+int session_put_size(Session *s) {
+  char *msg;
+  long long len = 0;
+
+  if (take_message(&s->conn, &msg) < 0) {
+    if (errno == EAGAIN)
+      return 0;
+    log_warn("%s: message too long", s->peer);
+    return -1;
+  }
+
+  sscanf(msg, "%lld", &len);
+  log_info("%s: to receive %lldB", s->peer, len);
+  queue_message(s, "OK");
+
+  s->recv_left = len > 0 ? len : 0;
+  s->state = S_PUT_DATA;
+  return 1;
+}
+
+/* Version 2: get the DATA header for the file being put. */
+int session_put_header(Session *s) {
+  Header header;
+
+  if (take_header(&s->conn, &header) < 0)
+    return 0;
+  if (header.opcode != OP_DATA || header.id != s->command.id) {
+    log_warn("%s: expected file data, got 0x%x", s->peer, header.opcode);
+    return -1;
+  }
+
+  s->recv_left = (off_t)header.length;
+  s->recv_flags = header.flags & (FLAG_COMPRESS | FLAG_CHECKSUM);
+  s->recv_chunk = 0;
+  s->recv_crc = 0;
+  s->state = S_PUT_DATA;
+  return 1;
+}
+
+/* Write out whatever of the file has arrived, or throw it away if we
+   couldn't open the file.  A compressed chunk is written once it has all
+   arrived; the bytes of one sent as it is are written as they come.  A
+   checksum is worked out from the bytes as they're written. */
+int session_put_data(Session *s) {
+  char *data = s->conn.buf + s->conn.start;
+  size_t want = conn_buffered(&s->conn);
+  bool compressed = s->recv_flags & FLAG_COMPRESS;
+  off_t left = compressed ? s->recv_chunk : s->recv_left;
+  bool inflated = false;
+  ssize_t n, written;
+
+  if (compressed && s->recv_chunk == 0 && s->recv_left > 0) {
+    if ((n = take_chunk(&s->conn, s->recv_left, &data)) < 0) {
+      if (errno == EAGAIN)
+        return 0;
+      log_warn("%s: bad compressed data", s->peer);
+      return -1;
+    }
+    if (data == NULL) {
+      s->recv_chunk = n;
+      return 1;
+    }
+    left = n;
+    inflated = true;
+  }
+
+  if ((off_t)want > left || inflated)
+    want = (size_t)left;
+
+  if (s->file_fd < 0) {
+    if (!inflated)
+      s->conn.start += want;
+    if (compressed && !inflated)
+      s->recv_chunk -= (off_t)want;
+    s->recv_left -= (off_t)want;
+    if (s->recv_left > 0)
+      return compressed && s->recv_chunk == 0;
+
+    if (s->delta != NULL) {
+      s->state = S_DELTA_RECV;
+      return 1;
+    }
+    if (s->tree_fd >= 0) {
+      s->state = S_TREE_RECV;
+      return 1;
+    }
+    if (s->recv_flags & FLAG_CHECKSUM) {
+      s->state = S_PUT_CHECKSUM;
+      return 1;
+    }
+    s->recv_flags = 0;
+    queue_error(s, "%s", strerror(s->put_error));
+    s->state = S_COMMAND;
+    return 1;
+  }
+
+  if (s->recv_flags & FLAG_CHECKSUM)
+    s->recv_crc = crc32c(s->recv_crc, data, want);
+  while (want > 0) {
+    written = pwrite(s->file_fd, data, want, s->file_off);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0) {
+      log_warn("%s: write failed: %s", s->peer,
+               written < 0 ? strerror(errno) : "short write");
+      return -1;
+    }
+    if (!inflated)
+      s->conn.start += (size_t)written;
+    if (compressed && !inflated)
+      s->recv_chunk -= written;
+    data += written;
+    s->file_off += written;
+    s->recv_left -= written;
+    want -= (size_t)written;
+  }
+
+  if (s->recv_left > 0)
+    return compressed && s->recv_chunk == 0;
+
+  if (s->delta != NULL) {
+    s->delta->offset = s->file_off;
+    s->file_fd = -1;
+    s->state = S_DELTA_RECV;
+    return 1;
+  }
+  if (s->tree_fd >= 0) {
+    finish_file(s->file_fd, s->entry->path, s->entry->mtime);
+    s->file_fd = -1;
+    s->state = S_TREE_RECV;
+    return 1;
+  }
+  if (s->recv_flags & FLAG_CHECKSUM) {
+    s->state = S_PUT_CHECKSUM;
+    return 1;
+  }
+
+  log_info("%s: transfer completed", s->peer);
+  s->recv_flags = 0;
+  close_put(s->file_fd, &s->command);
+  s->file_fd = -1;
+  if (s->conn.version >= 2)
+    queue_frame(s, OP_OK, 0, s->command.id, NULL, 0);
+  s->state = S_COMMAND;
+  return 1;
+}
+
+/* Version 2: check the file that's been put against the CHECKSUM after it,
+   and answer for it. */
+int session_put_checksum(Session *s) {
+  Header header;
+  char *payload;
+  uint32_t crc;
+
+  if (take_frame(&s->conn, &header, &payload) < 0) {
+    if (errno == EAGAIN)
+      return 0;
+    log_warn("%s: message too long", s->peer);
+    return -1;
+  }
+  if (header.opcode != OP_CHECKSUM || header.id != s->command.id ||
+      header.length != CHECKSUM_SIZE) {
+    log_warn("%s: expected a checksum, got 0x%x", s->peer, header.opcode);
+    return -1;
+  }
+  memcpy(&crc, payload, sizeof crc);
+
+  s->recv_flags = 0;
+  s->state = S_COMMAND;
+  if (s->file_fd < 0) {
+    queue_error(s, "%s", strerror(s->put_error));
+    return 1;
+  }
+
+  close_put(s->file_fd, &s->command);
+  s->file_fd = -1;
+  if (ntohl(crc) != s->recv_crc) {
+    log_warn("%s: PUT failed: checksum mismatch", s->peer);
+    queue_error(s, "checksum mismatch");
+    return 1;
+  }
+  log_info("%s: transfer completed", s->peer);
+  queue_frame(s, OP_OK, 0, s->command.id, NULL, 0);
+  return 1;
+}
+
+/* Start a delta PUT: queue the signatures of our copy's blocks, then OK to
+   have the client send the delta. */
+int session_put_delta(Session *s) {
+  size_t next = 0, offset, used;
+  char *out;
+  Header header = {OP_SIGS, 0, s->command.id, 0};
+
+  log_info("%s: PUT delta %s", s->peer, s->command.put.path);
+
+  if ((s->delta = malloc(sizeof *s->delta)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  if (!delta_open(s->delta, s->command.put.path)) {
+    log_warn("%s: PUT failed: %s", s->peer, strerror(errno));
+    queue_error(s, "%s", strerror(errno));
+    free(s->delta);
+    s->delta = NULL;
+    return 1;
+  }
+  log_info("%s: %zu blocks of %uB", s->peer, s->delta->sigs.count,
+           s->delta->sigs.block);
+
+  for (;;) {
+    offset = s->out_len;
+    out = queue_space(s, HEADER_SIZE + DELTA_BATCH);
+    used = pack_sigs(&s->delta->sigs, &next, out + HEADER_SIZE, DELTA_BATCH);
+    s->out_len = offset;
+    if (used == 0)
+      break;
+    header.length = used;
+    pack_header(out, &header);
+    s->out_len += HEADER_SIZE + used;
+  }
+  queue_frame(s, OP_OK, 0, s->command.id, NULL, 0);
+  s->state = S_DELTA_RECV;
+  return 1;
+}
+
+/* Take the next frame of a delta: literal data is written like any other
+   PUT, runs of blocks are copied from the old file, and OK ends it. */
+int session_delta_recv(Session *s) {
+  Header header;
+  char *payload;
+  ssize_t len;
+
+  if (conn_buffered(&s->conn) < HEADER_SIZE)
+    return 0;
+  unpack_header(&header, s->conn.buf + s->conn.start);
+
+  if (header.opcode == OP_DATA) {
+    take_header(&s->conn, &header);
+    s->file_fd = s->delta->failure == NULL ? s->delta->out_fd : -1;
+    s->file_off = s->delta->offset;
+    s->recv_left = (off_t)header.length;
+    s->state = S_PUT_DATA;
+    return 1;
+  }
+  if (header.opcode != OP_OK && header.opcode != OP_BLOCKS) {
+    log_warn("%s: expected delta, got 0x%x", s->peer, header.opcode);
+    return -1;
+  }
+  if ((len = take_frame(&s->conn, &header, &payload)) < 0)
+    return errno == EAGAIN ? 0 : -1;
+  if (header.opcode == OP_BLOCKS) {
+    delta_copy(s->delta, payload, (size_t)len);
+    return 1;
+  }
+
+  if (delta_commit(s->delta, s->command.put.size)) {
+    log_info("%s: transfer completed", s->peer);
+    queue_frame(s, OP_OK, 0, s->command.id, NULL, 0);
+  } else {
+    log_warn("%s: PUT failed: %s", s->peer, s->delta->failure);
+    queue_error(s, "%s", s->delta->failure);
+  }
+  delta_close(s->delta);
+  free(s->delta);
+  s->delta = NULL;
+  s->state = S_COMMAND;
+  return 1;
+}
+
+/* Start sending a whole directory tree. */
+int session_get_tree(Session *s) {
+  log_info("%s: GET tree %s", s->peer, s->command.get.path);
+
+  if ((s->walk = malloc(sizeof *s->walk)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  if (!tree_open(s->walk, s->command.get.path)) {
+    log_warn("%s: GET failed: %s", s->peer, strerror(errno));
+    queue_error(s, "%s", strerror(errno));
+    free(s->walk);
+    s->walk = NULL;
+    return 1;
+  }
+
+  s->state = S_TREE_SEND;
+  return 1;
+}
+
+/* Once everything queued has gone, queue the next batch of a tree's
+   entries: small files along with their entries, until there's a good
+   batch, or a big file to be sent from file_fd on its own.  OK ends the tree.
+ */
+int session_tree_send(Session *s) {
+  TreeEntry entry;
+  size_t head, offset;
+  ssize_t got;
+  char *out;
+
+  while (s->out_len < GATHER_SIZE) {
+    if (tree_next(s->walk, &entry) == 0) {
+      tree_close(s->walk);
+      free(s->walk);
+      s->walk = NULL;
+      queue_frame(s, OP_OK, 0, s->command.id, NULL, 0);
+      s->state = S_COMMAND;
+      return 1;
+    }
+
+    head = entry_size(&entry);
+    if (entry.fd >= 0 && entry.size > SMALL_FILE) {
+      pack_entry(queue_space(s, head), s->command.id, &entry);
+      s->file_fd = entry.fd;
+      s->file_off = 0;
+      s->send_left = entry.size;
+      return 1;
+    }
+
+    /* The file may shrink as we read it, so its entry is packed after. */
+    offset = s->out_len;
+    out = queue_space(s, head + (size_t)entry.size);
+    if (entry.fd >= 0) {
+      got = read_small(&entry.fd, entry.path, entry.size, out + head);
+      if (got < 0) {
+        s->out_len = offset;
+        continue;
+      }
+      entry.size = got;
+    }
+    pack_entry(out, s->command.id, &entry);
+    s->out_len = offset + head + (size_t)entry.size;
+  }
+
+  return 1;
+}
+
+/* Expand the patterns of an MGET, to send the files a batch at a time. */
+int session_mget(Session *s) {
+  log_info("%s: MGET %s%s", s->peer, s->command.mget.patterns,
+           strlen(s->command.mget.patterns) + 1 < s->command.mget.length
+               ? " ..."
+               : "");
+
+  if ((s->files = malloc(sizeof *s->files)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  if (!mget_open(s->files, s->command.mget.patterns, s->command.mget.length)) {
+    log_warn("%s: MGET failed: %s", s->peer, strerror(errno));
+    queue_error(s, "%s", strerror(errno));
+    free(s->files);
+    s->files = NULL;
+    return 1;
+  }
+
+  s->state = S_MGET_SEND;
+  return 1;
+}
+
+/* Once everything queued has gone, queue the next batch of an MGET's files:
+   small ones along with their headers, until there's a good batch, or a big
+   one to be sent from file_fd on its own.  OK ends them.
+ */
+int session_mget_send(Session *s) {
+  MgetFile file;
+  size_t head, offset;
+  ssize_t got;
+  char *out;
+
+  while (s->out_len < GATHER_SIZE) {
+    if (mget_next(s->files, &file) == 0) {
+      mget_close(s->files);
+      free(s->files);
+      s->files = NULL;
+      queue_frame(s, OP_OK, 0, s->command.id, NULL, 0);
+      s->state = S_COMMAND;
+      return 1;
+    }
+
+    head = file_frame_size(&file);
+    if (file.fd >= 0 && file.size > SMALL_FILE) {
+      pack_file(queue_space(s, head), s->command.id, &file);
+      s->file_fd = file.fd;
+      s->file_off = 0;
+      s->send_left = file.size;
+      return 1;
+    }
+
+    /* The file may shrink as we read it, so its header is packed after. */
+    offset = s->out_len;
+    out = queue_space(s, head + (size_t)file.size + FILE_MESSAGE);
+    if (file.fd >= 0) {
+      got = read_small(&file.fd, file.path, file.size, out + head);
+      file.error = got < 0 ? EIO : 0;
+      file.size = got < 0 ? (off_t)strlen(strerror(EIO)) + 1 : got;
+    }
+    pack_file(out, s->command.id, &file);
+    s->out_len = offset + head + (size_t)file.size;
+  }
+
+  return 1;
+}
+
+/* Start receiving a whole directory tree into the path given. */
+int session_put_tree(Session *s) {
+  log_info("%s: PUT tree %s", s->peer, s->command.put.path);
+
+  if ((s->tree_fd = tree_mkroot(s->command.put.path)) < 0) {
+    log_warn("%s: PUT failed: %s", s->peer, strerror(errno));
+    queue_error(s, "%s", strerror(errno));
+    return 1;
+  }
+  if (s->entry == NULL && (s->entry = malloc(sizeof *s->entry)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+
+  s->tree_failed = 0;
+  queue_frame(s, OP_OK, 0, s->command.id, NULL, 0);
+  s->state = S_TREE_RECV;
+  return 1;
+}
+
+/* Make the next entry of a tree being received, once its header and path
+   are all here, then take its data like any other PUT.  The client's OK
+   ends the tree. */
+int session_tree_recv(Session *s) {
+  Header header;
+  char *payload;
+  size_t path_len;
+
+  if (conn_buffered(&s->conn) < HEADER_SIZE)
+    return 0;
+  unpack_header(&header, s->conn.buf + s->conn.start);
+
+  if (header.opcode == OP_OK) {
+    if (take_frame(&s->conn, &header, &payload) < 0)
+      return 0;
+    close(s->tree_fd);
+    s->tree_fd = -1;
+    if (s->tree_failed > 0)
+      queue_error(s, "%d entries couldn't be written", s->tree_failed);
+    else
+      queue_frame(s, OP_OK, 0, s->command.id, NULL, 0);
+    log_info("%s: transfer completed", s->peer);
+    s->state = S_COMMAND;
+    return 1;
+  }
+  if (header.opcode != OP_ENTRY || header.length < ENTRY_FIXED) {
+    log_warn("%s: expected tree entry, got 0x%x", s->peer, header.opcode);
+    return -1;
+  }
+
+  if (conn_buffered(&s->conn) < HEADER_SIZE + ENTRY_FIXED)
+    return 0;
+  path_len = entry_path_len(s->conn.buf + s->conn.start + HEADER_SIZE);
+  if (path_len > PATH_MAX) {
+    log_warn("%s: bad tree entry", s->peer);
+    return -1;
+  }
+  if (conn_buffered(&s->conn) < HEADER_SIZE + ENTRY_FIXED + path_len)
+    return 0;
+  if (!unpack_entry(s->entry, &header, s->conn.buf + s->conn.start +
+                                            HEADER_SIZE)) {
+    log_warn("%s: bad tree entry", s->peer);
+    return -1;
+  }
+  s->conn.start += HEADER_SIZE + ENTRY_FIXED + path_len;
+
+  if (!tree_create(s->tree_fd, s->entry, &s->file_fd)) {
+    log_warn("%s: %s: %s", s->peer, s->entry->path, strerror(errno));
+    s->tree_failed++;
+  }
+  s->file_off = 0;
+  s->recv_left = s->entry->size;
+  s->state = S_PUT_DATA;
+  return 1;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <netdb.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "compress.h"
+#include "delta.h"
+#include "filecache.h"
+#include "listing.h"
+#include "mget.h"
+#include "sftp.h"
+#include "stats.h"
+#include "transfer.h"
+#include "tree.h"
+
+/* Most events we handle per call to epoll_wait(). */
+#define MAX_EVENTS 64
+
+/* What a session is waiting to read next. */
+typedef enum SessionState_t {
+  S_COMMAND,      /* The next command. */
+  S_GET_CONFIRM,  /* GET: OK or NO after we sent the size. */
+  S_PUT_SIZE,     /* Version 1 PUT: the size of the file. */
+  S_PUT_HEADER,   /* Version 2 PUT: the DATA header. */
+  S_PUT_DATA,     /* PUT: the contents of the file. */
+  S_PUT_CHECKSUM, /* Version 2 PUT: the CHECKSUM after the DATA. */
+  S_LIST_SEND,    /* Nothing: LIST, sending the entries. */
+  S_TREE_SEND,    /* Nothing: GET of a tree, sending its entries. */
+  S_MGET_SEND,    /* Nothing: MGET, sending its files. */
+  S_TREE_RECV,    /* PUT of a tree: the next ENTRY, or OK at the end. */
+  S_DELTA_RECV,   /* Delta PUT: the next DATA or BLOCKS, or OK at the end. */
+  S_CLOSING,      /* Nothing: hang up once everything queued is sent. */
+} SessionState;
+
+/* A client session driven by the event loop.  Replies are queued in out and
+   sent as the socket allows, followed by send_left bytes of file_fd when
+   sending a file.  While receiving a file, recv_left bytes are still to be
+   written to file_fd.  send_flags and recv_flags are those of the DATA frame
+   the file goes in.  A file sent or received compressed goes in chunks, and
+   send_chunk or recv_chunk bytes of one sent as it is are still to go.  With
+   FLAG_CHECKSUM, send_crc or recv_crc is the CRC of the file so far.  A
+   directory being listed is read from listing.  A tree being sent is walked
+   with walk, and one being received is made under tree_fd, its entries one
+   by one in entry.  A file being rebuilt from a delta is in delta.
+ */
+typedef struct Session_t {
+  Connection conn;
+  SessionState state;
+  Command command;
+  char peer[INET6_ADDRSTRLEN];
+
+  char *out;
+  size_t out_size;
+  size_t out_len;
+  size_t out_sent;
+
+  int file_fd;
+  off_t file_size;
+  off_t file_off;
+  off_t send_left;
+  off_t recv_left;
+  int put_error;
+
+  uint16_t send_flags;
+  Packer packer;
+  off_t send_chunk;
+  uint32_t send_crc;
+  CachedFile *cached; /* Being sent instead of a file, or NULL. */
+  uint16_t recv_flags;
+  off_t recv_chunk;
+  uint32_t recv_crc;
+
+  Listing *listing;
+  TreeWalk *walk;
+  FileList *files; /* Still to be sent by an MGET. */
+  TreeEntry *entry;
+  int tree_fd;
+  int tree_failed;
+
+  Delta *delta;
+
+  bool in_request;     /* A request has started and not yet been counted. */
+  StatsSocket traffic; /* What's been counted of the socket's traffic. */
+  uint64_t started;    /* When the request started, if tracing. */
+
+  uint32_t events;
+} Session;
+
+int event_server(int[], int);
+void accept_sessions(int, int);
+
+Session *session_new(int, char[INET6_ADDRSTRLEN]);
+void session_free(Session *);
+bool session_event(Session *, uint32_t);
+bool session_pending(Session *);
+bool session_flush(Session *);
+bool queue_chunk(Session *);
+void send_done(Session *);
+bool session_read(Session *);
+bool session_process(Session *);
+
+char *queue_space(Session *, size_t);
+void queue_bytes(Session *, void *, size_t);
+void queue_message(Session *, char *, ...);
+void queue_frame(Session *, uint16_t, uint16_t, uint32_t, void *, size_t);
+void queue_error(Session *, char *, ...);
+
+void session_counted(Session *);
+int session_command(Session *);
+int session_list(Session *);
+int session_list_send(Session *);
+int session_get(Session *);
+int session_get_confirm(Session *);
+int session_get_tree(Session *);
+int session_tree_send(Session *);
+int session_mget(Session *);
+int session_mget_send(Session *);
+int session_stat(Session *);
+int session_stats(Session *);
+int session_put(Session *);
+int session_put_size(Session *);
+int session_put_header(Session *);
+int session_put_data(Session *);
+int session_put_checksum(Session *);
+int session_put_tree(Session *);
+int session_tree_recv(Session *);
+int session_put_delta(Session *);
+int session_delta_recv(Session *);
@@ -0,0 +1,490 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "filecache.h"
+#include "sftp.h"
+
+/* Anything that could change what a GET of a file in the directory sends,
+   or whether it's allowed. */
+#define FILECACHE_EVENTS                                                       \
+  (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MODIFY |            \
+   IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+/* The end of a chain of blocks. */
+#define NO_BLOCK UINT32_MAX
+
+/* The cache, mapped before the workers are started, so that it's at the same
+   address in every server process and they can all follow its pointers. */
+static FileCache *cache;
+
+static bool lock(void);
+static void unlock(void);
+static void drain(void);
+static unsigned hash_path(char *);
+static CachedFile *lookup(char *);
+static int find_watch(int);
+static int add_watch(char *);
+static void release_watch(int);
+static void invalidate(int, char *);
+static void lru_unlink(CachedFile *);
+static void lru_push(CachedFile *);
+static void uncache(CachedFile *);
+static void free_file(CachedFile *);
+
+/* Keep up to bytes of small files in memory shared by every server process,
+   to answer GETs for them without touching the filesystem.  With 0 bytes, or
+   if the memory can't be had, nothing is cached and false is returned.
+
+   Files are dropped on any inotify event in their directory naming them,
+   and everything from a directory on one for the directory itself.  The
+   inotify instance is shared too, and whichever process next looks up a
+   file reads whatever is queued, under the cache's lock, before it does.
+   The kernel queues events during the system call that makes the change,
+   so once a PUT has been answered, even by another process, no GET can be
+   served the old file.  Writes through a mapping of a file make no events,
+   and neither does moving a directory's parent, so neither is noticed.
+   Files with more than one link, or reached through a symbolic link, could
+   change from another directory, so they aren't cached.
+ */
+bool filecache_init(size_t bytes) {
+  pthread_mutexattr_t attr;
+  size_t blocks = bytes / FILECACHE_BLOCK, files, size, data_at;
+  char *p;
+
+  files = blocks / FILECACHE_BLOCKS_PER_FILE;
+  if (files == 0 || blocks >= NO_BLOCK)
+    return false;
+
+  data_at = sizeof *cache + files * sizeof(CachedFile) +
+            blocks * sizeof(uint32_t);
+  data_at = (data_at + FILECACHE_BLOCK - 1) / FILECACHE_BLOCK * FILECACHE_BLOCK;
+  size = data_at + blocks * FILECACHE_BLOCK;
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+           0);
+  if (p == MAP_FAILED) {
+    log_warn("not caching files: couldn't map memory: %s", strerror(errno));
+    return false;
+  }
+
+  cache = (FileCache *)p;
+  cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (cache->inotify_fd < 0) {
+    log_warn("not caching files: inotify_init1: %s", strerror(errno));
+    munmap(p, size);
+    cache = NULL;
+    return false;
+  }
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&cache->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  for (int i = 0; i < FILECACHE_WATCHES; i++)
+    cache->watches[i].wd = -1;
+
+  cache->files = (CachedFile *)(p + sizeof *cache);
+  cache->file_count = files;
+  for (size_t i = 0; i < files; i++) {
+    cache->files[i].hash_next = cache->free_files;
+    cache->free_files = &cache->files[i];
+  }
+
+  cache->next_block = (uint32_t *)(cache->files + files);
+  cache->data = p + data_at;
+  cache->block_count = (uint32_t)blocks;
+  for (uint32_t b = 0; b < blocks; b++)
+    cache->next_block[b] = b + 1 < blocks ? b + 1 : NO_BLOCK;
+  cache->free_block = 0;
+  cache->free_blocks = (uint32_t)blocks;
+  return true;
+}
+
+/* Could a GET with these flags be answered from the cache?  Only whole files
+   are cached, uncompressed. */
+bool filecache_wanted(uint16_t flags) {
+  return cache != NULL && !(flags & (FLAG_RANGE | FLAG_COMPRESS | FLAG_TREE));
+}
+
+/* Take the cache's lock.  Returns false, not holding it, if the cache can't
+   be trusted because a process died while changing it. */
+static bool lock(void) {
+  int err = pthread_mutex_lock(&cache->lock);
+
+  if (err == EOWNERDEAD) {
+    log_warn("a server process died holding the file cache, not caching");
+    cache->broken = true;
+    pthread_mutex_consistent(&cache->lock);
+  } else if (err != 0) {
+    return false;
+  }
+  if (cache->broken) {
+    unlock();
+    return false;
+  }
+  return true;
+}
+
+static void unlock(void) { pthread_mutex_unlock(&cache->lock); }
+
+static unsigned hash_path(char *path) {
+  unsigned h = 2166136261u;
+
+  for (; *path != '\0'; path++)
+    h = (h ^ (unsigned char)*path) * 16777619u;
+  return h % FILECACHE_BUCKETS;
+}
+
+static CachedFile *lookup(char *path) {
+  CachedFile *f;
+
+  for (f = cache->buckets[hash_path(path)]; f != NULL; f = f->hash_next)
+    if (!strcmp(f->path, path))
+      return f;
+  return NULL;
+}
+
+/* The index of the watch with descriptor wd, or -1. */
+static int find_watch(int wd) {
+  for (int i = 0; i < FILECACHE_WATCHES; i++)
+    if (cache->watches[i].wd == wd)
+      return i;
+  return -1;
+}
+
+/* Watch the directory at path, if it isn't already.  Returns the index of
+   its watch, or -1 if it can't be watched. */
+static int add_watch(char *path) {
+  int wd, i;
+
+  if ((wd = inotify_add_watch(cache->inotify_fd, path, FILECACHE_EVENTS)) < 0)
+    return -1;
+  if ((i = find_watch(wd)) >= 0)
+    return i;
+  if ((i = find_watch(-1)) < 0) {
+    inotify_rm_watch(cache->inotify_fd, wd);
+    return -1;
+  }
+  cache->watches[i].wd = wd;
+  cache->watches[i].files = NULL;
+  return i;
+}
+
+/* Stop watching a directory, once nothing's cached from it. */
+static void release_watch(int i) {
+  FileWatch *w = &cache->watches[i];
+
+  inotify_rm_watch(cache->inotify_fd, w->wd);
+  w->wd = -1;
+  w->generation++;
+}
+
+/* Something changed in a watched directory: drop the file named name from
+   it, or with a NULL name everything from it. */
+static void invalidate(int i, char *name) {
+  FileWatch *w = &cache->watches[i];
+  CachedFile *f, *next;
+  char *base;
+
+  w->generation++;
+  for (f = w->files; f != NULL; f = next) {
+    next = f->watch_next;
+    base = strrchr(f->path, '/');
+    if (name == NULL || !strcmp(base != NULL ? base + 1 : f->path, name))
+      uncache(f);
+  }
+  if (w->files == NULL && w->wd >= 0)
+    release_watch(i);
+}
+
+/* Read whatever inotify has queued, and drop the files it makes stale.
+   Only ever called with the lock held. */
+static void drain(void) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *event;
+  bool self;
+  ssize_t n;
+  int i;
+
+  while ((n = read(cache->inotify_fd, buf, sizeof buf)) > 0) {
+    for (char *p = buf; p < buf + n; p += sizeof *event + event->len) {
+      event = (struct inotify_event *)p;
+      self = event->len == 0 ||
+             (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED));
+      if (event->mask & IN_Q_OVERFLOW) {
+        /* We've lost track, so nothing cached can be trusted. */
+        for (i = 0; i < FILECACHE_WATCHES; i++)
+          if (cache->watches[i].wd >= 0)
+            invalidate(i, NULL);
+      } else if ((i = find_watch(event->wd)) >= 0) {
+        invalidate(i, self ? NULL : event->name);
+      }
+    }
+  }
+  if (n < 0 && errno != EAGAIN && errno != EINTR)
+    log_warn("reading inotify events: %s", strerror(errno));
+}
+
+static void lru_unlink(CachedFile *f) {
+  if (f->lru_prev != NULL)
+    f->lru_prev->lru_next = f->lru_next;
+  else
+    cache->lru_first = f->lru_next;
+  if (f->lru_next != NULL)
+    f->lru_next->lru_prev = f->lru_prev;
+  else
+    cache->lru_last = f->lru_prev;
+  f->lru_prev = f->lru_next = NULL;
+}
+
+static void lru_push(CachedFile *f) {
+  f->lru_next = cache->lru_first;
+  if (cache->lru_first != NULL)
+    cache->lru_first->lru_prev = f;
+  else
+    cache->lru_last = f;
+  cache->lru_first = f;
+}
+
+/* Drop a file from the cache.  Sessions still sending it keep its blocks
+   until they're done. */
+static void uncache(CachedFile *f) {
+  CachedFile **p;
+  FileWatch *w = &cache->watches[f->watch];
+
+  for (p = &cache->buckets[hash_path(f->path)]; *p != f; p = &(*p)->hash_next)
+    ;
+  *p = f->hash_next;
+  for (p = &w->files; *p != f; p = &(*p)->watch_next)
+    ;
+  *p = f->watch_next;
+  lru_unlink(f);
+
+  f->cached = false;
+  if (f->refs == 0)
+    free_file(f);
+}
+
+/* Give a file's blocks, and the file, back to be used again. */
+static void free_file(CachedFile *f) {
+  uint32_t last = f->first;
+
+  if (f->blocks > 0) {
+    for (uint32_t i = 1; i < f->blocks; i++)
+      last = cache->next_block[last];
+    cache->next_block[last] = cache->free_block;
+    cache->free_block = f->first;
+    cache->free_blocks += f->blocks;
+  }
+  f->blocks = 0;
+  f->hash_next = cache->free_files;
+  cache->free_files = f;
+}
+
+/* Look up the file at path, after catching up with whatever has changed.
+   Returns it with a reference the caller must give back with
+   filecache_release(), or NULL if it isn't cached. */
+CachedFile *filecache_find(char *path) {
+  CachedFile *f;
+
+  if (cache == NULL || !lock())
+    return NULL;
+  drain();
+  if ((f = lookup(path)) != NULL) {
+    lru_unlink(f);
+    lru_push(f);
+    f->refs++;
+  }
+  unlock();
+  return f;
+}
+
+/* Give back a reference to a file, freeing it if it was the last of a file
+   that's been dropped. */
+void filecache_release(CachedFile *f) {
+  if (!lock())
+    return;
+  if (--f->refs == 0 && !f->cached)
+    free_file(f);
+  unlock();
+}
+
+/* Cache the file at path, open as fd, with its attributes in fs, if it's
+   small enough and not cached already.  Its directory is watched first and
+   then it's read, and it's only cached if nothing has changed in the
+   directory meanwhile.  The least recently used files are dropped to make
+   room for it.
+ */
+void filecache_add(char *path, int fd, struct stat *fs) {
+  struct stat ls;
+  char dir[FILECACHE_PATH], *slash;
+  uint32_t need, b, last, generation, crc = 0;
+  size_t want;
+  off_t done;
+  ssize_t n;
+  CachedFile *f;
+  int i;
+  bool ok = true;
+
+  if (cache == NULL || !S_ISREG(fs->st_mode) || fs->st_nlink != 1 ||
+      fs->st_size > FILECACHE_MAX_FILE || strlen(path) >= FILECACHE_PATH)
+    return;
+  if (lstat(path, &ls) != 0 || ls.st_ino != fs->st_ino ||
+      ls.st_dev != fs->st_dev)
+    return;
+  need = (uint32_t)((fs->st_size + FILECACHE_BLOCK - 1) / FILECACHE_BLOCK);
+  if (need > cache->block_count)
+    return;
+
+  strcpy(dir, path);
+  if ((slash = strrchr(dir, '/')) == NULL)
+    strcpy(dir, ".");
+  else if (slash == dir)
+    dir[1] = '\0';
+  else
+    *slash = '\0';
+
+  if (!lock())
+    return;
+  drain();
+  if (lookup(path) != NULL || (i = add_watch(dir)) < 0) {
+    unlock();
+    return;
+  }
+  generation = cache->watches[i].generation;
+
+  while ((cache->free_blocks < need || cache->free_files == NULL) &&
+         cache->lru_last != NULL)
+    uncache(cache->lru_last);
+  if (cache->free_blocks < need || cache->free_files == NULL) {
+    if (cache->watches[i].files == NULL)
+      release_watch(i);
+    unlock();
+    return;
+  }
+
+  /* Take the file and its blocks, which nobody else will touch while it
+     isn't cached and holds a reference. */
+  f = cache->free_files;
+  cache->free_files = f->hash_next;
+  f->first = last = cache->free_block;
+  for (b = 1; b < need; b++)
+    last = cache->next_block[last];
+  cache->free_block = need > 0 ? cache->next_block[last] : cache->free_block;
+  if (need > 0)
+    cache->next_block[last] = NO_BLOCK;
+  cache->free_blocks -= need;
+  f->blocks = need;
+  f->size = fs->st_size;
+  f->watch = i;
+  f->refs = 1;
+  f->cached = false;
+  strcpy(f->path, path);
+  unlock();
+
+  for (b = f->first, done = 0; ok && done < f->size;
+       b = cache->next_block[b]) {
+    want = f->size - done < FILECACHE_BLOCK ? (size_t)(f->size - done)
+                                            : FILECACHE_BLOCK;
+    for (size_t got = 0; ok && got < want; got += (size_t)n) {
+      n = pread(fd, cache->data + (size_t)b * FILECACHE_BLOCK + got,
+                want - got, done + (off_t)got);
+      if (n < 0 && errno == EINTR)
+        n = 0;
+      else if (n <= 0)
+        ok = false;
+    }
+    crc = crc32c(crc, cache->data + (size_t)b * FILECACHE_BLOCK, want);
+    done += (off_t)want;
+  }
+  f->crc = crc;
+
+  if (!lock())
+    return;
+  drain();
+  if (ok && cache->watches[i].generation == generation &&
+      lookup(path) == NULL) {
+    f->cached = true;
+    f->hash_next = cache->buckets[hash_path(path)];
+    cache->buckets[hash_path(path)] = f;
+    f->watch_next = cache->watches[i].files;
+    cache->watches[i].files = f;
+    lru_push(f);
+    log_debug("cached %s, %lldB", path, (long long)f->size);
+  }
+  if (--f->refs == 0 && !f->cached)
+    free_file(f);
+  if (cache->watches[i].generation == generation &&
+      cache->watches[i].files == NULL)
+    release_watch(i);
+  unlock();
+}
+
+/* Send up to len bytes of a cached file from offset, as much as the socket
+   will take in one go, with the given send() flags.  Returns the bytes sent,
+   or -1 (errno is set). */
+ssize_t filecache_send(int sock_fd, CachedFile *f, off_t offset, size_t len,
+                       int flags) {
+  struct iovec iov[FILECACHE_IOV];
+  struct msghdr msg;
+  uint32_t b = f->first;
+  size_t skip, count = 0;
+
+  for (off_t at = FILECACHE_BLOCK; at <= offset; at += FILECACHE_BLOCK)
+    b = cache->next_block[b];
+  skip = (size_t)(offset % FILECACHE_BLOCK);
+
+  for (; len > 0 && count < FILECACHE_IOV; count++) {
+    iov[count].iov_base = cache->data + (size_t)b * FILECACHE_BLOCK + skip;
+    iov[count].iov_len =
+        FILECACHE_BLOCK - skip < len ? FILECACHE_BLOCK - skip : len;
+    len -= iov[count].iov_len;
+    skip = 0;
+    b = cache->next_block[b];
+  }
+
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+  return sendmsg(sock_fd, &msg, flags | MSG_NOSIGNAL);
+}
+
+/* Send a cached file in a DATA frame, as send_data() sends one that's open,
+   followed with FLAG_CHECKSUM by the CHECKSUM frame worked out when it was
+   cached.  Returns the bytes of the file sent, or -1 if the header or
+   checksum couldn't be. */
+off_t filecache_send_data(int sock_fd, uint32_t id, uint16_t flags,
+                          CachedFile *f) {
+  uint32_t crc = htonl(f->crc);
+  off_t sent = 0;
+  ssize_t n;
+
+  flags &= FLAG_CHECKSUM;
+  if (send_header(sock_fd, OP_DATA, flags, id, (uint64_t)f->size, MSG_MORE) < 0)
+    return -1;
+  while (sent < f->size) {
+    n = filecache_send(sock_fd, f, sent, (size_t)(f->size - sent), 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return sent;
+    sent += n;
+  }
+
+  if ((flags & FLAG_CHECKSUM) &&
+      send_frame(sock_fd, OP_CHECKSUM, 0, id, &crc, sizeof crc) < 0)
+    return -1;
+  return sent;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Default limit on the memory the GET cache takes, in megabytes. */
+#define FILECACHE_DEFAULT_MB 64
+
+/* Largest file cached.  Bigger ones gain little over sendfile(). */
+#define FILECACHE_MAX_FILE (1024 * 1024)
+
+/* Cached files are kept in blocks of this many bytes, chained together, so
+   that any free blocks will do for a file and the memory never fragments. */
+#define FILECACHE_BLOCK 4096
+
+/* Blocks of the cache for each file it can hold, at most. */
+#define FILECACHE_BLOCKS_PER_FILE 4
+
+/* Longest path cached, nil included. */
+#define FILECACHE_PATH 256
+
+/* Buckets in the table of files, and directories that can be watched. */
+#define FILECACHE_BUCKETS 1024
+#define FILECACHE_WATCHES 1024
+
+/* Most blocks sent with one sendmsg(). */
+#define FILECACHE_IOV 64
+
+/* A file kept for GETs.  Sessions sending it hold a reference, so that its
+   blocks aren't given to another file until they're done. */
+typedef struct CachedFile_t {
+  char path[FILECACHE_PATH];
+  off_t size;
+  uint32_t crc;      /* CRC-32C of the whole file. */
+  uint32_t first;    /* Its first block. */
+  uint32_t blocks;
+  int watch;         /* Index of the directory's watch. */
+  int refs;
+  bool cached;       /* Rather than dropped, waiting for refs to go. */
+
+  struct CachedFile_t *hash_next;
+  struct CachedFile_t *watch_next;
+  struct CachedFile_t *lru_prev;
+  struct CachedFile_t *lru_next;
+} CachedFile;
+
+/* An inotify watch on a directory that files are cached from, removed once
+   none are.  generation counts the events on it, to tell whether one came
+   while a file was being read. */
+typedef struct FileWatch_t {
+  int wd;
+  uint32_t generation;
+  CachedFile *files;
+} FileWatch;
+
+/* The cache, at the start of the memory it's kept in, which every server
+   process shares.  The files and blocks follow it. */
+typedef struct FileCache_t {
+  pthread_mutex_t lock;
+  bool broken; /* A process died holding the lock. */
+  int inotify_fd;
+
+  CachedFile *buckets[FILECACHE_BUCKETS];
+  FileWatch watches[FILECACHE_WATCHES];
+  CachedFile *lru_first; /* Most recently used. */
+  CachedFile *lru_last;
+  CachedFile *free_files;
+
+  CachedFile *files;
+  size_t file_count;
+  char *data;
+  uint32_t *next_block; /* The block after each in its file. */
+  uint32_t block_count;
+  uint32_t free_block;  /* First in a chain of free blocks. */
+  uint32_t free_blocks;
+} FileCache;
+
+bool filecache_init(size_t);
+bool filecache_wanted(uint16_t);
+CachedFile *filecache_find(char *);
+void filecache_release(CachedFile *);
+void filecache_add(char *, int, struct stat *);
+ssize_t filecache_send(int, CachedFile *, off_t, size_t, int);
+off_t filecache_send_data(int, uint32_t, uint16_t, CachedFile *);
@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "listing.h"
+#include "sftp.h"
+
+/* A directory entry as getdents64() returns it. */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static bool listing_read(Listing *);
+static bool listing_sort(Listing *);
+static int compare_names(const void *, const void *);
+static void listing_copy(Listing *, char *, size_t);
+static void listing_uncopy(Listing *);
+
+/* Start listing the directory at path, with the size, mtime and type of each
+   entry if stat is set, and in order of name if sort is.  Returns false, with
+   errno set, if it can't be read.
+ */
+bool listing_open(Listing *l, char *path, bool stat, bool sort) {
+  uint16_t flags = (stat ? FLAG_STAT : 0) | (sort ? FLAG_SORT : 0);
+
+  memset(l, 0, sizeof *l);
+  l->fd = -1;
+  l->stat = stat;
+
+  if ((l->cached = dircache_find(path, flags)) != NULL) {
+    l->count = l->cached->count;
+    return true;
+  }
+
+  /* Watch first, so that changes made while we read are noticed. */
+  if ((l->watch = dircache_watch(path)) != NULL &&
+      (l->path = strdup(path)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+
+  if ((l->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    listing_close(l);
+    return false;
+  }
+  if ((l->buf = malloc(LIST_READ)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+
+  if (sort && !listing_sort(l)) {
+    listing_close(l);
+    return false;
+  }
+  return true;
+}
+
+/* Let go of the directory and everything read from it, caching the listing
+   if it was read to the end. */
+void listing_close(Listing *l) {
+  uint16_t flags = (l->stat ? FLAG_STAT : 0) | (l->sorted ? FLAG_SORT : 0);
+  int err = errno;
+
+  if (l->cached != NULL)
+    dircache_release(l->cached);
+  if (l->watch != NULL && l->done) {
+    dircache_add(l->watch, l->path, flags, l->copy, l->ends, l->batches,
+                 l->count);
+    l->watch = NULL;
+    l->copy = NULL;
+    l->ends = NULL;
+  }
+  listing_uncopy(l);
+  free(l->path);
+
+  if (l->fd >= 0)
+    close(l->fd);
+  free(l->buf);
+  free(l->names);
+  free(l->arena);
+  memset(l, 0, sizeof *l);
+  l->fd = -1;
+  errno = err;
+}
+
+/* Read the next batch of entries from the directory.  Returns false at the
+   end of the directory, or if it couldn't be read. */
+static bool listing_read(Listing *l) {
+  long n = syscall(SYS_getdents64, l->fd, l->buf, LIST_READ);
+
+  if (n < 0) {
+    log_warn("getdents64: %s", strerror(errno));
+    listing_uncopy(l);
+  }
+  l->len = n > 0 ? (size_t)n : 0;
+  l->pos = 0;
+  return n > 0;
+}
+
+/* Read the whole directory and sort it by name, as alphasort() would. */
+static bool listing_sort(Listing *l) {
+  size_t used = 0, size = 0, len, *offsets = NULL, slots = 0;
+  struct linux_dirent64 *d;
+  char *arena;
+
+  for (;;) {
+    if (l->pos >= l->len && !listing_read(l))
+      break;
+    d = (struct linux_dirent64 *)(l->buf + l->pos);
+    l->pos += d->d_reclen;
+
+    /* Names go in one block, so their places are kept as offsets until it
+       stops moving. */
+    len = strlen(d->d_name) + 1;
+    if (used + len > size) {
+      size = size ? size * 2 : LIST_READ;
+      if ((arena = realloc(l->arena, size)) == NULL)
+        log_error("couldn't allocate memory: %s", strerror(errno));
+      l->arena = arena;
+    }
+    if (l->count == slots) {
+      slots = slots ? slots * 2 : 1024;
+      if ((offsets = realloc(offsets, slots * sizeof *offsets)) == NULL)
+        log_error("couldn't allocate memory: %s", strerror(errno));
+    }
+    memcpy(l->arena + used, d->d_name, len);
+    offsets[l->count++] = used;
+    used += len;
+  }
+
+  if (l->count > 0 &&
+      (l->names = malloc(l->count * sizeof *l->names)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  for (size_t i = 0; i < l->count; i++)
+    l->names[i] = l->arena + offsets[i];
+  free(offsets);
+
+  qsort(l->names, l->count, sizeof *l->names, compare_names);
+  l->sorted = true;
+  return true;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcoll(*(char *const *)a, *(char *const *)b);
+}
+
+/* The name of the next entry, without moving past it, or NULL at the end. */
+char *listing_peek(Listing *l) {
+  if (l->sorted)
+    return l->next < l->count ? l->names[l->next] : NULL;
+
+  if (l->pos >= l->len && !listing_read(l))
+    return NULL;
+  return ((struct linux_dirent64 *)(l->buf + l->pos))->d_name;
+}
+
+/* Move past the entry listing_peek() returned. */
+void listing_advance(Listing *l) {
+  if (l->sorted)
+    l->next++;
+  else
+    l->pos += ((struct linux_dirent64 *)(l->buf + l->pos))->d_reclen;
+}
+
+/* Pack as many entries as fit into batch, which holds size bytes.  Each is
+   its name, nil terminated, after LIST_STAT_FIXED bytes of type, size and
+   mtime if the listing wants them.  Entries that vanish before we can stat
+   them are left out.  Returns the bytes packed, or 0 once the listing is over.
+ */
+size_t listing_pack(Listing *l, char *batch, size_t size) {
+  struct stat fs;
+  size_t used = 0, len, start;
+  uint64_t be_size, be_mtime;
+  char *name;
+
+  /* Cached batches were packed with the same size as they're sent in. */
+  if (l->cached != NULL) {
+    if (l->batch >= l->cached->batches)
+      return 0;
+    start = l->batch > 0 ? l->cached->ends[l->batch - 1] : 0;
+    len = l->cached->ends[l->batch] - start;
+    if (len > size)
+      return 0;
+    memcpy(batch, l->cached->data + start, len);
+    l->batch++;
+    return len;
+  }
+
+  while ((name = listing_peek(l)) != NULL) {
+    len = strlen(name) + 1;
+    if (used + len + (l->stat ? LIST_STAT_FIXED : 0) > size)
+      break;
+
+    if (l->stat) {
+      if (fstatat(l->fd, name, &fs, AT_SYMLINK_NOFOLLOW) != 0) {
+        listing_advance(l);
+        continue;
+      }
+      be_size = htobe64((uint64_t)fs.st_size);
+      be_mtime = htobe64((uint64_t)mtime_ns(&fs));
+      batch[used] = file_type(fs.st_mode);
+      memcpy(batch + used + 1, &be_size, 8);
+      memcpy(batch + used + 9, &be_mtime, 8);
+      used += LIST_STAT_FIXED;
+    }
+    memcpy(batch + used, name, len);
+    used += len;
+    listing_advance(l);
+  }
+
+  if (l->watch != NULL)
+    listing_copy(l, batch, used);
+  return used;
+}
+
+/* Keep a copy of a batch for the cache.  An empty batch means the whole
+   directory has been read. */
+static void listing_copy(Listing *l, char *batch, size_t used) {
+  char *copy;
+  size_t *ends;
+
+  if (used == 0) {
+    l->done = true;
+    return;
+  }
+  if (!dircache_fits(l->copied + used + (l->batches + 1) * sizeof *ends)) {
+    listing_uncopy(l);
+    return;
+  }
+
+  if ((copy = realloc(l->copy, l->copied + used)) == NULL ||
+      (ends = realloc(l->ends, (l->batches + 1) * sizeof *ends)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  memcpy(copy + l->copied, batch, used);
+  l->copy = copy;
+  l->ends = ends;
+  l->copied += used;
+  l->ends[l->batches++] = l->copied;
+}
+
+/* Give up on caching the listing. */
+static void listing_uncopy(Listing *l) {
+  if (l->watch != NULL)
+    dircache_unwatch(l->watch);
+  free(l->copy);
+  free(l->ends);
+  l->watch = NULL;
+  l->copy = NULL;
+  l->ends = NULL;
+}
+
+/* The letter for a type of file, as find -printf %y has it. */
+char file_type(mode_t mode) {
+  switch (mode & S_IFMT) {
+  case S_IFREG:
+    return 'f';
+  case S_IFDIR:
+    return 'd';
+  case S_IFLNK:
+    return 'l';
+  case S_IFCHR:
+    return 'c';
+  case S_IFBLK:
+    return 'b';
+  case S_IFIFO:
+    return 'p';
+  case S_IFSOCK:
+    return 's';
+  }
+  return 'U';
+}
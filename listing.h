@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "dircache.h"
+
+/* How much of a directory is read with each getdents64(). */
+#define LIST_READ (64 * 1024)
+
+/* A directory being listed.  Entries are read a batch at a time with
+   getdents64() and packed straight into ENTRIES payloads, so an unsorted
+   listing takes no more memory however big the directory is.  A sorted one
+   has to read the whole directory first, into names.
+
+   A listing found in the cache is sent from there instead, batch by batch.
+   Otherwise, if the cache is on, what's packed is also copied into copy
+   under the watch, to be cached at the end if it's all there and fits.
+ */
+typedef struct Listing_t {
+  int fd;
+  bool stat;
+  bool sorted;
+
+  char *buf;
+  size_t len;
+  size_t pos;
+
+  char **names;
+  char *arena;
+  size_t count;
+  size_t next;
+
+  CachedList *cached;
+  size_t batch;
+
+  DirWatch *watch;
+  char *path;
+  char *copy;
+  size_t copied;
+  size_t *ends;
+  size_t batches;
+  bool done;
+} Listing;
+
+bool listing_open(Listing *, char *, bool, bool);
+void listing_close(Listing *);
+char *listing_peek(Listing *);
+void listing_advance(Listing *);
+size_t listing_pack(Listing *, char *, size_t);
+char file_type(mode_t);
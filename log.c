@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "sftp.h"
+
+/* Messages are formatted into a ring of records by whoever logs them, and a
+   thread of the process's own writes them out, so logging never waits for
+   the disk or the terminal.  Loggers take a record without a lock: each has
+   a sequence number saying whether it's free to fill or ready to write, as
+   in Dmitry Vyukov's bounded queue.  Only one thread writes records out at
+   a time, under writer_lock.
+
+   The writer thread doesn't survive fork(), so the child starts its own the
+   first time it logs.  Everything logged before the fork is written out
+   first, so that the child doesn't write it again.
+ */
+
+typedef struct LogRecord_t {
+  size_t seq;
+  int level;
+  time_t time;
+  char text[LOG_TEXT];
+} LogRecord;
+
+int log_level = LEVEL_INFO;
+
+static LogRecord records[LOG_RECORDS];
+static size_t head; /* Next record to fill. */
+static size_t tail; /* Next record to write out. */
+static size_t dropped;
+
+static int log_fd = STDERR_FILENO;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool writer_started = false;
+static bool writer_asleep = false;
+static uint32_t wake_count;
+
+static const char *level_names[] = {"[DEBUG]  ", "[INFO]   ", "[WARNING]",
+                                    "[ERROR]  "};
+
+static void write_records(void);
+
+/* Write everything out before forking, and keep it that way until the
+   fork's done. */
+static void prepare_fork(void) {
+  pthread_mutex_lock(&writer_lock);
+  write_records();
+}
+
+static void after_fork(void) {
+  pthread_mutex_unlock(&writer_lock);
+}
+
+static void after_fork_child(void) {
+  pthread_mutex_init(&writer_lock, NULL);
+  writer_started = false;
+  writer_asleep = false;
+}
+
+/* Make every record of the ring free to fill, the first time round. */
+__attribute__((constructor)) static void log_init(void) {
+  for (size_t i = 0; i < LOG_RECORDS; i++)
+    records[i].seq = i;
+  pthread_atfork(prepare_fork, after_fork, after_fork_child);
+}
+
+/* Write records to the log from now on to path, rather than standard error.
+   Returns false if it couldn't be opened. */
+bool log_open(char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+  if (fd < 0)
+    return false;
+  log_flush();
+  log_fd = fd;
+  return true;
+}
+
+static void write_all(char *buf, size_t len) {
+  ssize_t n;
+
+  for (; len > 0; buf += n, len -= (size_t)n)
+    if ((n = write(log_fd, buf, len)) < 0 && errno != EINTR)
+      return;
+    else if (n < 0)
+      n = 0;
+}
+
+/* The time as the log shows it, worked out again only when the second
+   changes. */
+static char *time_string(time_t t) {
+  static time_t cached = -1;
+  static char text[16];
+  struct tm tm;
+
+  if (t != cached) {
+    if (gmtime_r(&t, &tm) == NULL)
+      snprintf(text, sizeof text, "?????????");
+    else
+      strftime(text, sizeof text, "%H:%M:%S", &tm);
+    cached = t;
+  }
+  return text;
+}
+
+/* Write out every record that's ready, a batch at a time.  Only ever called
+   with writer_lock held. */
+static void write_records(void) {
+  char batch[LOG_BATCH];
+  size_t used = 0, lost;
+  LogRecord *r;
+  int n;
+
+  for (;;) {
+    r = &records[tail % LOG_RECORDS];
+    if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != tail + 1)
+      break;
+
+    if (used + LOG_TEXT + 64 > sizeof batch) {
+      write_all(batch, used);
+      used = 0;
+    }
+    n = snprintf(batch + used, sizeof batch - used, "%s %s %s: %s\n",
+                 program_name, level_names[r->level], time_string(r->time),
+                 r->text);
+    if (n > 0)
+      used += (size_t)n < sizeof batch - used ? (size_t)n
+                                              : sizeof batch - used - 1;
+
+    /* Free the record for the next time round the ring. */
+    __atomic_store_n(&r->seq, tail + LOG_RECORDS, __ATOMIC_RELEASE);
+    tail++;
+  }
+
+  if ((lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED)) > 0) {
+    n = snprintf(batch + used, sizeof batch - used,
+                 "%s [WARNING] %s: %zu log messages dropped\n", program_name,
+                 time_string(time(NULL)), lost);
+    if (n > 0 && (size_t)n < sizeof batch - used)
+      used += (size_t)n;
+  }
+  write_all(batch, used);
+}
+
+static bool records_waiting(void) {
+  return __atomic_load_n(&records[tail % LOG_RECORDS].seq, __ATOMIC_ACQUIRE) ==
+         tail + 1;
+}
+
+/* The writer thread: write out whatever's ready, then sleep until a logger
+   wakes it.  It says it's going to sleep before looking one last time, and
+   a logger marks its record ready before looking to see if the writer's
+   asleep.  Each side stores then loads what the other stores, and a store
+   can otherwise sit in a CPU's store buffer while the load that follows it
+   goes ahead, so both would read the old values: the writer sleeping on a
+   ready record and the logger not waking it.  A full fence between the store
+   and the load on each side puts both pairs in one order, so at least one
+   of them sees the other's store: the logger sees the writer going to
+   sleep and wakes it, or the writer sees the record and doesn't sleep.  The
+   futex wait on wake_count, read before writing, catches a wake that comes
+   between the last look and the sleep.
+ */
+static void *writer(__attribute__((unused)) void *arg) {
+  uint32_t count;
+
+  for (;;) {
+    count = __atomic_load_n(&wake_count, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&writer_lock);
+    write_records();
+    pthread_mutex_unlock(&writer_lock);
+
+    __atomic_store_n(&writer_asleep, true, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!records_waiting())
+      syscall(SYS_futex, &wake_count, FUTEX_WAIT_PRIVATE, count, NULL, NULL,
+              0);
+    __atomic_store_n(&writer_asleep, false, __ATOMIC_SEQ_CST);
+  }
+  return NULL;
+}
+
+static void start_writer(void) {
+  static bool registered = false;
+  pthread_attr_t attr;
+  pthread_t thread;
+
+  writer_started = true;
+  if (!registered) {
+    atexit(log_flush);
+    registered = true;
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, 2 * LOG_BATCH + 64 * 1024);
+  if (pthread_create(&thread, &attr, writer, NULL) != 0)
+    writer_started = false; /* Write as we go instead, as log_flush() does. */
+  pthread_attr_destroy(&attr);
+}
+
+/* Log a message at the given level: take the next record, format the
+   message into it and mark it ready.  Use log_info() and the like rather
+   than calling this, so that nothing's worked out for messages that aren't
+   logged.
+ */
+int log_write(int level, char *message, ...) {
+  struct timespec now;
+  LogRecord *r;
+  size_t pos, seq;
+  va_list argp;
+  int len;
+
+  if (!writer_started)
+    start_writer();
+
+  pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  for (;;) {
+    r = &records[pos % LOG_RECORDS];
+    seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+    if (seq != pos) {
+      if ((intptr_t)(seq - pos) < 0) {
+        /* The ring is full. */
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+      }
+      pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    } else if (__atomic_compare_exchange_n(&head, &pos, pos + 1, true,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+
+  /* The coarse clock is read without a system call, and seconds are all
+     the log shows. */
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  r->level = level;
+  r->time = now.tv_sec;
+  va_start(argp, message);
+  len = vsnprintf(r->text, sizeof r->text, message, argp);
+  va_end(argp);
+  __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST); /* See writer(). */
+
+  if (!writer_started) {
+    log_flush();
+  } else if (__atomic_load_n(&writer_asleep, __ATOMIC_SEQ_CST)) {
+    __atomic_fetch_add(&wake_count, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &wake_count, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+  return len;
+}
+
+/* Write out everything logged so far, before this returns. */
+void log_flush(void) {
+  pthread_mutex_lock(&writer_lock);
+  write_records();
+  pthread_mutex_unlock(&writer_lock);
+}
+
+/* Log an error, straight away, and exit. */
+int log_error(char *message, ...) {
+  char text[LOG_TEXT];
+  va_list argp;
+
+  va_start(argp, message);
+  vsnprintf(text, sizeof text, message, argp);
+  va_end(argp);
+
+  pthread_mutex_lock(&writer_lock);
+  write_records();
+  dprintf(log_fd, "%s %s %s: %s\n", program_name, level_names[LEVEL_ERROR],
+          time_string(time(NULL)), text);
+  pthread_mutex_unlock(&writer_lock);
+  exit(EXIT_FAILURE);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* How important a log message is.  Messages below log_level aren't logged,
+   and their arguments aren't even worked out. */
+enum LogLevel {
+  LEVEL_DEBUG,
+  LEVEL_INFO,
+  LEVEL_WARN,
+  LEVEL_ERROR,
+};
+
+/* Messages wait to be written in a ring of this many records, each holding
+   up to LOG_TEXT bytes of message; longer ones are cut short.  When it's
+   full, messages are dropped rather than wait for room. */
+#define LOG_RECORDS 1024
+#define LOG_TEXT 240
+
+/* Most bytes written to the log at once. */
+#define LOG_BATCH (16 * 1024)
+
+extern int log_level;
+
+#define log_debug(...)                                                         \
+  (log_level <= LEVEL_DEBUG ? log_write(LEVEL_DEBUG, __VA_ARGS__) : 0)
+#define log_info(...)                                                          \
+  (log_level <= LEVEL_INFO ? log_write(LEVEL_INFO, __VA_ARGS__) : 0)
+#define log_warn(...)                                                          \
+  (log_level <= LEVEL_WARN ? log_write(LEVEL_WARN, __VA_ARGS__) : 0)
+
+int log_write(int, char *, ...);
+__attribute__((noreturn)) int log_error(char *, ...);
+bool log_open(char *);
+void log_flush(void);
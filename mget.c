@@ -0,0 +1,271 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <search.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "mget.h"
+#include "sftp.h"
+#include "transfer.h"
+
+/* An MGET asks for many files at once, by path or by glob(7) pattern, and
+   they all come back in one stream of FILE frames ended by OK: no SIZE, no
+   OK from the client, and no round trip between one file and the next.
+ */
+
+/* Expand the len bytes of nil terminated patterns of an MGET.  A pattern
+   that matches nothing is kept as it is, so that the client hears why it
+   can't have it.  Returns false, with errno set, if they can't be expanded.
+ */
+bool mget_open(FileList *files, char *patterns, size_t len) {
+  int flags = GLOB_NOCHECK, err;
+  char *p;
+
+  memset(&files->found, 0, sizeof files->found);
+  files->next = 0;
+  for (p = patterns; p < patterns + len; p += strlen(p) + 1) {
+    if (*p == '\0')
+      continue;
+    if ((err = glob(p, flags, NULL, &files->found)) != 0) {
+      globfree(&files->found);
+      errno = err == GLOB_NOSPACE ? ENOMEM : EINVAL;
+      return false;
+    }
+    flags |= GLOB_APPEND;
+  }
+  return true;
+}
+
+void mget_close(FileList *files) { globfree(&files->found); }
+
+/* Open the next file of the list for sending.  One that can't be opened, or
+   isn't a regular file, comes back with error set.  Returns 1 with the file
+   filled in, or 0 when there are no more. */
+int mget_next(FileList *files, MgetFile *file) {
+  struct stat fs;
+
+  if (files->next >= files->found.gl_pathc)
+    return 0;
+
+  file->path = files->found.gl_pathv[files->next++];
+  file->mtime = 0;
+  file->error = 0;
+  /* Not blocking, as the event loop calls this too and a FIFO would stop it
+     until it had a writer. */
+  file->fd = open(file->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (file->fd < 0 || fstat(file->fd, &fs) != 0)
+    file->error = errno;
+  else if (!S_ISREG(fs.st_mode))
+    file->error = S_ISDIR(fs.st_mode) ? EISDIR : EINVAL;
+
+  if (file->error != 0) {
+    if (file->fd >= 0)
+      close(file->fd);
+    file->fd = -1;
+    file->size = (off_t)strlen(strerror(file->error)) + 1;
+    return 1;
+  }
+  file->size = fs.st_size;
+  file->mtime = mtime_ns(&fs);
+  return 1;
+}
+
+/* Bytes a file's frame takes on the wire, not counting its data. */
+size_t file_frame_size(MgetFile *file) {
+  return HEADER_SIZE + FILE_FIXED + strlen(file->path) + 1;
+}
+
+/* Write the FILE frame header, fixed part and path for a file into buf,
+   which must have room for file_frame_size() bytes.  Its data follows, or
+   for a file that can't be sent the reason why, which is written too. */
+void pack_file(char *buf, uint32_t id, MgetFile *file) {
+  size_t path_len = strlen(file->path) + 1;
+  Header header = {OP_FILE, 0, id,
+                   FILE_FIXED + path_len + (uint64_t)file->size};
+  uint32_t status = htobe32(file->error != 0 ? FILE_FAILED : FILE_SENT);
+  uint32_t be_len = htobe32((uint32_t)path_len);
+  uint64_t mtime = htobe64((uint64_t)file->mtime);
+
+  pack_header(buf, &header);
+  buf += HEADER_SIZE;
+  memcpy(buf, &status, 4);
+  memcpy(buf + 4, &be_len, 4);
+  memcpy(buf + 8, &mtime, 8);
+  memcpy(buf + FILE_FIXED, file->path, path_len);
+  if (file->error != 0)
+    memcpy(buf + FILE_FIXED + path_len, strerror(file->error),
+           (size_t)file->size);
+}
+
+/* Send every file in the list as a FILE frame.  Small files are gathered up
+   with their headers and sent many at a time; bigger ones go out with
+   send_file() on their own.  The caller ends the stream with an OK.  Returns
+   the number of files sent, or -1 if the connection failed.
+ */
+ssize_t send_mget(int sock, uint32_t id, FileList *files) {
+  MgetFile file;
+  Gather gather;
+  size_t head;
+  ssize_t count = 0, got;
+  char *out;
+
+  gather_init(&gather, sock);
+  while (mget_next(files, &file) > 0) {
+    head = file_frame_size(&file);
+    if (file.fd >= 0 && file.size > SMALL_FILE) {
+      if ((out = gather_room(&gather, head)) == NULL)
+        goto fail;
+      pack_file(out, id, &file);
+      gather.used += head;
+      if (!gather_file(&gather, file.fd, file.path, file.size))
+        goto fail;
+      count++;
+      continue;
+    }
+
+    /* The file may shrink as we read it, so its header is packed after, and
+       there's room left to say why should it fail to be read. */
+    out = gather_room(&gather, head + (size_t)file.size + FILE_MESSAGE);
+    if (out == NULL)
+      goto fail;
+    if (file.fd >= 0) {
+      got = read_small(&file.fd, file.path, file.size, out + head);
+      file.error = got < 0 ? EIO : 0;
+      file.size = got < 0 ? (off_t)strlen(strerror(EIO)) + 1 : got;
+    }
+    pack_file(out, id, &file);
+    gather.used += head + (size_t)file.size;
+    count += file.error == 0;
+  }
+
+  if (!gather_flush(&gather))
+    goto fail;
+  gather_free(&gather);
+  return count;
+
+fail:
+  gather_free(&gather);
+  return -1;
+}
+
+/* The name a file of an MGET is saved under here: the last part of its path
+   on the server.  Returns NULL if that isn't a name a file can have. */
+char *mget_local_name(char *path) {
+  char *name = strrchr(path, '/');
+
+  name = name != NULL ? name + 1 : path;
+  if (*name == '\0' || !strcmp(name, ".") || !strcmp(name, ".."))
+    return NULL;
+  return name;
+}
+
+static int compare_names(const void *a, const void *b) { return strcmp(a, b); }
+
+/* Receive FILE frames into the current directory, each file written as it
+   arrives under mget_local_name(), until some other frame (normally OK)
+   ends them.  That frame is left in end and payload, and how many files
+   couldn't be had in failed, which counts any refused for having the name
+   of one already saved, rather than let them overwrite it.  Returns how
+   many were written, or -1 if the connection failed.
+ */
+ssize_t recv_mget(Connection *conn, Header *end, char **payload,
+                  ssize_t *failed) {
+  char *fixed, *path, *name, **saved;
+  uint32_t status, path_len;
+  int64_t mtime;
+  uint64_t be_mtime;
+  off_t size, written;
+  ssize_t count = 0, result = -1;
+  void *names = NULL; /* Every local name used so far. */
+  int fd;
+
+  *failed = 0;
+  for (;;) {
+    if (recv_header(conn, end) < 0)
+      goto done;
+    if (end->opcode != OP_FILE) {
+      if (recv_payload(conn, end, payload) >= 0)
+        result = count;
+      goto done;
+    }
+
+    if (end->length < FILE_FIXED || conn_need(conn, FILE_FIXED) < 0)
+      goto done;
+    fixed = conn->buf + conn->start;
+    memcpy(&status, fixed, 4);
+    memcpy(&path_len, fixed + 4, 4);
+    memcpy(&be_mtime, fixed + 8, 8);
+    status = be32toh(status);
+    path_len = be32toh(path_len);
+    mtime = (int64_t)be64toh(be_mtime);
+    if (path_len == 0 || path_len > PATH_MAX ||
+        end->length < FILE_FIXED + (uint64_t)path_len ||
+        conn_need(conn, FILE_FIXED + path_len) < 0 ||
+        conn->buf[conn->start + FILE_FIXED + path_len - 1] != '\0') {
+      log_warn("bad MGET file");
+      goto done;
+    }
+    size = (off_t)(end->length - FILE_FIXED - path_len);
+
+    if (status != FILE_SENT) {
+      if (size > FILE_MESSAGE ||
+          conn_need(conn, FILE_FIXED + path_len + (size_t)size) < 0) {
+        log_warn("bad MGET file");
+        goto done;
+      }
+      path = conn->buf + conn->start + FILE_FIXED;
+      log_warn("%s: %.*s", path, (int)size, path + path_len);
+      conn->start += FILE_FIXED + path_len + (size_t)size;
+      (*failed)++;
+      continue;
+    }
+
+    /* Copied, as receiving the data may move the buffer. */
+    path = strdup(conn->buf + conn->start + FILE_FIXED);
+    conn->start += FILE_FIXED + path_len;
+    if (path == NULL)
+      log_error("couldn't allocate memory: %s", strerror(errno));
+
+    fd = -1;
+    if ((name = mget_local_name(path)) == NULL) {
+      log_warn("%s: not a name to save a file under", path);
+    } else if ((name = strdup(name)) == NULL ||
+               (saved = tsearch(name, &names, compare_names)) == NULL) {
+      log_error("couldn't allocate memory: %s", strerror(errno));
+    } else if (*saved != name) {
+      log_warn("%s: not saved, as another file was saved as %s", path, name);
+      free(name);
+    } else if ((fd = open(name, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+                          0666)) < 0) {
+      log_warn("couldn't open %s: %s", name, strerror(errno));
+    }
+    if (fd < 0) {
+      free(path);
+      (*failed)++;
+      if (discard_data(conn, size) != size)
+        goto done;
+      continue;
+    }
+
+    written = recv_file(conn, fd, 0, size);
+    if (written == size)
+      log_debug("%s: %lldB", name, (long long)size);
+    finish_file(fd, name, mtime);
+    free(path);
+    if (written != size)
+      goto done;
+    count++;
+  }
+
+done:
+  tdestroy(names, free);
+  return result;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <glob.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sftp.h"
+
+/* Size of the fixed part of a FILE payload, before the path: its status,
+   the length of the path and its mtime. */
+#define FILE_FIXED 16
+
+/* Status of a FILE: sent, with its data after the path, or not, with why
+   after the path instead. */
+#define FILE_SENT 0
+#define FILE_FAILED 1
+
+/* Longest reason given for a file that couldn't be sent. */
+#define FILE_MESSAGE 256
+
+/* The files an MGET asks for, its patterns expanded into paths. */
+typedef struct FileList_t {
+  glob_t found;
+  size_t next;
+} FileList;
+
+/* One file of an MGET, being sent or received.  A file that can't be sent
+   has error set and no data, and size is then the length of its message. */
+typedef struct MgetFile_t {
+  char *path;
+  int64_t mtime;
+  off_t size;
+  int fd;    /* Open on the file being sent, otherwise -1. */
+  int error; /* Why it can't be, or 0. */
+} MgetFile;
+
+bool mget_open(FileList *, char *, size_t);
+void mget_close(FileList *);
+int mget_next(FileList *, MgetFile *);
+
+size_t file_frame_size(MgetFile *);
+void pack_file(char *, uint32_t, MgetFile *);
+
+ssize_t send_mget(int, uint32_t, FileList *);
+ssize_t recv_mget(Connection *, Header *, char **, ssize_t *);
+char *mget_local_name(char *);
@@ -1,22 +1,39 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
-#include <dirent.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "compress.h"
+#include "delta.h"
+#include "dircache.h"
+#include "event.h"
+#include "filecache.h"
+#include "listing.h"
+#include "mget.h"
 #include "server.h"
 #include "sftp.h"
+#include "stats.h"
+#include "trace.h"
+#include "transfer.h"
+#include "tree.h"
+
+Options options;
 
 /* Handler used to ensure ended sessions die smoothly. */
 void sigchld_handler(__attribute__((unused)) int s) {
@@ -31,22 +48,129 @@ void default_options(Options *opts) {
   if (opts != NULL) {
     opts->port = DEFAULT_PORT;
     opts->backlog = DEFAULT_BACKLOG;
+    opts->max_message = DEFAULT_MAX_MESSAGE;
+    opts->event_mode = false;
+    opts->workers = 1;
+    opts->pin_workers = false;
+    opts->list_cache = (size_t)DIRCACHE_DEFAULT_MB << 20;
+    opts->file_cache = (size_t)FILECACHE_DEFAULT_MB << 20;
+    opts->stats_file = NULL;
+    opts->log_file = NULL;
+    opts->trace_file = NULL;
+  }
+}
+
+/* Print how to call the server and exit. */
+void usage() {
+  fprintf(stderr,
+          "usage: %s [-e] [-u] [-a] [-W] [-w workers] [-m max-message-bytes] "
+          "[-c list-cache-mb] [-f file-cache-mb] [-S writeback-mb] "
+          "[-p port] [-s stats-file] [-v] [-l log-file] [-T trace-file]\n",
+          program_name);
+  exit(EXIT_FAILURE);
+}
+
+/* Fill in the options from the command line. */
+void parse_options(Options *opts, int argc, char *argv[]) {
+  int opt;
+  char *end;
+  unsigned long mb;
+
+  while ((opt = getopt(argc, argv, "ac:ef:l:m:p:s:S:T:vw:uW")) != -1) {
+    switch (opt) {
+    case 'c':
+      mb = strtoul(optarg, &end, 10);
+      if (*end != '\0' || *optarg == '\0')
+        usage();
+      opts->list_cache = (size_t)mb << 20;
+      break;
+    case 'f':
+      mb = strtoul(optarg, &end, 10);
+      if (*end != '\0' || *optarg == '\0')
+        usage();
+      opts->file_cache = (size_t)mb << 20;
+      break;
+    case 'u':
+#ifdef SFTP_URING
+      use_uring = true;
+#else
+      log_warn("built without io_uring support, ignoring -u");
+#endif
+      break;
+    case 'W':
+      write_behind = true;
+      break;
+    case 'S':
+      mb = strtoul(optarg, &end, 10);
+      if (*end != '\0' || *optarg == '\0')
+        usage();
+      writeback_step = (off_t)mb << 20;
+      write_behind = true;
+      break;
+    case 'a':
+      opts->pin_workers = true;
+      break;
+    case 'e':
+      opts->event_mode = true;
+      break;
+    case 'm':
+      opts->max_message = strtoul(optarg, &end, 10);
+      if (*end != '\0' || opts->max_message == 0)
+        usage();
+      break;
+    case 'p':
+      opts->port = optarg;
+      break;
+    case 's':
+      opts->stats_file = optarg;
+      break;
+    case 'l':
+      opts->log_file = optarg;
+      break;
+    case 'v':
+      log_level = LEVEL_DEBUG;
+      break;
+    case 'T':
+#ifdef SFTP_TRACE
+      opts->trace_file = optarg;
+#else
+      log_warn("built without tracing, ignoring -T");
+#endif
+      break;
+    case 'w':
+      opts->workers = atoi(optarg);
+      if (opts->workers < 1)
+        usage();
+      break;
+    default:
+      usage();
+    }
   }
+
+  if (optind != argc)
+    usage();
 }
 
-/* Get and bind to the first available socket, based on the hints given. */
-int get_bind_socket(struct addrinfo *hints) {
+/* Get and bind a socket for every address available, based on the hints
+   given, so we listen on IPv4 and IPv6 at once.  Up to max sockets are put
+   in sock_fds; returns how many.
+
+   When running several workers each binds its own sockets with SO_REUSEPORT
+   and the kernel shares incoming connections out between them.
+ */
+int get_bind_sockets(struct addrinfo *hints, int sock_fds[], int max) {
   int sock_fd = -1;
   struct addrinfo *servinfo, *p;
   int yes = 1;
   int err;
+  int n = 0;
 
   if ((err = getaddrinfo(NULL, options.port, hints, &servinfo)) != 0) {
     log_error("getaddrinfo: %s\n", gai_strerror(err));
   }
 
-  /* Loop through all the results and bind to the first we can. */
-  for (p = servinfo; p != NULL; p = p->ai_next) {
+  /* Loop through all the results and bind to every one we can. */
+  for (p = servinfo; p != NULL && n < max; p = p->ai_next) {
     if ((sock_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) ==
         -1) {
       log_warn("socket: %s", strerror(errno));
@@ -58,18 +182,33 @@ int get_bind_socket(struct addrinfo *hints) {
       log_error("setsockopt: %s", strerror(errno));
     }
 
+    if (options.workers > 1 &&
+        setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) ==
+            -1) {
+      log_error("setsockopt: %s", strerror(errno));
+    }
+
+    /* Otherwise the IPv6 socket also claims the IPv4 port. */
+    if (p->ai_family == AF_INET6 &&
+        setsockopt(sock_fd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(int)) ==
+            -1) {
+      log_warn("setsockopt: %s", strerror(errno));
+    }
+
     if (bind(sock_fd, p->ai_addr, p->ai_addrlen) == -1) {
       close(sock_fd);
       log_warn("bind: %s", strerror(errno));
       continue;
     }
 
-    break;
+    sock_fds[n++] = sock_fd;
   }
 
   freeaddrinfo(servinfo);
 
-  return sock_fd;
+  if (n == 0)
+    log_error("failed to bind");
+  return n;
 }
 
 /* Try and listen on a file descriptor */
@@ -109,37 +248,93 @@ int accept_connection(int sock_fd, char from[INET6_ADDRSTRLEN]) {
   return new_fd;
 }
 
+/* Wait for a connection on any of the listeners and accept it. */
+int accept_any(int sock_fds[], int n, char from[INET6_ADDRSTRLEN]) {
+  struct pollfd fds[MAX_LISTENERS];
+
+  if (n == 1)
+    return accept_connection(sock_fds[0], from);
+
+  for (int i = 0; i < n; i++) {
+    fds[i].fd = sock_fds[i];
+    fds[i].events = POLLIN;
+  }
+
+  /* Reaping sessions interrupts poll(), so just go round again. */
+  if (poll(fds, (nfds_t)n, -1) <= 0)
+    return -1;
+
+  for (int i = 0; i < n; i++)
+    if (fds[i].revents & POLLIN)
+      return accept_connection(sock_fds[i], from);
+
+  return -1;
+}
+
 /* Set up the server and as connections come in bind them to their own session
    of the file transfer server.
  */
-int main(__attribute__((unused)) int argc, char *argv[]) {
-  int sock_fd, new_fd;
-  struct addrinfo hints;
-
+int main(int argc, char *argv[]) {
   program_name = argv[0];
   default_options(&options);
+  parse_options(&options, argc, argv);
+  if (options.log_file != NULL && !log_open(options.log_file))
+    log_error("couldn't open %s: %s", options.log_file, strerror(errno));
+  if (options.trace_file != NULL && !trace_open(options.trace_file))
+    log_error("couldn't start tracing: %s", strerror(errno));
+  /* A forked session would take an inotify instance to fill a cache that
+     dies with it, so listings are only cached by the event loop. */
+  dircache_init(options.event_mode ? options.list_cache : 0);
+  filecache_init(options.file_cache);
+  if (stats_init(options.workers) && options.stats_file != NULL)
+    stats_dump(options.stats_file);
+
+  if (options.workers > 1)
+    return start_workers();
+  return serve(0);
+}
+
+/* Run a worker: listen on every address and serve the connections that come
+   in, either by forking a session per connection or from the event loop.
+ */
+int serve(int worker) {
+  int sock_fds[MAX_LISTENERS];
+  int n, new_fd;
+  struct addrinfo hints;
+
+  if (options.pin_workers)
+    pin_to_cpu(worker);
+  stats_worker(worker);
 
   memset(&hints, 0, sizeof hints);
   hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_flags = AI_PASSIVE; /* Use my IP. */
 
-  sock_fd = get_bind_socket(&hints);
-  listen_on(sock_fd);
+  n = get_bind_sockets(&hints, sock_fds, MAX_LISTENERS);
+  for (int i = 0; i < n; i++)
+    listen_on(sock_fds[i]);
   setup_process_reaping();
 
-  log_info("waiting for connections");
+  if (options.workers > 1)
+    log_info("worker %d waiting for connections", worker);
+  else
+    log_info("waiting for connections");
+
+  if (options.event_mode)
+    return event_server(sock_fds, n);
 
   /* Listen for connections, and set up server instances. */
   for (;;) {
-    if ((new_fd = accept_connection(sock_fd, options.connection)) < 0)
+    if ((new_fd = accept_any(sock_fds, n, options.connection)) < 0)
       continue;
 
     log_info("got connection from %s", options.connection);
 
     if (!fork()) {
-      /* Child process: we don't need the listener. */
-      close(sock_fd);
+      /* Child process: we don't need the listeners. */
+      for (int i = 0; i < n; i++)
+        close(sock_fds[i]);
       return server(new_fd);
     } else {
       /* Parent process: we don't need the connection. */
@@ -150,25 +345,134 @@ int main(__attribute__((unused)) int argc, char *argv[]) {
   return EXIT_SUCCESS;
 }
 
+/* Fork the workers, each of which binds its own listeners, and keep them
+   running.  A worker killed by a signal is replaced; one that exits by itself
+   (e.g. because it couldn't bind) is not.
+ */
+int start_workers() {
+  pid_t *pids;
+  pid_t pid;
+  int status;
+  int running = 0;
+
+  if ((pids = calloc((size_t)options.workers, sizeof *pids)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+
+  for (int i = 0; i < options.workers; i++) {
+    if ((pids[i] = start_worker(i)) > 0)
+      running++;
+  }
+
+  while (running > 0) {
+    if ((pid = wait(&status)) == -1) {
+      if (errno == EINTR)
+        continue;
+      log_error("wait: %s", strerror(errno));
+    }
+
+    for (int i = 0; i < options.workers; i++) {
+      if (pids[i] != pid)
+        continue;
+
+      running--;
+      pids[i] = -1;
+      if (WIFSIGNALED(status)) {
+        log_warn("worker %d killed by signal %d, restarting", i,
+                 WTERMSIG(status));
+        if ((pids[i] = start_worker(i)) > 0)
+          running++;
+      } else {
+        log_warn("worker %d exited with status %d", i, WEXITSTATUS(status));
+      }
+    }
+  }
+
+  free(pids);
+  return EXIT_FAILURE;
+}
+
+/* Fork worker number i.  Returns its pid, or -1 if it couldn't be started. */
+pid_t start_worker(int i) {
+  pid_t pid = fork();
+
+  if (pid == -1) {
+    log_warn("fork: %s", strerror(errno));
+  } else if (pid == 0) {
+    /* Go down with the parent rather than keep holding the port. */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    exit(serve(i));
+  }
+
+  return pid;
+}
+
+/* Keep this process on one CPU, picked by worker number. */
+void pin_to_cpu(int worker) {
+  cpu_set_t set;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int cpu = (int)(worker % (cpus > 0 ? cpus : 1));
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof set, &set) == -1)
+    log_warn("couldn't pin worker %d to CPU %d: %s", worker, cpu,
+             strerror(errno));
+  else
+    log_debug("worker %d pinned to CPU %d", worker, cpu);
+}
+
 /* An established server session with a client communicating over the file
  * descriptor fd. */
 int server(int fd) {
+  Connection conn;
+  Header header;
   char *buffer = NULL;
   Command command;
-  bool keep_alive = true;
+  bool keep_alive = true, transfer;
+  StatsSocket traffic = {0, 0};
+
+  conn_init(&conn, fd);
+  conn.max_message = options.max_message;
+  stats_add(STATS_SESSIONS, 1);
+  stats_add(STATS_SESSIONS_TOTAL, 1);
 
   while (keep_alive) {
-    recv_all(fd, &buffer);
+    if (conn.version >= 2) {
+      if (recv_frame(&conn, &header, &buffer) < 0)
+        break;
+
+      /* The whole frame has been read, so we can carry on after a bad one. */
+      if (!parse_frame(&command, &header, buffer)) {
+        log_warn("%s: unparseable request: 0x%x", options.connection,
+                 header.opcode);
+        send_error(fd, header.id, "unrecognised request");
+        continue;
+      }
+    } else {
+      if (recv_message(&conn, &buffer) < 0)
+        break;
 
-    if (!parse_command(&command, buffer))
-      log_error("%s: unparseable command: %s", options.connection, buffer);
+      if (!parse_command(&command, buffer))
+        log_error("%s: unparseable command: %s", options.connection, buffer);
+    }
 
-    keep_alive = do_command(fd, &command);
+    transfer =
+        command.type == GET || command.type == PUT || command.type == MGET;
+    stats_add(STATS_REQUESTS, 1);
+    if (transfer) {
+      stats_add(STATS_TRANSFERS, 1);
+      stats_add(STATS_TRANSFERS_TOTAL, 1);
+    }
+    keep_alive = do_command(&conn, &command);
+    if (transfer)
+      stats_add(STATS_TRANSFERS, -1);
+    stats_socket(fd, &traffic);
   }
 
+  stats_socket(fd, &traffic);
+  stats_add(STATS_SESSIONS, -1);
   close(fd);
-  free(buffer);
-  buffer = NULL;
+  conn_free(&conn);
   log_info("%s: session ended", options.connection);
   return EXIT_SUCCESS;
 }
@@ -195,7 +499,9 @@ bool parse_list(Command *command, char *buffer) {
 bool parse_get(Command *command, char *buffer) {
   if (strncmp("GET ", buffer, 4) == 0) {
     command->type = GET;
-    command->list.path = buffer + 4;
+    command->get.path = buffer + 4;
+    command->get.offset = 0;
+    command->get.length = -1;
     return true;
   }
 
@@ -205,16 +511,32 @@ bool parse_get(Command *command, char *buffer) {
 bool parse_put(Command *command, char *buffer) {
   if (strncmp("PUT ", buffer, 4) == 0) {
     command->type = PUT;
-    command->list.path = buffer + 4;
+    command->put.path = buffer + 4;
+    command->put.size = command->put.offset = command->put.mtime = 0;
     return true;
   }
 
   return false;
 }
 
+bool parse_hello(Command *command, char *buffer) {
+  if (strncmp("HELLO ", buffer, 6) == 0) {
+    command->type = HELLO;
+    command->hello.version = atoi(buffer + 6);
+    return command->hello.version > 0;
+  }
+
+  return false;
+}
+
 bool parse_command(Command *command, char *buffer) {
+  command->id = 0;
+  command->flags = 0;
+
   if (parse_done(command, buffer))
     return true;
+  if (parse_hello(command, buffer))
+    return true;
   if (parse_list(command, buffer))
     return true;
   if (parse_get(command, buffer))
@@ -226,16 +548,107 @@ bool parse_command(Command *command, char *buffer) {
   return false;
 }
 
-bool do_command(int fd, Command *c) {
+/* Turn a version 2 frame into a command.  Paths point into payload. */
+bool parse_frame(Command *command, Header *header, char *payload) {
+  uint64_t range[2], resume[3];
+  size_t fixed;
+
+  command->id = header->id;
+  command->flags = header->flags;
+
+  switch (header->opcode) {
+  case OP_DONE:
+    command->type = DONE;
+    return true;
+  case OP_LIST:
+    command->type = LIST;
+    command->list.path = payload;
+    return payload_string(header, payload);
+  case OP_GET:
+    command->type = GET;
+    command->get.path = payload;
+    command->get.offset = 0;
+    command->get.length = -1;
+    if (!(header->flags & FLAG_RANGE))
+      return payload_string(header, payload);
+    /* A ranged GET has the offset and length before the path. */
+    if (header->length < sizeof range + 1)
+      break;
+    memcpy(range, payload, sizeof range);
+    command->get.offset = (off_t)be64toh(range[0]);
+    command->get.length = (off_t)be64toh(range[1]);
+    command->get.path = payload + sizeof range;
+    if (command->get.offset < 0 || command->get.length < 0)
+      break;
+    return payload[header->length - 1] == '\0';
+  case OP_PUT:
+    /* A tree is just its path, as its entries come in ENTRY frames. */
+    if (header->flags & FLAG_TREE) {
+      command->type = PUT;
+      command->put.path = payload;
+      command->put.size = command->put.offset = command->put.mtime = 0;
+      return payload_string(header, payload);
+    }
+    /* The size of the file comes before its path, and when resuming so do
+       the offset to carry on from and the mtime to give the file. */
+    fixed = header->flags & FLAG_RESUME ? sizeof resume : sizeof resume[0];
+    if (header->length < fixed + 1)
+      break;
+    memcpy(resume, payload, fixed);
+    command->type = PUT;
+    command->put.size = (off_t)be64toh(resume[0]);
+    command->put.offset = 0;
+    command->put.mtime = 0;
+    command->put.path = payload + fixed;
+    if (header->flags & FLAG_RESUME) {
+      command->put.offset = (off_t)be64toh(resume[1]);
+      command->put.mtime = (int64_t)be64toh(resume[2]);
+      if (command->put.offset < 0 || command->put.offset > command->put.size)
+        break;
+    }
+    return payload[header->length - 1] == '\0';
+  case OP_STAT:
+    command->type = STAT;
+    command->stat.path = payload;
+    return payload_string(header, payload);
+  case OP_STATS:
+    command->type = STATS;
+    return true;
+  case OP_MGET:
+    command->type = MGET;
+    command->mget.patterns = payload;
+    command->mget.length = header->length;
+    return payload_string(header, payload);
+  }
+
+  command->type = ERROR;
+  return false;
+}
+
+bool do_command(Connection *conn, Command *c) {
   switch (c->type) {
   case DONE:
-    return do_done(fd, c);
+    return do_done(conn, c);
   case LIST:
-    return do_list(fd, c);
+    return conn->version >= 2 ? do_list_v2(conn, c) : do_list(conn, c);
   case GET:
-    return do_get(fd, c);
+    if (conn->version < 2)
+      return do_get(conn, c);
+    return c->flags & FLAG_TREE ? do_get_tree(conn, c) : do_get_v2(conn, c);
   case PUT:
-    return do_put(fd, c);
+    if (conn->version < 2)
+      return do_put(conn, c);
+    if (c->flags & FLAG_TREE)
+      return do_put_tree(conn, c);
+    return c->flags & FLAG_DELTA ? do_put_delta(conn, c) : do_put_v2(conn, c);
+  case HELLO:
+    return do_hello(conn, c);
+  case STAT:
+    return do_stat_v2(conn, c);
+  case STATS:
+    return do_stats_v2(conn, c);
+  case MGET:
+    return do_mget_v2(conn, c);
 
   case ERROR:
     log_warn("unrecognised command: %d", c->type);
@@ -244,160 +657,632 @@ bool do_command(int fd, Command *c) {
   return false;
 }
 
-bool do_done(__attribute__((unused)) int fd,
+bool do_done(__attribute__((unused)) Connection *conn,
              __attribute__((unused)) Command *command) {
   log_info("%s: DONE", options.connection);
   return false;
 }
 
-bool do_list(int fd, Command *command) {
-  int err;
-  struct dirent **list;
+/* Agree on the newest protocol version both ends speak.  Everything after
+   the reply is in that version. */
+bool do_hello(Connection *conn, Command *command) {
+  int version = command->hello.version < PROTOCOL_VERSION
+                    ? command->hello.version
+                    : PROTOCOL_VERSION;
+
+  log_info("%s: HELLO %d", options.connection, command->hello.version);
+  if (dzprintf(conn->fd, "HELLO %d", version) < 0)
+    return false;
+  conn->version = version;
+  return true;
+}
+
+bool do_list(Connection *conn, Command *command) {
+  Listing l;
+  char batch[LIST_BATCH];
+  size_t used;
+  uint64_t started = trace_start(), phase;
 
   log_info("%s: LIST %s", options.connection, command->list.path);
 
-  err = scandir(command->list.path, &list, NULL, alphasort);
-  if (err < 0) {
+  phase = trace_start();
+  if (!listing_open(&l, command->list.path, false, true)) {
     log_warn("cannot open directory for reading: %s", command->list.path);
-    dzprintf(fd, "ERROR can't open directory: %s", strerror(errno));
-  } else {
-    log_debug("found %d entries", err);
-    dzprintf(fd, "%d", err);
-
-    for (int i = 0; i < err; i++) {
-      log_debug("sending dirent %s", list[i]->d_name);
-      send_all(fd, list[i]->d_name, strlen(list[i]->d_name) + 1);
-      free(list[i]);
-      list[i] = NULL;
-    }
-    free(list);
-    list = NULL;
+    dzprintf(conn->fd, "ERROR can't open directory: %s", strerror(errno));
+    stats_add(STATS_ERRORS, 1);
+    return true;
   }
+  trace_end(TRACE_READDIR, 0, l.count, phase);
+
+  log_debug("found %zu entries", l.count);
+  dzprintf(conn->fd, "%zu", l.count);
+  while ((used = listing_pack(&l, batch, sizeof batch)) > 0)
+    if (send_all(conn->fd, batch, used) < 0)
+      break;
+  listing_close(&l);
+  trace_end(TRACE_LIST, 0, 0, started);
 
   return true;
 }
 
-bool do_get(int fd, Command *command) {
+bool do_get(Connection *conn, Command *command) {
   log_info("%s: GET %s", options.connection, command->get.path);
 
   struct stat fs;
   int err;
   int to_send = -1;
   char *msg = NULL;
-  char buf[MAXDATASIZE];
   off_t len;
-  ssize_t n, sent;
-  ssize_t chunk_read;
-  ssize_t chunk_sent;
+  off_t sent = 0;
+  bool keep_alive = true;
+  uint64_t started = trace_start(), phase;
 
+  phase = trace_start();
   err = stat(command->get.path, &fs);
   if (err != 0)
     goto err;
+  trace_end(TRACE_STAT, 0, 0, phase);
 
+  phase = trace_start();
   to_send = open(command->get.path, O_RDONLY);
   if (to_send < 0)
     goto err;
+  trace_end(TRACE_OPEN, 0, 0, phase);
 
   len = fs.st_size;
   log_info("%s: checking if okay to receive %lluB", options.connection, len);
-  dzprintf(fd, "%llu", len);
+  phase = trace_start();
+  dzprintf(conn->fd, "%llu", len);
 
-  recv_all(fd, &msg);
+  if (recv_message(conn, &msg) < 0) {
+    keep_alive = false;
+    goto done;
+  }
+  trace_end(TRACE_HANDSHAKE, 0, 0, phase);
   if (strcmp(msg, "OK") != 0) {
     log_info("%s: cancelled GET: %s", options.connection, msg);
     goto done;
   }
 
   log_info("%s: sending %uB", options.connection, len);
-  sent = 0;
-  while (sent < len) {
-    chunk_read = read(to_send, &buf, MAXDATASIZE);
-    chunk_sent = 0;
-    while (chunk_sent < chunk_read) {
-      n = send(fd, buf + chunk_sent, chunk_read - (size_t)chunk_sent, 0);
-      sent += n;
-      chunk_sent += n;
-    }
-    log_debug("sent %u/%uB", sent, len);
+  advise_sequential(to_send, 0, len);
+  sent = send_file(conn->fd, to_send, 0, len);
+  if (sent != len) {
+    /* The client is still waiting for bytes we can't send it, so the session
+       can't carry on. */
+    log_warn("%s: GET aborted after %lld/%lldB: %s", options.connection,
+             (long long)sent, (long long)len, strerror(errno));
+    keep_alive = false;
   }
 
   goto done;
 
 err:
   log_warn("%s: GET failed: %s", options.connection, strerror(errno));
-  dzprintf(fd, "ERROR %s", strerror(errno));
+  dzprintf(conn->fd, "ERROR %s", strerror(errno));
+  stats_add(STATS_ERRORS, 1);
 
 done:
   if (to_send > 0)
     close(to_send);
-  if (msg != NULL)
-    free(msg);
-  return true;
+  trace_end(TRACE_GET, 0, (uint64_t)sent, started);
+  return keep_alive;
 }
 
-bool do_put(int fd, Command *command) {
+bool do_put(Connection *conn, Command *command) {
   char *msg = NULL;
   int dest_fd = -1;
   ssize_t len;
-  ssize_t received, remaining, want, n, written;
-  char buf[MAXDATASIZE];
+  off_t received = 0;
+  bool keep_alive = true;
+  uint64_t started = trace_start(), phase;
 
   log_info("%s: PUT %s", options.connection, command->put.path);
 
+  phase = trace_start();
   dest_fd =
       open(command->put.path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+  trace_end(TRACE_OPEN, 0, 0, phase);
   if (dest_fd == -1) {
     log_warn("%s: couldn't open file for PUT: %s", options.connection,
              strerror(errno));
-    dzprintf(fd, "NO: %s", strerror(errno));
+    dzprintf(conn->fd, "NO: %s", strerror(errno));
+    stats_add(STATS_ERRORS, 1);
     goto done;
   }
   log_debug("%s: opened file for writing: %s", options.connection,
             command->put.path);
 
-  dzprintf(fd, "OK");
+  phase = trace_start();
+  dzprintf(conn->fd, "OK");
   log_debug("%s: accepted put in principle", options.connection);
 
-  recv_all(fd, &msg);
+  if (recv_message(conn, &msg) < 0) {
+    keep_alive = false;
+    goto done;
+  }
+  trace_end(TRACE_HANDSHAKE, 0, 0, phase);
   sscanf(msg, "%zd", &len);
-  free(msg);
-  msg = NULL;
   log_info("%s: to receive %luB", options.connection, len);
 
   // TODO: handle rejecting files based on free space.
-  dzprintf(fd, "OK");
+  dzprintf(conn->fd, "OK");
 
   log_debug("%s: awaiting transfer", options.connection);
-  received = 0;
-  while (received < len) {
-    remaining = len - received;
-    want = (MAXDATASIZE < remaining) ? MAXDATASIZE : remaining;
-    n = recv(fd, &buf, (size_t)want, MSG_WAITALL);
-
-    if (n < 0)
-      log_error("error receiving file: %s", strerror(errno));
-    if (n == 0) {
-      log_warn("connection from client ended abruptly");
+  received = recv_file(conn, dest_fd, 0, len);
+  if (received != len) {
+    /* Whatever is left of the file is still on its way, so we can't make
+       sense of anything else the client sends. */
+    log_warn("%s: PUT failed after %lld/%lldB: %s", options.connection,
+             (long long)received, (long long)len, strerror(errno));
+    keep_alive = false;
+    goto done;
+  }
+  log_info("transfer completed");
+
+done:
+  phase = trace_start();
+  if (dest_fd > 0)
+    close(dest_fd);
+  trace_end(TRACE_CLOSE, 0, 0, phase);
+  trace_end(TRACE_PUT, 0, (uint64_t)received, started);
+
+  return keep_alive;
+}
+
+/* Version 2 LIST: the entries go out packed into ENTRIES frames of up to
+   LIST_BATCH bytes as the directory is read, followed by an OK.  FLAG_STAT
+   puts the type, size and mtime in front of each name, and FLAG_SORT sorts
+   them, which means reading the whole directory first.
+ */
+bool do_list_v2(Connection *conn, Command *command) {
+  Listing l;
+  char batch[LIST_BATCH];
+  size_t used;
+  bool ok = true;
+  uint64_t started = trace_start(), phase;
+
+  log_info("%s: LIST %s", options.connection, command->list.path);
+
+  phase = trace_start();
+  if (!listing_open(&l, command->list.path, command->flags & FLAG_STAT,
+                    command->flags & FLAG_SORT)) {
+    log_warn("cannot open directory for reading: %s", command->list.path);
+    return send_error(conn->fd, command->id, "can't open directory: %s",
+                      strerror(errno)) >= 0;
+  }
+  trace_end(TRACE_READDIR, command->id, l.count, phase);
+
+  while (ok && (used = listing_pack(&l, batch, sizeof batch)) > 0)
+    ok = send_frame(conn->fd, OP_ENTRIES, 0, command->id, batch, used) >= 0;
+  listing_close(&l);
+  if (ok)
+    ok = send_frame(conn->fd, OP_OK, 0, command->id, NULL, 0) >= 0;
+  trace_end(TRACE_LIST, command->id, 0, started);
+
+  return ok;
+}
+
+/* Work out which part of a file of the given size a GET asked for.  Ranges
+   running past the end of the file are cut short, so the DATA frame may be
+   shorter than asked for, or empty.
+ */
+void get_range(Command *command, off_t size, off_t *offset, off_t *len) {
+  *offset = command->get.offset < size ? command->get.offset : size;
+  *len = size - *offset;
+  if (command->get.length >= 0 && command->get.length < *len)
+    *len = command->get.length;
+}
+
+/* Version 2 GET: reply with a DATA frame holding the whole file, or with
+   FLAG_RANGE just the part asked for.  With FLAG_CONFIRM we first send the
+   size of the whole file in a SIZE frame and wait for the client to answer OK
+   or NO.  With FLAG_COMPRESS the DATA frame is sent compressed, if we can,
+   and with FLAG_CHECKSUM a CHECKSUM frame follows it.
+
+   Small files are answered from the file cache when they can be, without
+   touching the filesystem, and added to it when they aren't there yet.
+ */
+bool do_get_v2(Connection *conn, Command *command) {
+  struct stat fs;
+  CachedFile *cached = NULL;
+  Header header;
+  char *payload;
+  uint64_t size;
+  int to_send = -1;
+  off_t offset, len, sent = 0;
+  bool keep_alive = true;
+  uint16_t flags = command->flags & DATA_FLAGS;
+  uint64_t started = trace_start(), phase;
+
+  log_info("%s: GET %s", options.connection, command->get.path);
+
+  if (filecache_wanted(command->flags) &&
+      (cached = filecache_find(command->get.path)) != NULL) {
+    fs.st_size = cached->size;
+  } else {
+    phase = trace_start();
+    /* Without O_NONBLOCK a FIFO would hold us here until it had a writer. */
+    to_send = open(command->get.path, O_RDONLY | O_NONBLOCK);
+    trace_end(TRACE_OPEN, command->id, 0, phase);
+    phase = trace_start();
+    if (to_send < 0 || fstat(to_send, &fs) != 0) {
+      log_warn("%s: GET failed: %s", options.connection, strerror(errno));
+      keep_alive =
+          send_error(conn->fd, command->id, "%s", strerror(errno)) >= 0;
+      goto done;
+    }
+    trace_end(TRACE_STAT, command->id, 0, phase);
+    if (!S_ISREG(fs.st_mode)) {
+      log_warn("%s: GET failed: not a regular file", options.connection);
+      keep_alive =
+          send_error(conn->fd, command->id, "not a regular file") >= 0;
       goto done;
     }
-    received += n;
-    log_debug("%s: read %luB", options.connection, n);
+    if (filecache_wanted(command->flags))
+      filecache_add(command->get.path, to_send, &fs);
+  }
 
-    written = write(dest_fd, buf, (size_t)want);
-    log_debug("%s: written %luB", options.connection, written);
-    if (written < 0)
-      log_error("write failed: %s", strerror(errno));
+  get_range(command, fs.st_size, &offset, &len);
 
-    if (written != want)
-      log_warn("tried to write %uB but only wrote %uB", want, written);
+  if (command->flags & FLAG_CONFIRM) {
+    phase = trace_start();
+    size = htobe64((uint64_t)fs.st_size);
+    if (send_frame(conn->fd, OP_SIZE, 0, command->id, &size, sizeof size) < 0 ||
+        recv_frame(conn, &header, &payload) < 0) {
+      keep_alive = false;
+      goto done;
+    }
+    trace_end(TRACE_HANDSHAKE, command->id, 0, phase);
+    if (header.opcode != OP_OK) {
+      log_info("%s: cancelled GET", options.connection);
+      goto done;
+    }
+  }
+
+  log_info("%s: sending %lldB from %lld%s", options.connection, (long long)len,
+           (long long)offset,
+           cached != NULL ? ", cached"
+                          : (flags & FLAG_COMPRESS ? ", compressed" : ""));
+  if (cached != NULL)
+    sent = filecache_send_data(conn->fd, command->id, flags, cached);
+  else
+    sent = send_data(conn->fd, command->id, flags, to_send, offset, len);
+  if (sent < 0) {
+    keep_alive = false;
+    goto done;
+  }
+  if (sent != len) {
+    log_warn("%s: GET aborted after %lld/%lldB: %s", options.connection,
+             (long long)sent, (long long)len, strerror(errno));
+    keep_alive = false;
   }
-  log_info("transfer completed");
 
 done:
-  if (dest_fd > 0)
-    close(dest_fd);
-  if (msg != NULL)
-    free(msg);
+  if (to_send >= 0)
+    close(to_send);
+  if (cached != NULL)
+    filecache_release(cached);
+  trace_end(TRACE_GET, command->id, sent > 0 ? (uint64_t)sent : 0, started);
+  return keep_alive;
+}
 
-  return true;
+/* Version 2 GET of a whole directory tree: stream every file and directory
+   under the path as ENTRY frames, then OK. */
+bool do_get_tree(Connection *conn, Command *command) {
+  TreeWalk walk;
+  ssize_t count;
+
+  log_info("%s: GET tree %s", options.connection, command->get.path);
+
+  if (!tree_open(&walk, command->get.path)) {
+    log_warn("%s: GET failed: %s", options.connection, strerror(errno));
+    return send_error(conn->fd, command->id, "%s", strerror(errno)) >= 0;
+  }
+
+  count = send_tree(conn->fd, command->id, &walk);
+  tree_close(&walk);
+  if (count < 0) {
+    log_warn("%s: GET tree aborted: %s", options.connection, strerror(errno));
+    return false;
+  }
+  log_info("%s: sent %zd entries", options.connection, count);
+
+  return send_frame(conn->fd, OP_OK, 0, command->id, NULL, 0) >= 0;
+}
+
+/* Version 2 MGET: stream every file the patterns match, or the reason it
+   can't be had, as FILE frames, then OK. */
+bool do_mget_v2(Connection *conn, Command *command) {
+  FileList files;
+  ssize_t count;
+  uint64_t started = trace_start();
+
+  log_info("%s: MGET %s%s", options.connection, command->mget.patterns,
+           strlen(command->mget.patterns) + 1 < command->mget.length ? " ..."
+                                                                     : "");
+
+  if (!mget_open(&files, command->mget.patterns, command->mget.length)) {
+    log_warn("%s: MGET failed: %s", options.connection, strerror(errno));
+    return send_error(conn->fd, command->id, "%s", strerror(errno)) >= 0;
+  }
+
+  count = send_mget(conn->fd, command->id, &files);
+  mget_close(&files);
+  trace_end(TRACE_GET, command->id, 0, started);
+  if (count < 0) {
+    log_warn("%s: MGET aborted: %s", options.connection, strerror(errno));
+    return false;
+  }
+  log_info("%s: sent %zd files", options.connection, count);
+
+  return send_frame(conn->fd, OP_OK, 0, command->id, NULL, 0) >= 0;
+}
+
+/* Version 2 PUT of a whole directory tree: say OK if we can make the
+   directory, recreate the tree from the ENTRY frames that follow, and answer
+   the client's OK at the end with our own, or ERROR if anything was lost. */
+bool do_put_tree(Connection *conn, Command *command) {
+  Header end;
+  char *payload;
+  ssize_t failed;
+  int root_fd;
+
+  log_info("%s: PUT tree %s", options.connection, command->put.path);
+
+  if ((root_fd = tree_mkroot(command->put.path)) < 0) {
+    log_warn("%s: PUT failed: %s", options.connection, strerror(errno));
+    return send_error(conn->fd, command->id, "%s", strerror(errno)) >= 0;
+  }
+  if (send_frame(conn->fd, OP_OK, 0, command->id, NULL, 0) < 0) {
+    close(root_fd);
+    return false;
+  }
+
+  failed = recv_tree(conn, root_fd, &end, &payload);
+  close(root_fd);
+  if (failed < 0 || end.opcode != OP_OK) {
+    log_warn("%s: PUT tree aborted", options.connection);
+    return false;
+  }
+  if (failed > 0)
+    return send_error(conn->fd, command->id, "%zd entries couldn't be written",
+                      failed) >= 0;
+  log_info("%s: transfer completed", options.connection);
+  return send_frame(conn->fd, OP_OK, 0, command->id, NULL, 0) >= 0;
+}
+
+/* Version 2 PUT with FLAG_DELTA: send the signatures of the blocks of our
+   copy in SIGS frames and then OK.  The client answers with DATA frames of
+   new data and BLOCKS frames of runs of our blocks, in the order they make up
+   its file, ending with OK, and we rebuild the file from them.  If anything
+   goes wrong part way the rest is still read, so we can answer with ERROR.
+ */
+bool do_put_delta(Connection *conn, Command *command) {
+  Delta d;
+  Header header;
+  char batch[DELTA_BATCH], *payload;
+  size_t next = 0, used;
+  ssize_t len;
+  off_t received;
+  bool ok = false;
+
+  log_info("%s: PUT delta %s", options.connection, command->put.path);
+
+  if (!delta_open(&d, command->put.path)) {
+    log_warn("%s: PUT failed: %s", options.connection, strerror(errno));
+    return send_error(conn->fd, command->id, "%s", strerror(errno)) >= 0;
+  }
+  log_info("%s: %zu blocks of %uB", options.connection, d.sigs.count,
+           d.sigs.block);
+  while ((used = pack_sigs(&d.sigs, &next, batch, sizeof batch)) > 0)
+    if (send_frame(conn->fd, OP_SIGS, 0, command->id, batch, used) < 0)
+      goto done;
+  if (send_frame(conn->fd, OP_OK, 0, command->id, NULL, 0) < 0)
+    goto done;
+
+  for (;;) {
+    if (recv_header(conn, &header) < 0)
+      goto done;
+    if (header.opcode == OP_DATA) {
+      if (d.failure != NULL)
+        received = discard_data(conn, (off_t)header.length);
+      else
+        received = recv_file(conn, d.out_fd, d.offset, (off_t)header.length);
+      if (received != (off_t)header.length)
+        goto done;
+      d.offset += received;
+      continue;
+    }
+    if ((len = recv_payload(conn, &header, &payload)) < 0)
+      goto done;
+    if (header.opcode == OP_OK)
+      break;
+    if (header.opcode != OP_BLOCKS) {
+      log_warn("%s: expected delta, got 0x%x", options.connection,
+               header.opcode);
+      goto done;
+    }
+    delta_copy(&d, payload, (size_t)len);
+  }
+
+  if (!delta_commit(&d, command->put.size)) {
+    log_warn("%s: PUT failed: %s", options.connection, d.failure);
+    ok = send_error(conn->fd, command->id, "%s", d.failure) >= 0;
+    goto done;
+  }
+  log_info("%s: transfer completed", options.connection);
+  ok = send_frame(conn->fd, OP_OK, 0, command->id, NULL, 0) >= 0;
+
+done:
+  delta_close(&d);
+  return ok;
+}
+
+/* Open the file a PUT writes to.  A resumed PUT keeps what's already there
+   up to its offset, and anything after that is thrown away as it can't be
+   trusted.  Fails with ERANGE if there's less there than the client thinks.
+ */
+int open_put(Command *command) {
+  struct stat fs;
+  int fd;
+
+  if (!(command->flags & FLAG_RESUME))
+    return open(command->put.path, O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC,
+                S_IRUSR | S_IWUSR);
+
+  fd = open(command->put.path, O_CREAT | O_RDWR | O_CLOEXEC,
+            S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &fs) != 0)
+    goto fail;
+  if (fs.st_size < command->put.offset) {
+    errno = ERANGE;
+    goto fail;
+  }
+  if (ftruncate(fd, command->put.offset) != 0)
+    goto fail;
+  return fd;
+
+fail:
+  close_put(fd, command);
+  return -1;
+}
+
+/* Close the file a PUT wrote to.  A resumed PUT is given the mtime of the
+   client's file even if it didn't all arrive, so that next time the client
+   can tell that what we have is the start of that same file.
+ */
+void close_put(int fd, Command *command) {
+  int err = errno;
+  struct timespec times[2] = {
+      {.tv_nsec = UTIME_OMIT},
+      {.tv_sec = command->put.mtime / 1000000000,
+       .tv_nsec = command->put.mtime % 1000000000}};
+
+  if ((command->flags & FLAG_RESUME) && futimens(fd, times) != 0)
+    log_warn("couldn't set mtime of file: %s", strerror(errno));
+  close(fd);
+  errno = err;
+}
+
+/* Version 2 STAT: reply with the size and mtime of a file in an ATTRS frame,
+   so the client can tell how much of it we have. */
+bool do_stat_v2(Connection *conn, Command *command) {
+  struct stat fs;
+  char attrs[ATTRS_SIZE];
+
+  log_info("%s: STAT %s", options.connection, command->stat.path);
+
+  if (stat(command->stat.path, &fs) != 0)
+    return send_error(conn->fd, command->id, "%s", strerror(errno)) >= 0;
+  if (!S_ISREG(fs.st_mode))
+    return send_error(conn->fd, command->id, "not a regular file") >= 0;
+
+  pack_attrs(attrs, fs.st_size, mtime_ns(&fs));
+  return send_frame(conn->fd, OP_ATTRS, 0, command->id, attrs, sizeof attrs) >=
+         0;
+}
+
+/* Version 2 STATS: reply with the counters, added up over every worker and
+   session, in a COUNTERS frame. */
+bool do_stats_v2(Connection *conn, Command *command) {
+  char counters[STATS_SIZE];
+
+  log_info("%s: STATS", options.connection);
+  stats_pack(counters);
+  return send_frame(conn->fd, OP_COUNTERS, 0, command->id, counters,
+                    sizeof counters) >= 0;
+}
+
+/* Version 2 PUT: accept (OK) or refuse (ERROR) the file, then receive it in a
+   DATA frame and answer OK once it's all written.  With FLAG_NOWAIT the
+   client sends the DATA frame straight after the request without waiting for
+   us to accept it, and the only reply is the final OK or ERROR.  With
+   FLAG_RESUME the DATA frame carries on from an offset into the file we
+   already have.  With FLAG_COMPRESS or FLAG_CHECKSUM our OK says whether the
+   client may send the DATA frame compressed, or checksummed.
+ */
+bool do_put_v2(Connection *conn, Command *command) {
+  Header header;
+  int dest_fd = -1;
+  int err = 0;
+  off_t received = 0;
+  bool keep_alive = true;
+  bool nowait = command->flags & FLAG_NOWAIT;
+  uint64_t started = trace_start(), phase;
+
+  log_info("%s: PUT %s (%lldB from %lld)", options.connection,
+           command->put.path, (long long)command->put.size,
+           (long long)command->put.offset);
+
+  phase = trace_start();
+  dest_fd = open_put(command);
+  trace_end(TRACE_OPEN, command->id, 0, phase);
+  if (dest_fd == -1) {
+    err = errno;
+    log_warn("%s: couldn't open file for PUT: %s", options.connection,
+             strerror(err));
+    if (!nowait) {
+      keep_alive = send_error(conn->fd, command->id, "%s", strerror(err)) >= 0;
+      goto done;
+    }
+  } else if (!nowait &&
+             send_frame(conn->fd, OP_OK,
+                        command->flags & DATA_FLAGS,
+                        command->id, NULL, 0) < 0) {
+    keep_alive = false;
+    goto done;
+  }
+
+  phase = trace_start();
+  if (recv_header(conn, &header) < 0) {
+    keep_alive = false;
+    goto done;
+  }
+  trace_end(TRACE_HANDSHAKE, command->id, 0, phase);
+  if (header.opcode != OP_DATA || header.id != command->id) {
+    log_warn("%s: expected file data, got 0x%x", options.connection,
+             header.opcode);
+    keep_alive = false;
+    goto done;
+  }
+
+  if (dest_fd == -1) {
+    /* The file is on its way regardless, so it has to be read and thrown
+       away before we can refuse it. */
+    if (recv_data(conn, &header, -1, 0) != (off_t)header.length) {
+      keep_alive = false;
+      goto done;
+    }
+    keep_alive = send_error(conn->fd, command->id, "%s", strerror(err)) >= 0;
+    goto done;
+  }
+
+  received = recv_data(conn, &header, dest_fd, command->put.offset);
+  if (received < 0 && errno == EBADMSG) {
+    log_warn("%s: PUT failed: checksum mismatch", options.connection);
+    keep_alive =
+        send_error(conn->fd, command->id, "checksum mismatch") >= 0;
+    goto done;
+  }
+  if (received != (off_t)header.length) {
+    log_warn("%s: PUT failed after %lld/%lldB: %s", options.connection,
+             (long long)received, (long long)header.length, strerror(errno));
+    keep_alive = false;
+    goto done;
+  }
+  log_info("transfer completed");
+
+  keep_alive = send_frame(conn->fd, OP_OK, 0, command->id, NULL, 0) >= 0;
+
+done:
+  phase = trace_start();
+  if (dest_fd >= 0)
+    close_put(dest_fd, command);
+  trace_end(TRACE_CLOSE, command->id, 0, phase);
+  trace_end(TRACE_PUT, command->id, received > 0 ? (uint64_t)received : 0,
+            started);
+  return keep_alive;
 }
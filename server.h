@@ -8,30 +8,67 @@
 /* How big the pending connections queue is. */
 #define DEFAULT_BACKLOG 10
 
+/* Most addresses we listen on at once. */
+#define MAX_LISTENERS 8
+
+/* Most bytes of names packed into one version 2 LIST reply frame. */
+#define LIST_BATCH (32 * 1024)
+
 typedef struct Options_t {
   char *port;
   int backlog;
+  size_t max_message;
+  bool event_mode;
+  int workers;
+  bool pin_workers;
+  size_t list_cache; /* Bytes of listings to cache, or 0 for none. */
+  size_t file_cache; /* Bytes of small files to cache, or 0 for none. */
+  char *stats_file;  /* Where to write the counters, or NULL. */
+  char *log_file;    /* Where to log to, or NULL for standard error. */
+  char *trace_file;  /* Where to trace to, before the pid, or NULL. */
   char connection[INET6_ADDRSTRLEN];
 } Options;
 
-static Options options;
+extern Options options;
 
 void sigchld_handler(int);
 void default_options(Options *);
-int get_bind_socket(struct addrinfo *);
+void parse_options(Options *, int, char *[]);
+void usage(void);
+int get_bind_sockets(struct addrinfo *, int[], int);
 void listen_on(int);
 void setup_process_reaping(void);
 int accept_connection(int, char[INET6_ADDRSTRLEN]);
+int accept_any(int[], int, char[INET6_ADDRSTRLEN]);
+int serve(int);
+int start_workers(void);
+pid_t start_worker(int);
+void pin_to_cpu(int);
 int server(int);
 
 bool parse_done(Command *, char *);
 bool parse_list(Command *, char *);
 bool parse_get(Command *, char *);
 bool parse_put(Command *, char *);
+bool parse_hello(Command *, char *);
 bool parse_command(Command *, char *);
+bool parse_frame(Command *, Header *, char *);
+void get_range(Command *, off_t, off_t *, off_t *);
+int open_put(Command *);
+void close_put(int, Command *);
 
-bool do_command(int, Command *);
-bool do_done(int, Command *);
-bool do_list(int, Command *);
-bool do_get(int, Command *);
-bool do_put(int, Command *);
+bool do_command(Connection *, Command *);
+bool do_done(Connection *, Command *);
+bool do_list(Connection *, Command *);
+bool do_get(Connection *, Command *);
+bool do_put(Connection *, Command *);
+bool do_hello(Connection *, Command *);
+bool do_list_v2(Connection *, Command *);
+bool do_get_v2(Connection *, Command *);
+bool do_put_v2(Connection *, Command *);
+bool do_stat_v2(Connection *, Command *);
+bool do_stats_v2(Connection *, Command *);
+bool do_get_tree(Connection *, Command *);
+bool do_mget_v2(Connection *, Command *);
+bool do_put_tree(Connection *, Command *);
+bool do_put_delta(Connection *, Command *);
@@ -1,18 +1,21 @@
 #define _GNU_SOURCE
+#include <endian.h>
 #include <errno.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "sftp.h"
-
-int vlogger(char *, char *, va_list argp);
+#include "stats.h"
 
 const char *program_name;
 
@@ -24,143 +27,174 @@ void *get_in_addr(struct sockaddr *sa) {
     return &(((struct sockaddr_in6 *)sa)->sin6_addr);
 }
 
-/* Generic logging function.  Don't use this, use one of the log_ methods
-   below. 
-*/
-int vlogger(char *level, char *message, va_list argp) {
-  struct timespec now;
-  struct tm *tmbuf;
-  char timestr[16];
-  int err;
-
-  clock_gettime(CLOCK_REALTIME, &now);
-  tmbuf = gmtime(&now.tv_sec);
-  if (tmbuf == NULL)
-    strncpy(timestr, "?????????", 9);
-  else
-    strftime(timestr, sizeof timestr, "%H:%M:%S", tmbuf);
+/* Send in chunks an entire string.  Essentially handle the case that send
+   returns less than the amount you asked it to send.
+ */
+ssize_t send_all(int fd, char *buf, size_t len) {
+  ssize_t sent = 0;
+  ssize_t n = 0;
 
-  err = 0;
-  err += fprintf(stderr, "%s %s %s: ", program_name, level, timestr);
-  err += vfprintf(stderr, message, argp);
-  err += fprintf(stderr, "\n");
+  while ((size_t)sent < len) {
+    n = send(fd, buf + sent, len - (size_t)sent, 0);
+    if (n == -1)
+      break;
+    sent += n;
+  }
 
-  return err;
+  /* Return a negative number if send failed, else return bytes sent. */
+  return n == -1 ? -sent : sent;
 }
 
-int log_info(char *message, ...) {
-  va_list argp;
-  int err;
-
-  va_start(argp, message);
-
-  err = vlogger("[INFO]   ", message, argp);
-  va_end(argp);
-
-  return err;
+/* Set up a connection over the socket fd with an empty buffer. */
+void conn_init(Connection *conn, int fd) {
+  int yes = 1;
+
+  /* Frames already go out whole, with MSG_MORE between a header and its
+     payload.  Left to Nagle's algorithm a small frame straight after a
+     large one, such as a CHECKSUM after its DATA, waits for the other
+     side's delayed ACK. */
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+
+  conn->fd = fd;
+  conn->buf = NULL;
+  conn->size = 0;
+  conn->start = 0;
+  conn->end = 0;
+  conn->max_message = DEFAULT_MAX_MESSAGE;
+  conn->version = 1;
+  conn->next_id = 0;
 }
 
-int log_warn(char *message, ...) {
-  va_list argp;
-  int err;
-
-  va_start(argp, message);
-
-  err = vlogger("[WARNING]", message, argp);
-  va_end(argp);
-
-  return err;
+/* Release the connection's buffer.  The socket is left for the caller. */
+void conn_free(Connection *conn) {
+  free(conn->buf);
+  conn->buf = NULL;
+  conn->size = conn->start = conn->end = 0;
 }
 
-int log_error(char *message, ...) {
-  va_list argp;
+/* How many bytes have been read from the socket but not used yet. */
+size_t conn_buffered(Connection *conn) { return conn->end - conn->start; }
 
-  va_start(argp, message);
+/* Read as much as is available from the socket into the connection's buffer,
+   first moving anything unused to the front and growing the buffer if there's
+   no room, up to enough to hold the longest message allowed.
 
-  vlogger("[ERROR]  ", message, argp);
-  va_end(argp);
+   Any message previously returned from the buffer is invalidated.  Returns the
+   bytes read, 0 at the end of the stream or -1 on error.
+ */
+ssize_t conn_fill(Connection *conn) {
+  size_t limit, size;
+  char *buf;
+  ssize_t n;
+
+  if (conn->start > 0) {
+    memmove(conn->buf, conn->buf + conn->start, conn->end - conn->start);
+    conn->end -= conn->start;
+    conn->start = 0;
+  }
 
-  exit(EXIT_FAILURE);
-}
+  if (conn->end == conn->size) {
+    limit = conn->max_message + HEADER_SIZE > CONN_BUFSIZE
+                ? conn->max_message + HEADER_SIZE
+                : CONN_BUFSIZE;
+    if (conn->size >= limit) {
+      errno = EMSGSIZE;
+      return -1;
+    }
 
-bool debug = false;
-int log_debug(char *message, ...) {
-  va_list argp;
-  int err = 0;
+    size = conn->size == 0 ? CONN_BUFSIZE : conn->size * 2;
+    if (size > limit)
+      size = limit;
+    if ((buf = realloc(conn->buf, size)) == NULL)
+      log_error("couldn't allocate memory: %s", strerror(errno));
+    conn->buf = buf;
+    conn->size = size;
+  }
 
-  va_start(argp, message);
+  do
+    n = recv(conn->fd, conn->buf + conn->end, conn->size - conn->end, 0);
+  while (n < 0 && errno == EINTR);
 
-  if (debug)
-    err = vlogger("[DEBUG]  ", message, argp);
+  if (n > 0)
+    conn->end += (size_t)n;
+  return n;
+}
 
-  va_end(argp);
+/* Make sure at least len bytes are buffered, reading more as needed.  Returns
+   the bytes buffered, or -1 if the connection failed or ended first.
+ */
+ssize_t conn_need(Connection *conn, size_t len) {
+  ssize_t n;
+
+  while (conn_buffered(conn) < len) {
+    n = conn_fill(conn);
+    if (n < 0) {
+      log_warn("recv: %s", strerror(errno));
+      return -1;
+    }
+    if (n == 0) {
+      log_warn("connection ended abruptly");
+      errno = ECONNRESET;
+      return -1;
+    }
+  }
 
-  return err;
+  return (ssize_t)conn_buffered(conn);
 }
 
-/* Send in chunks an entire string.  Essentially handle the case that send
-   returns less than the amount you asked it to send.
+/* Take the next nil terminated message out of the connection's buffer
+   without reading from the socket.  msg is pointed at the message inside the
+   buffer, so it is only valid until the connection is next read from.
+
+   Returns the length of the message, or -1 with errno set to EAGAIN if a
+   whole message hasn't arrived yet, or EMSGSIZE if it is longer than the
+   connection allows.
  */
-ssize_t send_all(int fd, char *buf, size_t len) {
-  ssize_t sent = 0;
-  ssize_t n = 0;
+ssize_t take_message(Connection *conn, char **msg) {
+  size_t avail = conn_buffered(conn);
+  char *nul = NULL;
+  ssize_t n;
+
+  if (avail > 0)
+    nul = memchr(conn->buf + conn->start, '\0', avail);
+  if (nul == NULL) {
+    errno = avail > conn->max_message ? EMSGSIZE : EAGAIN;
+    return -1;
+  }
 
-  while ((size_t)sent < len) {
-    n = send(fd, buf + sent, len - (size_t)sent, 0);
-    if (n == -1)
-      break;
-    sent += n;
+  *msg = conn->buf + conn->start;
+  n = nul - *msg;
+  conn->start += (size_t)n + 1;
+
+  if ((size_t)n > conn->max_message) {
+    errno = EMSGSIZE;
+    return -1;
   }
 
-  /* Return a negative number if send failed, else return bytes sent. */
-  return n == -1 ? -sent : sent;
+  return n;
 }
 
-/* Read byte by byte from fd until a nil is encountered, allocating
-   memory for buf as required.  If buf in not null, the memory is freed.
+/* Get the next nil terminated message from the connection, reading from the
+   socket in large chunks as needed.  Anything after the message stays
+   buffered for the next read.
+
+   Returns the length of the message, or -1 if the connection failed, ended
+   or the message was longer than the connection allows.
  */
-ssize_t recv_all(int fd, char **buf) {
-  ssize_t buflen = MAXDATASIZE;
-  ssize_t old_buflen;
-  ssize_t fp;
-  ssize_t len;
-
-  if (*buf != NULL)
-    free(*buf);
-
-  if ((*buf = calloc((size_t)buflen, sizeof(char))) == 0)
-    log_error("couldn't allocate memory: %s", strerror(errno));
-  memset(*buf, 0, (size_t)buflen);
-
-  fp = 0;
-  while (1) {
-    len = recv(fd, (*buf) + fp, 1, 0);
-    if (len < 0)
-      log_error("recv: %s", strerror(errno));
-    else if (len == 0)
-      log_error("connection ended abruptly");
-
-    if ((*buf)[fp] == '\0')
-      goto done;
-
-    fp += 1;
-    if (fp >= buflen) {
-      log_info("receiving long message: over %d bytes", fp);
-
-      old_buflen = buflen;
-      buflen *= 2;
-      if ((*buf = (char *)realloc(*buf, ((size_t)buflen) * sizeof(char))) == 0)
-        log_error("couldn't reallocate memory: %s", strerror(errno));
-
-      memset((*buf) + fp, 0, (size_t)(buflen - old_buflen));
+ssize_t recv_message(Connection *conn, char **msg) {
+  ssize_t n;
+
+  while ((n = take_message(conn, msg)) < 0) {
+    if (errno != EAGAIN) {
+      log_warn("message too long: over %zuB", conn->max_message);
+      return -1;
     }
+    if (conn_need(conn, conn_buffered(conn) + 1) < 0)
+      return -1;
   }
 
-done:
-  (*buf)[fp] = '\0';
-  log_debug("received %lldB (%lldB)", strlen(*buf), fp);
-  return fp;
-  /* Unreachable code */
+  log_debug("received %zdB", n);
+  return n;
 }
 
 /* Printf for a filedescriptor.
@@ -185,3 +219,251 @@ int dzprintf(int fd, char *format, ...) {
   va_end(argp);
   return result;
 }
+
+/* Write a header into buf in network byte order. */
+void pack_header(char buf[HEADER_SIZE], Header *header) {
+  uint16_t opcode = htobe16(header->opcode);
+  uint16_t flags = htobe16(header->flags);
+  uint32_t id = htobe32(header->id);
+  uint64_t length = htobe64(header->length);
+
+  memcpy(buf, &opcode, 2);
+  memcpy(buf + 2, &flags, 2);
+  memcpy(buf + 4, &id, 4);
+  memcpy(buf + 8, &length, 8);
+}
+
+/* Read a header out of buf, which is in network byte order. */
+void unpack_header(Header *header, char buf[HEADER_SIZE]) {
+  uint16_t opcode, flags;
+  uint32_t id;
+  uint64_t length;
+
+  memcpy(&opcode, buf, 2);
+  memcpy(&flags, buf + 2, 2);
+  memcpy(&id, buf + 4, 4);
+  memcpy(&length, buf + 8, 8);
+
+  header->opcode = be16toh(opcode);
+  header->flags = be16toh(flags);
+  header->id = be32toh(id);
+  header->length = be64toh(length);
+}
+
+/* Send just a header, for a payload the caller will send itself.  Pass
+   MSG_MORE as send_flags when the payload follows straight away so the two
+   go out in the same packets.
+ */
+ssize_t send_header(int fd, uint16_t opcode, uint16_t flags, uint32_t id,
+                    uint64_t length, int send_flags) {
+  Header header = {opcode, flags, id, length};
+  char buf[HEADER_SIZE];
+  ssize_t sent = 0;
+  ssize_t n;
+
+  pack_header(buf, &header);
+  while (sent < HEADER_SIZE) {
+    n = send(fd, buf + sent, HEADER_SIZE - (size_t)sent, send_flags);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    sent += n;
+  }
+
+  return sent;
+}
+
+/* Send a whole frame, header and payload, in as few calls as possible.
+   Returns the bytes sent or -1 on error.
+ */
+ssize_t send_frame(int fd, uint16_t opcode, uint16_t flags, uint32_t id,
+                   void *payload, size_t len) {
+  Header header = {opcode, flags, id, len};
+  char buf[HEADER_SIZE];
+  struct iovec iov[2];
+  struct msghdr msg;
+  size_t total = HEADER_SIZE + len;
+  size_t sent = 0;
+  ssize_t n;
+
+  pack_header(buf, &header);
+  iov[0].iov_base = buf;
+  iov[0].iov_len = HEADER_SIZE;
+  iov[1].iov_base = payload;
+  iov[1].iov_len = len;
+
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = len > 0 ? 2 : 1;
+
+  while (sent < total) {
+    n = sendmsg(fd, &msg, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    sent += (size_t)n;
+
+    /* Skip over whatever was sent for the next go. */
+    while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+      n -= (ssize_t)msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+      msg.msg_iov->iov_len -= (size_t)n;
+    }
+  }
+
+  return (ssize_t)sent;
+}
+
+/* Printf an OP_ERROR reply to request id. */
+ssize_t send_error(int fd, uint32_t id, char *format, ...) {
+  va_list argp;
+  ssize_t result = -1;
+  char *buf = NULL;
+
+  stats_add(STATS_ERRORS, 1);
+  va_start(argp, format);
+  if (vasprintf(&buf, format, argp) >= 0 && buf != NULL) {
+    result = send_frame(fd, OP_ERROR, 0, id, buf, strlen(buf) + 1);
+    free(buf);
+  }
+  va_end(argp);
+
+  return result;
+}
+
+/* Take the next frame's header out of the connection's buffer without
+   reading from the socket, leaving its payload.  Returns 0, or -1 with errno
+   set to EAGAIN if the whole header hasn't arrived yet.
+ */
+ssize_t take_header(Connection *conn, Header *header) {
+  if (conn_buffered(conn) < HEADER_SIZE) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  unpack_header(header, conn->buf + conn->start);
+  conn->start += HEADER_SIZE;
+  return 0;
+}
+
+/* Take a whole frame, header and payload, out of the connection's buffer
+   without reading from the socket.  payload is pointed into the buffer, so is
+   only valid until the connection is next read from.
+
+   Returns the length of the payload, or -1 with errno set to EAGAIN if the
+   whole frame hasn't arrived yet, or EMSGSIZE if the payload is longer than
+   the connection allows.
+ */
+ssize_t take_frame(Connection *conn, Header *header, char **payload) {
+  if (conn_buffered(conn) < HEADER_SIZE) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  unpack_header(header, conn->buf + conn->start);
+  if (header->length > conn->max_message) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  if (conn_buffered(conn) < HEADER_SIZE + header->length) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  *payload = conn->buf + conn->start + HEADER_SIZE;
+  conn->start += HEADER_SIZE + (size_t)header->length;
+  return (ssize_t)header->length;
+}
+
+/* Read the next frame's header, leaving its payload on the connection.
+   Returns 0, or -1 if the connection failed or ended.
+ */
+ssize_t recv_header(Connection *conn, Header *header) {
+  if (conn_need(conn, HEADER_SIZE) < 0)
+    return -1;
+  take_header(conn, header);
+
+  log_debug("received header op=0x%x flags=0x%x id=%u length=%llu",
+            header->opcode, header->flags, header->id,
+            (unsigned long long)header->length);
+  return 0;
+}
+
+/* Read the payload for a header already taken with recv_header().  payload is
+   pointed into the connection's buffer, so is only valid until the connection
+   is next read from.  Returns the length of the payload, or -1 if the
+   connection failed or the payload is longer than the connection allows.
+ */
+ssize_t recv_payload(Connection *conn, Header *header, char **payload) {
+  if (header->length > conn->max_message) {
+    log_warn("message too long: %lluB", (unsigned long long)header->length);
+    errno = EMSGSIZE;
+    return -1;
+  }
+  if (conn_need(conn, (size_t)header->length) < 0)
+    return -1;
+
+  *payload = conn->buf + conn->start;
+  conn->start += (size_t)header->length;
+  return (ssize_t)header->length;
+}
+
+/* Read a whole frame, header and payload.  payload is pointed into the
+   connection's buffer, so is only valid until the connection is next read
+   from.  Returns the length of the payload, or -1 if the connection failed
+   or the payload is longer than the connection allows.
+ */
+ssize_t recv_frame(Connection *conn, Header *header, char **payload) {
+  ssize_t n;
+
+  while ((n = take_frame(conn, header, payload)) < 0) {
+    if (errno != EAGAIN) {
+      log_warn("message too long: %lluB",
+               (unsigned long long)header->length);
+      return -1;
+    }
+    if (conn_need(conn, conn_buffered(conn) + 1) < 0)
+      return -1;
+  }
+
+  log_debug("received frame op=0x%x flags=0x%x id=%u length=%llu",
+            header->opcode, header->flags, header->id,
+            (unsigned long long)header->length);
+  return n;
+}
+
+/* Is the payload for header a properly terminated string? */
+bool payload_string(Header *header, char *payload) {
+  return header->length > 0 && payload[header->length - 1] == '\0';
+}
+
+/* Write a file's size and modification time into buf in network byte order,
+   as the payload of an ATTRS reply. */
+void pack_attrs(char buf[ATTRS_SIZE], off_t size, int64_t mtime) {
+  uint64_t be_size = htobe64((uint64_t)size);
+  uint64_t be_mtime = htobe64((uint64_t)mtime);
+
+  memcpy(buf, &be_size, 8);
+  memcpy(buf + 8, &be_mtime, 8);
+}
+
+/* Read a file's size and modification time out of an ATTRS payload. */
+void unpack_attrs(off_t *size, int64_t *mtime, char buf[ATTRS_SIZE]) {
+  uint64_t be_size, be_mtime;
+
+  memcpy(&be_size, buf, 8);
+  memcpy(&be_mtime, buf + 8, 8);
+  *size = (off_t)be64toh(be_size);
+  *mtime = (int64_t)be64toh(be_mtime);
+}
+
+/* A file's modification time in nanoseconds since the epoch. */
+int64_t mtime_ns(struct stat *fs) {
+  return (int64_t)fs->st_mtim.tv_sec * 1000000000 + fs->st_mtim.tv_nsec;
+}
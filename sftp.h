@@ -3,18 +3,110 @@
 #include <netdb.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
+#include "log.h"
+
 /* Default port to use for the app. */
 #define DEFAULT_PORT "49152"
 
 /* Maximum number of bytes we can fetch at once. */
 #define MAXDATASIZE BUFSIZ
 
+/* How much we try to read from a connection at once when looking for a
+   message. */
+#define CONN_BUFSIZE (64 * 1024)
+
+/* Longest message (not counting the terminating nil) we accept by default. */
+#define DEFAULT_MAX_MESSAGE (64 * 1024)
+
+/* The newest version of the protocol we speak.  Version 1 is nil terminated
+   text; version 2 frames everything with a binary Header. */
+#define PROTOCOL_VERSION 2
+
+/* Size of a version 2 header on the wire. */
+#define HEADER_SIZE 16
+
+/* Version 2 opcodes.  Requests come from the client, replies from the
+   server, and a reply carries the id of the request it answers.  A client
+   may send more requests before the replies to earlier ones arrive, and
+   should match replies to requests by id rather than by order. */
+enum Opcode {
+  /* Requests. */
+  OP_DONE = 1,
+  OP_LIST = 2,
+  OP_GET = 3,
+  OP_PUT = 4,
+  OP_STAT = 5,
+  OP_STATS = 6,
+  OP_MGET = 7, /* Nil terminated paths or patterns, one after another. */
+
+  /* Replies, or a client's answer to one. */
+  OP_OK = 0x80,
+  OP_NO = 0x81,
+  OP_ERROR = 0x82,
+  OP_SIZE = 0x83,
+  OP_DATA = 0x84,
+  OP_ENTRIES = 0x85,
+  OP_ATTRS = 0x86,
+  OP_ENTRY = 0x87,    /* One file or directory of a tree, either way. */
+  OP_SIGS = 0x88,     /* Signatures of the blocks of a file, for a delta. */
+  OP_BLOCKS = 0x89,   /* The client's answer: runs of those blocks to copy. */
+  OP_CHECKSUM = 0x8a, /* Either way: the CRC-32C of the DATA just sent. */
+  OP_COUNTERS = 0x8b, /* The server's counters, as STATS asked. */
+  OP_FILE = 0x8c,     /* One file of an MGET, or why it can't be had. */
+};
+
+/* Version 2 flags. */
+#define FLAG_CONFIRM 0x0001  /* GET: send SIZE and wait for OK or NO first. */
+#define FLAG_NOWAIT 0x0002   /* PUT: DATA follows without waiting for an OK. */
+#define FLAG_RANGE 0x0004    /* GET: an offset and length precede the path. */
+#define FLAG_RESUME 0x0008   /* PUT: an offset and mtime follow the size. */
+#define FLAG_TREE 0x0010     /* GET, PUT: a whole directory tree, as ENTRYs. */
+#define FLAG_STAT 0x0020     /* LIST: give each entry's type, size and mtime. */
+#define FLAG_SORT 0x0040     /* LIST: in order of name. */
+#define FLAG_DELTA 0x0080    /* PUT: only what the server hasn't got is sent. */
+#define FLAG_COMPRESS 0x0100 /* GET, PUT, DATA: the data goes in chunks, each
+                                compressed if it's worth it. */
+#define FLAG_CHECKSUM 0x0200 /* GET, PUT, DATA: a CHECKSUM follows the data. */
+
+/* Size of what comes before each name in a LIST with FLAG_STAT: a type
+   letter, then the size and the mtime in nanoseconds. */
+#define LIST_STAT_FIXED 17
+
+/* Size of an ATTRS payload: a file's size and its modification time in
+   nanoseconds since the epoch. */
+#define ATTRS_SIZE 16
+
+/* A version 2 frame header, in host byte order.  length bytes of payload
+   follow it on the wire: a nil terminated string for paths and error
+   messages, or the raw bytes of a file for OP_DATA.
+ */
+typedef struct Header_t {
+  uint16_t opcode;
+  uint16_t flags;
+  uint32_t id;
+  uint64_t length;
+} Header;
+
 /* A command */
 typedef struct Command_t {
-  enum { ERROR = -1, DONE = 0, LIST = 1, GET = 2, PUT = 3 } type;
+  enum {
+    ERROR = -1,
+    DONE = 0,
+    LIST = 1,
+    GET = 2,
+    PUT = 3,
+    HELLO = 4,
+    STAT = 5,
+    STATS = 6,
+    MGET = 7
+  } type;
+  uint32_t id;
+  uint16_t flags;
   union {
     struct {
       char *path;
@@ -22,24 +114,69 @@ typedef struct Command_t {
     struct {
       char *path;
       char *into;
+      off_t offset;
+      off_t length; /* -1 for the rest of the file. */
     } get;
     struct {
       char *path;
       char *from;
+      off_t size;
+      off_t offset;  /* Where a resumed PUT carries on from. */
+      int64_t mtime; /* What a resumed PUT stamps on the file. */
     } put;
+    struct {
+      char *path;
+    } stat;
+    struct {
+      int version;
+    } hello;
+    struct {
+      char *patterns; /* Nil terminated, one after another. */
+      size_t length;  /* Of all of them, nils included. */
+    } mget;
   };
 } Command;
 
+/* A connection to the other end, along with anything read from it that
+   hasn't been used yet. */
+typedef struct Connection_t {
+  int fd;
+  char *buf;
+  size_t size;
+  size_t start;
+  size_t end;
+  size_t max_message;
+  int version;
+  uint32_t next_id;
+} Connection;
+
 extern const char *program_name;
-extern bool debug;
 
 void *get_in_addr(struct sockaddr *);
 
-int log_info(char *, ...);
-int log_warn(char *, ...);
-int log_error(char *, ...);
-int log_debug(char *, ...);
+void conn_init(Connection *, int);
+void conn_free(Connection *);
+ssize_t conn_fill(Connection *);
+size_t conn_buffered(Connection *);
+
+ssize_t conn_need(Connection *, size_t);
 
 ssize_t send_all(int, char *, size_t);
-ssize_t recv_all(int, char **);
+ssize_t take_message(Connection *, char **);
+ssize_t recv_message(Connection *, char **);
 int dzprintf(int, char *, ...);
+
+void pack_header(char[HEADER_SIZE], Header *);
+void unpack_header(Header *, char[HEADER_SIZE]);
+ssize_t send_header(int, uint16_t, uint16_t, uint32_t, uint64_t, int);
+ssize_t send_frame(int, uint16_t, uint16_t, uint32_t, void *, size_t);
+ssize_t send_error(int, uint32_t, char *, ...);
+ssize_t take_header(Connection *, Header *);
+ssize_t take_frame(Connection *, Header *, char **);
+ssize_t recv_header(Connection *, Header *);
+ssize_t recv_payload(Connection *, Header *, char **);
+ssize_t recv_frame(Connection *, Header *, char **);
+bool payload_string(Header *, char *);
+void pack_attrs(char[ATTRS_SIZE], off_t, int64_t);
+void unpack_attrs(off_t *, int64_t *, char[ATTRS_SIZE]);
+int64_t mtime_ns(struct stat *);
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <linux/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sftp.h"
+#include "stats.h"
+
+const char *stats_names[STATS_COUNTERS] = {
+    "sessions",        "sessions_total", "requests", "transfers",
+    "transfers_total", "bytes_in",       "bytes_out", "errors",
+};
+
+/* One worker's counters, on a cache line of their own. */
+typedef struct Counters_t {
+  _Alignas(STATS_LINE) uint64_t n[STATS_COUNTERS];
+} Counters;
+
+_Static_assert(sizeof(Counters) == STATS_LINE,
+               "a worker's counters should fill one cache line");
+
+static Counters *counters;
+static int workers;
+
+/* This process's worker's counters, or NULL to count nothing, as in the
+   client. */
+static Counters *mine;
+
+/* Map the counters for the given number of workers, before any of them are
+   started so that all of them share the one mapping.  Returns false if it
+   couldn't be made, in which case nothing's counted. */
+bool stats_init(int n) {
+  void *p = mmap(NULL, (size_t)n * sizeof *counters, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  if (p == MAP_FAILED) {
+    log_warn("couldn't map memory for statistics: %s", strerror(errno));
+    return false;
+  }
+  counters = p;
+  workers = n;
+  return true;
+}
+
+/* Count this process, and the sessions it forks, against worker i. */
+void stats_worker(int i) {
+  if (counters != NULL && i >= 0 && i < workers)
+    mine = &counters[i];
+}
+
+/* Add n to a counter, or take it away if negative. */
+void stats_add(int counter, int64_t n) {
+  if (mine != NULL)
+    __atomic_fetch_add(&mine->n[counter], (uint64_t)n, __ATOMIC_RELAXED);
+}
+
+/* Add the bytes sent and received on a session's socket since last time to
+   the counters. */
+void stats_socket(int fd, StatsSocket *last) {
+  struct tcp_info info;
+  socklen_t len = sizeof info;
+
+  if (mine == NULL)
+    return;
+  memset(&info, 0, sizeof info);
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+    return;
+
+  stats_add(STATS_BYTES_IN, (int64_t)(info.tcpi_bytes_received - last->in));
+  stats_add(STATS_BYTES_OUT, (int64_t)(info.tcpi_bytes_acked - last->out));
+  last->in = info.tcpi_bytes_received;
+  last->out = info.tcpi_bytes_acked;
+}
+
+/* Every counter, added up over all the workers. */
+void stats_read(uint64_t totals[STATS_COUNTERS]) {
+  memset(totals, 0, STATS_COUNTERS * sizeof *totals);
+  for (int i = 0; counters != NULL && i < workers; i++)
+    for (int c = 0; c < STATS_COUNTERS; c++)
+      totals[c] += __atomic_load_n(&counters[i].n[c], __ATOMIC_RELAXED);
+}
+
+/* The counters as text, a line of "sftp_" then the name and the value for
+   each, as metrics scrapers expect.  The caller frees it. */
+char *stats_format(uint64_t totals[STATS_COUNTERS]) {
+  char *text = NULL;
+  size_t len = 0;
+  FILE *f;
+
+  if ((f = open_memstream(&text, &len)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  for (int c = 0; c < STATS_COUNTERS; c++)
+    fprintf(f, "sftp_%s %llu\n", stats_names[c],
+            (unsigned long long)totals[c]);
+  if (fclose(f) != 0)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  return text;
+}
+
+/* The payload of a COUNTERS reply. */
+void stats_pack(char buf[STATS_SIZE]) {
+  uint64_t totals[STATS_COUNTERS];
+
+  stats_read(totals);
+  for (int c = 0; c < STATS_COUNTERS; c++)
+    totals[c] = htobe64(totals[c]);
+  memcpy(buf, totals, STATS_SIZE);
+}
+
+/* Read the counters out of a COUNTERS payload of len bytes.  Any it doesn't
+   have are 0, and any this end doesn't know about are ignored. */
+void stats_unpack(uint64_t totals[STATS_COUNTERS], char *buf, size_t len) {
+  uint64_t n;
+
+  for (size_t c = 0; c < STATS_COUNTERS; c++) {
+    totals[c] = 0;
+    if ((c + 1) * sizeof n <= len) {
+      memcpy(&n, buf + c * sizeof n, sizeof n);
+      totals[c] = be64toh(n);
+    }
+  }
+}
+
+/* Write the counters as text to path, every STATS_DUMP_INTERVAL seconds for
+   as long as the server runs, from a process of its own.  Each time a new
+   file replaces the old one, so a reader never sees half of one.  Returns
+   false if the process couldn't be started.
+ */
+bool stats_dump(char *path) {
+  uint64_t totals[STATS_COUNTERS];
+  char *text, *temp;
+  pid_t pid;
+  FILE *f;
+  bool ok = false;
+
+  if ((pid = fork()) < 0) {
+    log_warn("fork: %s", strerror(errno));
+    return false;
+  }
+  if (pid > 0)
+    return true;
+
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (asprintf(&temp, "%s.tmp", path) < 0)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+
+  for (;; sleep(STATS_DUMP_INTERVAL)) {
+    stats_read(totals);
+    text = stats_format(totals);
+    if ((f = fopen(temp, "w")) != NULL) {
+      ok = fputs(text, f) != EOF;
+      ok = fclose(f) == 0 && ok;
+    }
+    if (f == NULL || !ok || rename(temp, path) != 0)
+      log_warn("couldn't write %s: %s", path, strerror(errno));
+    free(text);
+  }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Counters kept by every server process, in memory shared between them so
+   that any one can read out the lot.  The _TOTAL ones only ever go up; the
+   others are how many of something there are right now. */
+enum StatsCounter {
+  STATS_SESSIONS,       /* Clients connected. */
+  STATS_SESSIONS_TOTAL, /* Clients that have connected. */
+  STATS_REQUESTS,       /* Requests handled. */
+  STATS_TRANSFERS,      /* GETs and PUTs under way. */
+  STATS_TRANSFERS_TOTAL,
+  STATS_BYTES_IN,  /* Received from clients, counted by the kernel. */
+  STATS_BYTES_OUT, /* Sent to them and acknowledged. */
+  STATS_ERRORS,    /* ERROR replies. */
+  STATS_COUNTERS,
+};
+
+/* Size of a cache line.  Each worker's counters take one to themselves, so
+   that workers on different CPUs don't keep taking it from each other. */
+#define STATS_LINE 64
+
+/* Size of a COUNTERS payload: every counter, 8 bytes each, in the order
+   above.  A client should expect there to be more in the future. */
+#define STATS_SIZE (8 * STATS_COUNTERS)
+
+/* Most seconds between writes of the metrics file. */
+#define STATS_DUMP_INTERVAL 1
+
+/* How much of a session's traffic has been counted so far.  The kernel
+   keeps count of the bytes each way on a socket, which saves counting them
+   at every send and receive; they're added to the counters after each
+   request and when the session ends. */
+typedef struct StatsSocket_t {
+  uint64_t in;
+  uint64_t out;
+} StatsSocket;
+
+extern const char *stats_names[STATS_COUNTERS];
+
+bool stats_init(int);
+void stats_worker(int);
+void stats_add(int, int64_t);
+void stats_socket(int, StatsSocket *);
+void stats_read(uint64_t[STATS_COUNTERS]);
+char *stats_format(uint64_t[STATS_COUNTERS]);
+void stats_pack(char[STATS_SIZE]);
+void stats_unpack(uint64_t[STATS_COUNTERS], char *, size_t);
+bool stats_dump(char *);
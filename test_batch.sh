@@ -0,0 +1,59 @@
+#!/bin/sh
+# Run a batch in which some jobs fail, one of them by breaking its
+# connection, and check that the rest are still done and the summary counts
+# them all.  Run from the top of the tree with make check.
+
+top=$(pwd)
+dir=$(mktemp -d) || exit 1
+port=$((20000 + $$ % 10000))
+failed=0
+
+cleanup() {
+  kill "$server" 2>/dev/null
+  wait "$server" 2>/dev/null
+  rm -rf "$dir"
+}
+trap cleanup EXIT
+
+mkdir "$dir/srv" "$dir/srv/dir" "$dir/cli"
+echo hello > "$dir/srv/small"
+long=$(printf '%0200d' 0)
+
+# A GET of a path longer than the server's -m limit makes it drop the
+# connection, so the job after it needs a new one.
+cat > "$dir/cli/manifest" <<EOF
+get dir got-dir
+get small got-1
+get $long got-long
+get small got-2
+EOF
+
+cd "$dir/srv" || exit 1
+"$top/server" -p "$port" -m 100 2> "$dir/server.log" &
+server=$!
+sleep 0.5
+
+cd "$dir/cli" || exit 1
+for n in 1 3; do
+  rm -f got-*
+  "$top/client" -p "$port" -b manifest -n "$n" localhost > out 2> err
+  status=$?
+  if [ "$status" -ne 1 ]; then
+    echo "-n $n: exited $status, not 1"
+    failed=1
+  fi
+  if ! grep -q '^4 jobs: 2 done, 2 failed, 0 not run$' out; then
+    echo "-n $n: wrong summary:"
+    cat out err
+    failed=1
+  fi
+  for f in got-1 got-2; do
+    if ! cmp -s "$dir/srv/small" "$f"; then
+      echo "-n $n: $f wasn't fetched"
+      failed=1
+    fi
+  done
+done
+
+[ "$failed" -eq 0 ] && echo "batch test passed"
+exit "$failed"
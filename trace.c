@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sftp.h"
+#include "trace.h"
+
+const char *trace_names[TRACE_PHASES] = {
+    "get",      "put",   "list",     "stat",    "open",
+    "handshake", "read", "send",     "sendfile", "recv",
+    "write",    "checksum", "readdir", "close",
+};
+
+#ifdef SFTP_TRACE
+/* Events are kept in memory and written out TRACE_EVENTS at a time, to
+   prefix.pid, a file for each process: the server forks one for each
+   session and the client one for each extra range of a GET.  The file's
+   only opened when the process has something to write to it.  Transfers
+   only ever happen on one thread of a process, so there's no locking.
+ */
+
+bool trace_on = false;
+
+static char *prefix;
+static int trace_fd = -1;
+static TraceEvent events[TRACE_EVENTS];
+static size_t count;
+
+/* Write out the parent's events before forking, so the child doesn't write
+   them again, and give the child its own file. */
+static void prepare_fork(void) {
+  trace_flush();
+}
+
+static void after_fork_child(void) {
+  if (trace_fd >= 0)
+    close(trace_fd);
+  trace_fd = -1;
+  count = 0;
+}
+
+/* Start tracing this process, and those it forks, to files named after
+   path.  Returns false if tracing can't be started. */
+bool trace_open(char *path) {
+  if ((prefix = strdup(path)) == NULL)
+    return false;
+  pthread_atfork(prepare_fork, NULL, after_fork_child);
+  atexit(trace_flush);
+  trace_on = true;
+  return true;
+}
+
+uint64_t trace_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/* Record a span of the given phase of request id, from start until now. */
+void trace_event(int phase, uint32_t id, uint64_t bytes, uint64_t start) {
+  TraceEvent *e = &events[count];
+
+  e->start = start;
+  e->duration = trace_now() - start;
+  e->bytes = bytes;
+  e->id = id;
+  e->phase = (uint16_t)phase;
+  e->unused = 0;
+  if (++count == TRACE_EVENTS)
+    trace_flush();
+}
+
+static bool open_trace_file(void) {
+  TraceHeader header;
+  char *path;
+
+  if (asprintf(&path, "%s.%d", prefix, (int)getpid()) < 0)
+    return false;
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace_fd < 0) {
+    log_warn("couldn't open %s, not tracing: %s", path, strerror(errno));
+    free(path);
+    return false;
+  }
+  free(path);
+
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, TRACE_MAGIC, sizeof header.magic);
+  header.pid = (uint32_t)getpid();
+  header.event_size = sizeof(TraceEvent);
+  return write(trace_fd, &header, sizeof header) == sizeof header;
+}
+
+/* Write out the events recorded so far.  If they can't be, tracing stops. */
+void trace_flush(void) {
+  char *p = (char *)events;
+  size_t left = count * sizeof *events;
+  ssize_t n;
+
+  if (count == 0)
+    return;
+  count = 0;
+  if (trace_fd < 0 && !open_trace_file())
+    goto fail;
+
+  for (; left > 0; p += n, left -= (size_t)n)
+    if ((n = write(trace_fd, p, left)) < 0 && errno != EINTR)
+      goto fail;
+    else if (n < 0)
+      n = 0;
+  return;
+
+fail:
+  log_warn("couldn't write trace, not tracing: %s", strerror(errno));
+  trace_on = false;
+}
+#else
+bool trace_open(__attribute__((unused)) char *path) {
+  errno = ENOTSUP;
+  return false;
+}
+
+void trace_flush(void) {}
+#endif
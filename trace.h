@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* What a span of a trace was spent doing.  The first few are whole
+   requests, and the rest the phases within them. */
+enum TracePhase {
+  TRACE_GET,
+  TRACE_PUT,
+  TRACE_LIST,
+  TRACE_STAT,      /* stat() or fstat() of the file. */
+  TRACE_OPEN,      /* Opening it. */
+  TRACE_HANDSHAKE, /* Waiting for the other end to say go ahead. */
+  TRACE_READ,      /* Reading a chunk of the file into memory. */
+  TRACE_SEND,      /* Sending a chunk from memory. */
+  TRACE_SENDFILE,  /* Sending straight from the file with sendfile(). */
+  TRACE_RECV,      /* Receiving a chunk, into memory or a pipe. */
+  TRACE_WRITE,     /* Writing a chunk to the file. */
+  TRACE_CHECKSUM,  /* Reading a step of the file back to checksum it. */
+  TRACE_READDIR,   /* Reading a directory into a listing. */
+  TRACE_CLOSE,     /* Closing the file, and anything done to it then. */
+  TRACE_PHASES,
+};
+
+/* A trace file is a TraceHeader and then TraceEvents, in the byte order of
+   the machine that wrote it, one file per process. */
+#define TRACE_MAGIC "sftptrc1"
+
+typedef struct TraceHeader_t {
+  char magic[8];
+  uint32_t pid;
+  uint32_t event_size; /* sizeof(TraceEvent), to tell a foreign file. */
+} TraceHeader;
+
+typedef struct TraceEvent_t {
+  uint64_t start;    /* CLOCK_MONOTONIC, in nanoseconds. */
+  uint64_t duration; /* In nanoseconds. */
+  uint64_t bytes;    /* Moved in the span, or entries read by readdir. */
+  uint32_t id;       /* Of the request, or 0 for chunks and protocol 1. */
+  uint16_t phase;
+  uint16_t unused;
+} TraceEvent;
+
+/* Events kept in memory before they're written out together. */
+#define TRACE_EVENTS 4096
+
+extern const char *trace_names[TRACE_PHASES];
+
+/* Time a span with trace_start() at its beginning and trace_end() at its
+   end.  Built without SFTP_TRACE neither does anything, nor evaluates its
+   arguments; built with it they only read the clock once tracing has been
+   turned on.
+ */
+#ifdef SFTP_TRACE
+extern bool trace_on;
+
+#define trace_start() (trace_on ? trace_now() : 0)
+#define trace_end(phase, id, bytes, start)                                     \
+  do {                                                                         \
+    if (trace_on)                                                              \
+      trace_event((phase), (id), (bytes), (start));                            \
+  } while (0)
+#else
+#define trace_start() ((uint64_t)0)
+#define trace_end(phase, id, bytes, start) ((void)(start))
+#endif
+
+bool trace_open(char *);
+uint64_t trace_now(void);
+void trace_event(int, uint32_t, uint64_t, uint64_t);
+void trace_flush(void);
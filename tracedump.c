@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sftp.h"
+#include "trace.h"
+#include "tracedump.h"
+
+/* Reads the trace files the server and client write with -T and prints, for
+   each phase, a histogram of how long it took; or with -c the lot as Chrome
+   trace JSON, for chrome://tracing or Perfetto to draw on a timeline.
+ */
+
+/* Print how to call the tool and exit. */
+void usage() {
+  fprintf(stderr, "usage: %s [-c] trace-file ...\n", program_name);
+  exit(EXIT_FAILURE);
+}
+
+/* Add every event in the trace file at path to spans.  Returns false if it
+   isn't a trace file this can read. */
+bool read_trace(Spans *spans, char *path) {
+  TraceHeader header;
+  TraceEvent event;
+  FILE *f;
+  bool ok = false;
+
+  if ((f = fopen(path, "rb")) == NULL) {
+    log_warn("couldn't open %s: %s", path, strerror(errno));
+    return false;
+  }
+  if (fread(&header, sizeof header, 1, f) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof header.magic) != 0 ||
+      header.event_size != sizeof event) {
+    log_warn("%s isn't a trace file", path);
+    goto done;
+  }
+
+  while (fread(&event, sizeof event, 1, f) == 1) {
+    if (event.phase >= TRACE_PHASES)
+      continue;
+    if (spans->count == spans->size) {
+      spans->size = spans->size ? spans->size * 2 : 1024;
+      if ((spans->spans = reallocarray(spans->spans, spans->size,
+                                       sizeof *spans->spans)) == NULL)
+        log_error("couldn't allocate memory: %s", strerror(errno));
+    }
+    spans->spans[spans->count].event = event;
+    spans->spans[spans->count++].pid = header.pid;
+  }
+  ok = !ferror(f);
+  if (!ok)
+    log_warn("couldn't read %s: %s", path, strerror(errno));
+
+done:
+  fclose(f);
+  return ok;
+}
+
+/* Order spans by when they started. */
+int compare_spans(const void *a, const void *b) {
+  uint64_t x = ((const Span *)a)->event.start;
+  uint64_t y = ((const Span *)b)->event.start;
+
+  return (x > y) - (x < y);
+}
+
+int compare_durations(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Print a histogram of the count durations of a phase, in nanoseconds and
+   sorted, and how many bytes the spans moved between them. */
+void print_histogram(int phase, uint64_t *durations, size_t count,
+                     uint64_t bytes) {
+  size_t buckets[DUMP_BUCKETS] = {0}, most = 0;
+  uint64_t total = 0, us;
+  int b, first = DUMP_BUCKETS, last = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    total += durations[i];
+    us = durations[i] / 1000;
+    for (b = 0; b < DUMP_BUCKETS - 1 && us >= (1ULL << b); b++)
+      ;
+    buckets[b]++;
+  }
+  for (b = 0; b < DUMP_BUCKETS; b++) {
+    if (buckets[b] == 0)
+      continue;
+    first = b < first ? b : first;
+    last = b;
+    most = buckets[b] > most ? buckets[b] : most;
+  }
+
+  printf("%s: %zu spans, %llu bytes, mean %lluus, p50 %lluus, p90 %lluus, "
+         "p99 %lluus, max %lluus\n",
+         trace_names[phase], count, (unsigned long long)bytes,
+         (unsigned long long)(total / count / 1000),
+         (unsigned long long)(durations[count / 2] / 1000),
+         (unsigned long long)(durations[count * 9 / 10] / 1000),
+         (unsigned long long)(durations[count * 99 / 100] / 1000),
+         (unsigned long long)(durations[count - 1] / 1000));
+
+  /* Bucket b holds spans shorter than 2^b us and at least half that. */
+  for (b = first; b <= last; b++)
+    printf("  < %10lluus %8zu %.*s\n", 1ULL << b, buckets[b],
+           (int)(buckets[b] * DUMP_BAR / most),
+           "##################################################");
+}
+
+/* Print a histogram for each phase that has any spans. */
+void print_histograms(Spans *spans) {
+  uint64_t *durations, bytes;
+  size_t n;
+
+  if ((durations = calloc(spans->count + 1, sizeof *durations)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+
+  for (int phase = 0; phase < TRACE_PHASES; phase++) {
+    n = 0;
+    bytes = 0;
+    for (size_t i = 0; i < spans->count; i++)
+      if (spans->spans[i].event.phase == phase) {
+        durations[n++] = spans->spans[i].event.duration;
+        bytes += spans->spans[i].event.bytes;
+      }
+    if (n == 0)
+      continue;
+    qsort(durations, n, sizeof *durations, compare_durations);
+    print_histogram(phase, durations, n, bytes);
+  }
+
+  free(durations);
+}
+
+/* Print the spans as complete events in Chrome's trace event format, a
+   process to each trace file. */
+void print_chrome(Spans *spans) {
+  TraceEvent *e;
+
+  printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (size_t i = 0; i < spans->count; i++) {
+    e = &spans->spans[i].event;
+    printf("%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03u,"
+           "\"dur\":%llu.%03u,\"pid\":%u,\"tid\":%u,"
+           "\"args\":{\"id\":%u,\"bytes\":%llu}}",
+           i > 0 ? "," : "", trace_names[e->phase],
+           e->phase <= TRACE_LIST ? "request" : "phase",
+           (unsigned long long)(e->start / 1000),
+           (unsigned)(e->start % 1000),
+           (unsigned long long)(e->duration / 1000),
+           (unsigned)(e->duration % 1000), spans->spans[i].pid,
+           spans->spans[i].pid, e->id, (unsigned long long)e->bytes);
+  }
+  printf("\n]}\n");
+}
+
+int main(int argc, char *argv[]) {
+  Spans spans = {NULL, 0, 0};
+  bool chrome = false;
+  int opt;
+
+  program_name = argv[0];
+  while ((opt = getopt(argc, argv, "c")) != -1) {
+    switch (opt) {
+    case 'c':
+      chrome = true;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind >= argc)
+    usage();
+
+  for (int i = optind; i < argc; i++)
+    if (!read_trace(&spans, argv[i]))
+      return EXIT_FAILURE;
+  if (spans.count > 0)
+    qsort(spans.spans, spans.count, sizeof *spans.spans, compare_spans);
+
+  if (chrome)
+    print_chrome(&spans);
+  else
+    print_histograms(&spans);
+
+  free(spans.spans);
+  return EXIT_SUCCESS;
+}
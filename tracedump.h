@@ -0,0 +1,31 @@
+#pragma once
+#include "sftp.h"
+#include "trace.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Buckets of a histogram, each twice as long as the one before, from 1us. */
+#define DUMP_BUCKETS 32
+
+/* Widest bar of a histogram. */
+#define DUMP_BAR 50
+
+/* An event read from a trace file, with the process that recorded it. */
+typedef struct Span_t {
+  TraceEvent event;
+  uint32_t pid;
+} Span;
+
+typedef struct Spans_t {
+  Span *spans;
+  size_t count;
+  size_t size;
+} Spans;
+
+void usage(void);
+bool read_trace(Spans *, char *);
+int compare_spans(const void *, const void *);
+int compare_durations(const void *, const void *);
+void print_histograms(Spans *);
+void print_histogram(int, uint64_t *, size_t, uint64_t);
+void print_chrome(Spans *);
@@ -0,0 +1,1188 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "crc32c.h"
+#include "sftp.h"
+#include "trace.h"
+#include "transfer.h"
+#ifdef SFTP_URING
+#include "uring.h"
+#endif
+
+bool use_uring = false;
+bool write_behind = false;
+off_t writeback_step = 0;
+
+/* Send len bytes of file_fd, starting at offset, down sock_fd.  The kernel
+   copies straight from the page cache to the socket with sendfile(); if the
+   pair of descriptors can't be used with it we fall back to a read/send loop
+   from wherever sendfile got to.
+
+   Returns the number of bytes sent, which is only less than len if an error
+   occurred (errno is set) or the file was truncated under us.
+ */
+off_t send_file(int sock_fd, int file_fd, off_t offset, off_t len) {
+  off_t sent = 0;
+  size_t want;
+  ssize_t n;
+  uint64_t started;
+
+#ifdef SFTP_URING
+  if (use_uring && (sent = uring_send_file(sock_fd, file_fd, offset, len)) >= 0)
+    return sent;
+  sent = 0;
+#endif
+
+  while (sent < len) {
+    want = (len - sent < SENDFILE_CHUNK) ? (size_t)(len - sent) : SENDFILE_CHUNK;
+    started = trace_start();
+    n = sendfile(sock_fd, file_fd, &offset, want);
+    trace_end(TRACE_SENDFILE, 0, n > 0 ? (uint64_t)n : 0, started);
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+        log_debug("sendfile unusable (%s), copying instead", strerror(errno));
+        return sent + send_file_copy(sock_fd, file_fd, offset, len - sent);
+      }
+      log_warn("sendfile: %s", strerror(errno));
+      return sent;
+    }
+    if (n == 0) {
+      log_warn("file truncated while sending: %lld/%lldB", (long long)sent,
+               (long long)len);
+      errno = EIO;
+      return sent;
+    }
+
+    sent += n;
+    log_debug("sent %lld/%lldB", (long long)sent, (long long)len);
+  }
+
+  return sent;
+}
+
+/* The portable send path: read a chunk of the file into memory then send it,
+   coping with short sends.  Returns bytes sent, as send_file does.
+ */
+off_t send_file_copy(int sock_fd, int file_fd, off_t offset, off_t len) {
+  char buf[MAXDATASIZE];
+  off_t sent = 0;
+  ssize_t chunk_read, chunk_sent, n;
+  size_t want;
+  uint64_t started;
+
+  while (sent < len) {
+    want = (len - sent < MAXDATASIZE) ? (size_t)(len - sent) : MAXDATASIZE;
+    started = trace_start();
+    chunk_read = pread(file_fd, buf, want, offset + sent);
+    trace_end(TRACE_READ, 0, chunk_read > 0 ? (uint64_t)chunk_read : 0,
+              started);
+    if (chunk_read < 0) {
+      if (errno == EINTR)
+        continue;
+      log_warn("read: %s", strerror(errno));
+      return sent;
+    }
+    if (chunk_read == 0) {
+      log_warn("file truncated while sending: %lld/%lldB", (long long)sent,
+               (long long)len);
+      errno = EIO;
+      return sent;
+    }
+
+    chunk_sent = 0;
+    started = trace_start();
+    while (chunk_sent < chunk_read) {
+      n = send(sock_fd, buf + chunk_sent, (size_t)(chunk_read - chunk_sent), 0);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        log_warn("send: %s", strerror(errno));
+        return sent + chunk_sent;
+      }
+      chunk_sent += n;
+    }
+    trace_end(TRACE_SEND, 0, (uint64_t)chunk_sent, started);
+
+    sent += chunk_sent;
+    log_debug("sent %lld/%lldB", (long long)sent, (long long)len);
+  }
+
+  return sent;
+}
+
+/* The pipe used to splice from sockets into files.  It is made on first use and
+   kept for the life of the thread, as we'd otherwise pay for a pipe(),
+   fcntl() and two close() calls on every transfer.
+ */
+static __thread int splice_pipe[2] = {-1, -1};
+static __thread size_t splice_pipe_size = 0;
+
+static bool get_splice_pipe(void) {
+  int size;
+
+  if (splice_pipe[0] >= 0)
+    return true;
+
+  if (pipe2(splice_pipe, O_CLOEXEC) == -1) {
+    log_debug("pipe: %s", strerror(errno));
+    splice_pipe[0] = splice_pipe[1] = -1;
+    return false;
+  }
+
+  /* Unprivileged processes may be limited by /proc/sys/fs/pipe-max-size, so
+     just use whatever we end up with. */
+  fcntl(splice_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+  size = fcntl(splice_pipe[1], F_GETPIPE_SZ);
+  splice_pipe_size = size > 0 ? (size_t)size : MAXDATASIZE;
+  log_debug("splice pipe of %zuB", splice_pipe_size);
+
+  return true;
+}
+
+/* Throw the pipe away, e.g. when an error might have left data in it. */
+static void drop_splice_pipe(void) {
+  if (splice_pipe[0] >= 0) {
+    close(splice_pipe[0]);
+    close(splice_pipe[1]);
+  }
+  splice_pipe[0] = splice_pipe[1] = -1;
+}
+
+/* Copy len bytes sitting in the pipe into the file at offset through a
+   buffer, for when the file won't accept splice().  Returns bytes written.
+ */
+static off_t drain_pipe_copy(int pipe_fd, int file_fd, off_t offset,
+                             size_t len) {
+  char buf[MAXDATASIZE];
+  off_t done = 0;
+  ssize_t n, written;
+
+  while ((size_t)done < len) {
+    n = read(pipe_fd, buf, len - (size_t)done < MAXDATASIZE ? len - (size_t)done
+                                                            : MAXDATASIZE);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return done;
+
+    for (ssize_t w = 0; w < n; w += written) {
+      written = pwrite(file_fd, buf + w, (size_t)(n - w), offset + done + w);
+      if (written < 0 && errno == EINTR)
+        written = 0;
+      else if (written <= 0)
+        return done + w;
+    }
+    done += n;
+  }
+
+  return done;
+}
+
+/* Write out whatever of the next len bytes have already been read into the
+   connection's buffer, e.g. while looking for the message before them.
+   Returns the bytes written, which is less than the number buffered only on
+   error.
+ */
+static off_t recv_buffered(Connection *conn, int file_fd, off_t offset,
+                           off_t len) {
+  size_t want = conn_buffered(conn);
+  ssize_t written;
+  off_t done = 0;
+  uint64_t started = trace_start();
+
+  if ((off_t)want > len)
+    want = (size_t)len;
+
+  while ((size_t)done < want) {
+    written = pwrite(file_fd, conn->buf + conn->start, want - (size_t)done,
+                     offset + done);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0) {
+      log_warn("write: %s", written < 0 ? strerror(errno) : "short write");
+      return done;
+    }
+    conn->start += (size_t)written;
+    done += written;
+  }
+
+  if (done > 0)
+    trace_end(TRACE_WRITE, 0, (uint64_t)done, started);
+  return done;
+}
+
+/* Receive len bytes from the connection and write them into file_fd at
+   offset, starting with anything already buffered.  The rest of the data is
+   moved with splice() through a pipe so it never gets copied into
+   userspace; if splice can't be used with these descriptors we fall back to a
+   recv/write loop.
+
+   Returns the number of bytes written into the file, which is only less than
+   len if something went wrong (errno is set).  A connection closed early is
+   reported as ECONNRESET.
+ */
+off_t recv_file(Connection *conn, int file_fd, off_t offset, off_t len) {
+  int sock_fd = conn->fd;
+  off_t received;
+  size_t want;
+  ssize_t n, m, left;
+  bool copy_out = false;
+  uint64_t started;
+
+  received = recv_buffered(conn, file_fd, offset, len);
+  if (received == len || conn_buffered(conn) > 0)
+    return received;
+
+  if (write_behind && len - received >= WRITE_BEHIND_MIN)
+    return received + recv_file_behind(conn, file_fd, offset + received,
+                                       len - received, NULL);
+
+#ifdef SFTP_URING
+  off_t ring_received;
+  if (use_uring && (ring_received = uring_recv_file(conn, file_fd,
+                                                    offset + received,
+                                                    len - received)) >= 0)
+    return received + ring_received;
+#endif
+
+  if (!get_splice_pipe())
+    return received + recv_file_copy(conn, file_fd, offset + received,
+                                      len - received);
+
+  while (received < len) {
+    want = (len - received < (off_t)splice_pipe_size)
+               ? (size_t)(len - received)
+               : splice_pipe_size;
+    started = trace_start();
+    n = splice(sock_fd, NULL, splice_pipe[1], NULL, want,
+               SPLICE_F_MOVE | SPLICE_F_MORE);
+    trace_end(TRACE_RECV, 0, n > 0 ? (uint64_t)n : 0, started);
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EINVAL || errno == ENOSYS) {
+        log_debug("splice unusable (%s), copying instead", strerror(errno));
+        return received + recv_file_copy(conn, file_fd, offset + received,
+                                         len - received);
+      }
+      log_warn("splice: %s", strerror(errno));
+      return received;
+    }
+    if (n == 0) {
+      log_warn("connection ended abruptly after %lld/%lldB",
+               (long long)received, (long long)len);
+      errno = ECONNRESET;
+      return received;
+    }
+
+    /* Empty the pipe into the file before reading any more. */
+    started = trace_start();
+    for (left = n; left > 0; left -= m) {
+      if (copy_out) {
+        m = drain_pipe_copy(splice_pipe[0], file_fd, offset + received,
+                            (size_t)left);
+        if (m < left) {
+          log_warn("write: %s", strerror(errno));
+          drop_splice_pipe();
+          return received + m;
+        }
+      } else {
+        off_t at = offset + received;
+        m = splice(splice_pipe[0], NULL, file_fd, &at, (size_t)left,
+                   SPLICE_F_MOVE);
+        if (m < 0 && errno == EINTR) {
+          m = 0;
+          continue;
+        }
+        if (m < 0 && errno == EINVAL) {
+          log_debug("can't splice into file, copying instead");
+          copy_out = true;
+          m = 0;
+          continue;
+        }
+        if (m <= 0) {
+          log_warn("splice: %s", m < 0 ? strerror(errno) : "short write");
+          drop_splice_pipe();
+          return received;
+        }
+      }
+      received += m;
+    }
+    trace_end(TRACE_WRITE, 0, (uint64_t)n, started);
+    log_debug("received %lld/%lldB", (long long)received, (long long)len);
+  }
+
+  return received;
+}
+
+/* The portable receive path: recv a chunk into memory and write it out.
+   Returns bytes written, as recv_file does.
+ */
+off_t recv_file_copy(Connection *conn, int file_fd, off_t offset, off_t len) {
+  char buf[MAXDATASIZE];
+  int sock_fd = conn->fd;
+  off_t received;
+  size_t want;
+  ssize_t n, w, written;
+  uint64_t started;
+
+  received = recv_buffered(conn, file_fd, offset, len);
+  if (received == len || conn_buffered(conn) > 0)
+    return received;
+
+  while (received < len) {
+    want = (len - received < MAXDATASIZE) ? (size_t)(len - received)
+                                          : MAXDATASIZE;
+    started = trace_start();
+    n = recv(sock_fd, buf, want, MSG_WAITALL);
+    trace_end(TRACE_RECV, 0, n > 0 ? (uint64_t)n : 0, started);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      log_warn("recv: %s", strerror(errno));
+      return received;
+    }
+    if (n == 0) {
+      log_warn("connection ended abruptly after %lld/%lldB",
+               (long long)received, (long long)len);
+      errno = ECONNRESET;
+      return received;
+    }
+
+    started = trace_start();
+    for (w = 0; w < n; w += written) {
+      written = pwrite(file_fd, buf + w, (size_t)(n - w), offset + received + w);
+      if (written < 0 && errno == EINTR) {
+        written = 0;
+        continue;
+      }
+      if (written <= 0) {
+        log_warn("write: %s", written < 0 ? strerror(errno) : "short write");
+        return received + w;
+      }
+    }
+
+    trace_end(TRACE_WRITE, 0, (uint64_t)n, started);
+
+    received += n;
+    log_debug("received %lld/%lldB", (long long)received, (long long)len);
+  }
+
+  return received;
+}
+
+/* The buffers a file received with write_behind passes through on its way
+   to disk: the first count of them from head are full, waiting for the
+   writer thread, and the rest are free for the receiving thread to fill.
+ */
+typedef struct WriteBehind_t {
+  pthread_mutex_t lock;
+  pthread_cond_t filled;  /* A buffer's full, or finished is set. */
+  pthread_cond_t emptied; /* A buffer's been written, or writing failed. */
+  char *buffers[WRITE_BUFFERS];
+  size_t used[WRITE_BUFFERS];
+  off_t at[WRITE_BUFFERS]; /* Where in the file each buffer goes. */
+  unsigned head;
+  unsigned count;
+  bool finished; /* No more buffers are coming. */
+  int error;     /* Why writing failed, or 0. */
+  int fd;
+  off_t offset;  /* Where the file's data starts. */
+  off_t written; /* Bytes of it written so far. */
+  off_t synced;  /* Where writeback's been started up to. */
+} WriteBehind;
+
+/* The buffers, allocated on first use and kept for the next file. */
+static __thread char *write_pool;
+
+/* Write a buffer out whole at offset.  Returns 0 or an errno. */
+static int write_buffer(int fd, char *buf, size_t len, off_t offset) {
+  ssize_t n;
+
+  for (size_t done = 0; done < len; done += (size_t)n) {
+    n = pwrite(fd, buf + done, len - done, offset + (off_t)done);
+    if (n < 0 && errno == EINTR) {
+      n = 0;
+      continue;
+    }
+    if (n <= 0)
+      return n < 0 ? errno : EIO;
+  }
+  return 0;
+}
+
+/* Having written up to end, start the kernel writing back each whole
+   writeback_step since the last, and wait for the step before each to be on
+   disk.  The file's pages are then written out steadily as it arrives,
+   rather than piling up dirty until the kernel flushes them all at once.
+   Returns 0 or an errno.
+ */
+static int spread_writeback(WriteBehind *w, off_t end) {
+  off_t step = writeback_step;
+
+  for (; end - w->synced >= step; w->synced += step) {
+    if (sync_file_range(w->fd, w->synced, step, SYNC_FILE_RANGE_WRITE) != 0 &&
+        errno == EIO)
+      return EIO;
+    if (w->synced - step >= w->offset &&
+        sync_file_range(w->fd, w->synced - step, step,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER) != 0 &&
+        errno == EIO)
+      return EIO;
+  }
+  return 0;
+}
+
+/* The writer thread: write out each buffer as it's filled, in order, until
+   there are no more or one can't be written.  It neither logs nor traces;
+   the receiving thread reports what became of the file. */
+static void *write_behind_thread(void *arg) {
+  WriteBehind *w = arg;
+  unsigned i;
+  off_t end;
+  int err;
+
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (w->count == 0 && !w->finished)
+      pthread_cond_wait(&w->filled, &w->lock);
+    if (w->count == 0)
+      break;
+    i = w->head;
+    pthread_mutex_unlock(&w->lock);
+
+    end = w->at[i] + (off_t)w->used[i];
+    err = write_buffer(w->fd, w->buffers[i], w->used[i], w->at[i]);
+    if (err == 0 && writeback_step > 0)
+      err = spread_writeback(w, end);
+
+    pthread_mutex_lock(&w->lock);
+    if (err != 0) {
+      w->error = err;
+      pthread_cond_signal(&w->emptied);
+      break;
+    }
+    w->written = end - w->offset;
+    w->head = (i + 1) % WRITE_BUFFERS;
+    w->count--;
+    pthread_cond_signal(&w->emptied);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+/* Receive len bytes into the file at offset with write_behind: this thread
+   keeps reading the socket into free buffers while another writes the full
+   ones out, so the connection only stalls if the disk falls WRITE_BUFFERS
+   behind.  Unless sum is NULL the CRC-32C of the data is added to it as
+   it's received.  If no thread can be had it's received the usual way.
+   Returns the bytes written, as recv_file() does.
+ */
+off_t recv_file_behind(Connection *conn, int file_fd, off_t offset, off_t len,
+                       uint32_t *sum) {
+  WriteBehind w;
+  pthread_t writer;
+  off_t received, buffered;
+  size_t want;
+  ssize_t n;
+  unsigned i;
+  int err = 0;
+  uint64_t started;
+
+  buffered = (off_t)conn_buffered(conn) < len ? (off_t)conn_buffered(conn)
+                                               : len;
+  if (sum != NULL)
+    *sum = crc32c(*sum, conn->buf + conn->start, (size_t)buffered);
+  received = recv_buffered(conn, file_fd, offset, len);
+  if (received == len || conn_buffered(conn) > 0)
+    return received;
+  buffered = received;
+  offset += received;
+  len -= received;
+  received = 0;
+
+  memset(&w, 0, sizeof w);
+  w.fd = file_fd;
+  w.offset = w.synced = offset;
+  if (write_pool == NULL &&
+      (write_pool = malloc((size_t)WRITE_BUFFERS * WRITE_BUFFER_SIZE)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+  for (i = 0; i < WRITE_BUFFERS; i++)
+    w.buffers[i] = write_pool + (size_t)i * WRITE_BUFFER_SIZE;
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.filled, NULL);
+  pthread_cond_init(&w.emptied, NULL);
+  if ((errno = pthread_create(&writer, NULL, write_behind_thread, &w)) != 0) {
+    log_warn("couldn't start a writer thread: %s", strerror(errno));
+    received = recv_file_copy(conn, file_fd, offset, len);
+    if (sum != NULL && received == len &&
+        !crc32c_file(sum, file_fd, offset, len))
+      received = 0;
+    goto done;
+  }
+
+  while (received < len) {
+    /* Time spent here is the disk holding up the socket. */
+    started = trace_start();
+    pthread_mutex_lock(&w.lock);
+    while (w.count == WRITE_BUFFERS && w.error == 0)
+      pthread_cond_wait(&w.emptied, &w.lock);
+    i = (w.head + w.count) % WRITE_BUFFERS;
+    err = w.error;
+    pthread_mutex_unlock(&w.lock);
+    trace_end(TRACE_WRITE, 0, 0, started);
+    if (err != 0)
+      break;
+
+    want = len - received < WRITE_BUFFER_SIZE ? (size_t)(len - received)
+                                              : WRITE_BUFFER_SIZE;
+    started = trace_start();
+    n = recv(conn->fd, w.buffers[i], want, MSG_WAITALL);
+    trace_end(TRACE_RECV, 0, n > 0 ? (uint64_t)n : 0, started);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      err = errno;
+      log_warn("recv: %s", strerror(err));
+      break;
+    }
+    if (n == 0) {
+      log_warn("connection ended abruptly after %lld/%lldB",
+               (long long)(buffered + received), (long long)(buffered + len));
+      err = ECONNRESET;
+      break;
+    }
+    if (sum != NULL)
+      *sum = crc32c(*sum, w.buffers[i], (size_t)n);
+
+    pthread_mutex_lock(&w.lock);
+    w.used[i] = (size_t)n;
+    w.at[i] = offset + received;
+    w.count++;
+    pthread_cond_signal(&w.filled);
+    pthread_mutex_unlock(&w.lock);
+    received += n;
+    log_debug("received %lld/%lldB", (long long)received, (long long)len);
+  }
+
+  /* Whatever's been received is written before we return. */
+  pthread_mutex_lock(&w.lock);
+  w.finished = true;
+  pthread_cond_signal(&w.filled);
+  pthread_mutex_unlock(&w.lock);
+  pthread_join(writer, NULL);
+
+  received = w.written;
+  if (w.error != 0) {
+    err = w.error;
+    log_warn("write: %s", strerror(err));
+  }
+  if (err != 0)
+    errno = err;
+
+done:
+  pthread_cond_destroy(&w.emptied);
+  pthread_cond_destroy(&w.filled);
+  pthread_mutex_destroy(&w.lock);
+  return buffered + received;
+}
+
+/* Read and throw away len bytes from the connection, e.g. a file we can't
+   write anywhere.  Returns the bytes discarded, which is less than len only
+   if the connection failed or ended (errno is set).
+ */
+off_t discard_data(Connection *conn, off_t len) {
+  char buf[MAXDATASIZE];
+  off_t done;
+  size_t want;
+  ssize_t n;
+
+  done = (off_t)conn_buffered(conn) < len ? (off_t)conn_buffered(conn) : len;
+  conn->start += (size_t)done;
+
+  while (done < len) {
+    want = (len - done < MAXDATASIZE) ? (size_t)(len - done) : MAXDATASIZE;
+    n = recv(conn->fd, buf, want, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (n == 0)
+        errno = ECONNRESET;
+      log_warn("connection ended abruptly after %lld/%lldB",
+               (long long)done, (long long)len);
+      return done;
+    }
+    done += n;
+  }
+
+  return done;
+}
+
+/* Tell the kernel that len bytes of fd from offset, if there are at least
+   MMAP_MIN of them, are about to be read in order, so that it reads well
+   ahead of whatever's sending them. */
+void advise_sequential(int fd, off_t offset, off_t len) {
+  if (len < MMAP_MIN)
+    return;
+  posix_fadvise(fd, offset, len, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fd, offset, len < READAHEAD_MAX ? len : READAHEAD_MAX,
+                POSIX_FADV_WILLNEED);
+}
+
+/* Where checksum_file() jumps back to should reading a mapping raise SIGBUS,
+   as it does once the file's been truncated under it, or NULL when it isn't
+   reading one. */
+static __thread sigjmp_buf *mapping_fault;
+
+static void on_sigbus(int sig) {
+  if (mapping_fault != NULL)
+    siglongjmp(*mapping_fault, 1);
+  /* Not ours: die of it, as we would have without the handler. */
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/* Map len bytes of file_fd from offset, if there are at least MMAP_MIN of
+   them, to read them straight from the page cache.  The mapping's read in
+   order, and offered huge pages, which the kernel uses where the file's
+   filesystem supports them.  Otherwise map->data is left NULL.
+ */
+void map_file(FileMap *map, int fd, off_t offset, off_t len) {
+  static bool handling = false;
+  struct sigaction sa;
+  off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+  void *p;
+
+  map->data = NULL;
+  if (len < MMAP_MIN)
+    return;
+
+  if (!handling) {
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = on_sigbus;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, NULL) != 0) {
+      log_debug("sigaction: %s", strerror(errno));
+      return;
+    }
+    handling = true;
+  }
+
+  map->size = (size_t)(offset - start + len);
+  p = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, start);
+  if (p == MAP_FAILED) {
+    log_debug("mmap: %s", strerror(errno));
+    return;
+  }
+  madvise(p, map->size, MADV_SEQUENTIAL);
+  if (map->size >= HUGE_PAGE_SIZE)
+    madvise(p, map->size, MADV_HUGEPAGE);
+
+  map->base = p;
+  map->data = (char *)p + (offset - start);
+  map->offset = offset;
+}
+
+void unmap_file(FileMap *map) {
+  if (map->data != NULL)
+    munmap(map->base, map->size);
+  map->data = NULL;
+}
+
+/* Add len bytes of the file from offset to crc, from its mapping if it has
+   one or by reading them if not.  Returns false if they couldn't be read,
+   which for a mapping means the file was truncated while it was sent: that
+   raises SIGBUS, which jumps back here rather than killing the process.
+ */
+bool checksum_file(uint32_t *crc, FileMap *map, int fd, off_t offset,
+                   off_t len) {
+  sigjmp_buf fault;
+  uint32_t sum;
+
+  if (map->data == NULL)
+    return crc32c_file(crc, fd, offset, len);
+
+  if (sigsetjmp(fault, 1) != 0) {
+    mapping_fault = NULL;
+    log_warn("file truncated while sending");
+    errno = EIO;
+    return false;
+  }
+  mapping_fault = &fault;
+  sum = crc32c(*crc, map->data + (offset - map->offset), (size_t)len);
+  mapping_fault = NULL;
+  *crc = sum;
+  return true;
+}
+
+/* Send len bytes of file_fd from offset as a DATA frame answering id.  With
+   FLAG_COMPRESS in flags they're compressed, and with FLAG_CHECKSUM their
+   CRC follows in a CHECKSUM frame.  sendfile() never brings them into
+   userspace, so they're checksummed in steps from a mapping of the file,
+   or for a small one by reading them back from the page cache.
+
+   Returns the bytes of the file sent, as send_file() does, or -1 if the
+   frames around them couldn't be sent.
+ */
+off_t send_data(int sock_fd, uint32_t id, uint16_t flags, int file_fd,
+                off_t offset, off_t len) {
+  uint32_t crc = 0, *sum = flags & FLAG_CHECKSUM ? &crc : NULL;
+  off_t sent = 0, step, n;
+  uint64_t started;
+  FileMap map;
+
+  flags &= FLAG_COMPRESS | FLAG_CHECKSUM;
+  if (send_header(sock_fd, OP_DATA, flags, id, (uint64_t)len, MSG_MORE) < 0)
+    return -1;
+
+  advise_sequential(file_fd, offset, len);
+  if (flags & FLAG_COMPRESS) {
+    sent = send_compressed(sock_fd, file_fd, offset, len, sum);
+  } else if (sum == NULL) {
+    sent = send_file(sock_fd, file_fd, offset, len);
+  } else {
+    map_file(&map, file_fd, offset, len);
+    while (sent < len) {
+      step = len - sent < CHECKSUM_STEP ? len - sent : CHECKSUM_STEP;
+      n = send_file(sock_fd, file_fd, offset + sent, step);
+      if (n < step) {
+        sent += n;
+        break;
+      }
+      started = trace_start();
+      if (!checksum_file(&crc, &map, file_fd, offset + sent, step))
+        break;
+      trace_end(TRACE_CHECKSUM, id, (uint64_t)step, started);
+      sent += n;
+    }
+    unmap_file(&map);
+  }
+
+  if (sent == len && sum != NULL) {
+    crc = htonl(crc);
+    if (send_frame(sock_fd, OP_CHECKSUM, 0, id, &crc, sizeof crc) < 0)
+      return -1;
+  }
+  return sent;
+}
+
+/* Receive the payload of a DATA frame into file_fd at offset, however it was
+   sent, or throw it away if file_fd is -1.  With FLAG_CHECKSUM what was
+   written is read back from the page cache in steps, and checked against the
+   CHECKSUM frame after it.
+
+   Returns the bytes of the file received, as recv_file() does, or -1 if they
+   all arrived but their checksum didn't (errno is set), or doesn't match
+   them (EBADMSG).
+ */
+off_t recv_data(Connection *conn, Header *header, int file_fd, off_t offset) {
+  Header trailer;
+  char *payload;
+  uint32_t crc = 0, sent_crc;
+  uint32_t *sum = (header->flags & FLAG_CHECKSUM) && file_fd >= 0 ? &crc : NULL;
+  off_t len = (off_t)header->length, received = 0, step, n;
+  uint64_t started;
+
+  if (header->flags & FLAG_COMPRESS) {
+    received = recv_compressed(conn, file_fd, offset, len, sum);
+  } else if (file_fd < 0) {
+    received = discard_data(conn, len);
+  } else if (sum == NULL) {
+    received = recv_file(conn, file_fd, offset, len);
+  } else if (write_behind && len >= WRITE_BEHIND_MIN) {
+    received = recv_file_behind(conn, file_fd, offset, len, sum);
+  } else {
+    while (received < len) {
+      step = len - received < CHECKSUM_STEP ? len - received : CHECKSUM_STEP;
+      n = recv_file(conn, file_fd, offset + received, step);
+      if (n < step)
+        return received + n;
+      started = trace_start();
+      if (!crc32c_file(&crc, file_fd, offset + received, step))
+        return received;
+      trace_end(TRACE_CHECKSUM, header->id, (uint64_t)step, started);
+      received += n;
+    }
+  }
+
+  if (received != len || !(header->flags & FLAG_CHECKSUM))
+    return received;
+
+  if (recv_frame(conn, &trailer, &payload) < 0)
+    return -1;
+  if (trailer.opcode != OP_CHECKSUM || trailer.id != header->id ||
+      trailer.length != CHECKSUM_SIZE) {
+    log_warn("expected a checksum, got 0x%x", trailer.opcode);
+    errno = EPROTO;
+    return -1;
+  }
+  memcpy(&sent_crc, payload, sizeof sent_crc);
+  if (sum != NULL && ntohl(sent_crc) != crc) {
+    log_warn("checksum mismatch: sent %08x, received %08x", ntohl(sent_crc),
+             crc);
+    errno = EBADMSG;
+    return -1;
+  }
+
+  return received;
+}
+
+/* Read a small file of size bytes, open on *fd, into buf, which has room for
+   all of it, and close it.  Returns how much there was, which is less should
+   the file have shrunk since we looked, or -1 if it couldn't be read.
+ */
+ssize_t read_small(int *fd, char *name, off_t size, char *buf) {
+  ssize_t n, got = 0;
+
+  while (got < size) {
+    n = pread(*fd, buf + got, (size_t)(size - got), got);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      log_warn("%s: read: %s", name, strerror(errno));
+      got = -1;
+      break;
+    }
+    if (n == 0)
+      break;
+    got += n;
+  }
+
+  close(*fd);
+  *fd = -1;
+  return got;
+}
+
+/* Give a file that's been received, if fd is open on one, the mtime it had
+   where it came from, and close it. */
+void finish_file(int fd, char *name, int64_t mtime) {
+  struct timespec times[2] = {
+      {.tv_nsec = UTIME_OMIT},
+      {.tv_sec = mtime / 1000000000, .tv_nsec = mtime % 1000000000}};
+
+  if (fd < 0)
+    return;
+  if (futimens(fd, times) != 0)
+    log_warn("%s: couldn't set mtime: %s", name, strerror(errno));
+  close(fd);
+}
+
+void gather_init(Gather *g, int sock) {
+  g->sock = sock;
+  g->used = 0;
+  if ((g->buf = malloc(GATHER_SIZE)) == NULL)
+    log_error("couldn't allocate memory: %s", strerror(errno));
+}
+
+/* Send everything gathered.  Returns false if the connection failed. */
+bool gather_flush(Gather *g) {
+  if (send_all(g->sock, g->buf, g->used) < (ssize_t)g->used)
+    return false;
+  g->used = 0;
+  return true;
+}
+
+/* Make room for a frame of len bytes, at most GATHER_SIZE, sending what's
+   been gathered if it won't fit.  The caller writes the frame where this
+   points and adds to used however much of it it takes.  Returns NULL if the
+   connection failed.
+ */
+char *gather_room(Gather *g, size_t len) {
+  if (g->used + len > GATHER_SIZE && !gather_flush(g))
+    return NULL;
+  return g->buf + g->used;
+}
+
+/* Send the frames gathered, the last one's header for a file too big to be
+   gathered, then size bytes of that file from fd, which is closed.  Returns
+   false if the connection failed.
+ */
+bool gather_file(Gather *g, int fd, char *name, off_t size) {
+  off_t sent;
+
+  if (!gather_flush(g)) {
+    close(fd);
+    return false;
+  }
+  advise_sequential(fd, 0, size);
+  sent = send_file(g->sock, fd, 0, size);
+  close(fd);
+  if (sent != size) {
+    log_warn("%s: sent %lld/%lldB", name, (long long)sent, (long long)size);
+    return false;
+  }
+  return true;
+}
+
+void gather_free(Gather *g) {
+  free(g->buf);
+  g->buf = NULL;
+}
+
+#ifdef SFTP_URING
+/* The ring used for transfers, made on first use.  ring_state is 0 until we've
+   tried, then 1 if we have a ring or -1 if the kernel wouldn't give us one.
+ */
+static __thread Uring ring;
+static __thread int ring_state = 0;
+
+static Uring *get_ring(void) {
+  if (ring_state == 0) {
+    ring_state = uring_init(&ring) ? 1 : -1;
+    if (ring_state < 0)
+      log_info("io_uring unavailable, using the standard transfer path");
+  }
+
+  return ring_state > 0 ? &ring : NULL;
+}
+
+/* Wait for and collect the completions of a batch of count entries, putting
+   each result in res by the entry's user_data.  Returns false if the ring
+   failed. */
+static bool reap_batch(Uring *r, int res[URING_ENTRIES], unsigned count) {
+  struct io_uring_cqe cqe;
+
+  if (uring_submit_wait(r, count) < 0) {
+    log_warn("io_uring_enter: %s", strerror(errno));
+    return false;
+  }
+
+  for (unsigned got = 0; got < count;) {
+    if (!uring_cqe(r, &cqe)) {
+      if (uring_submit_wait(r, 1) < 0) {
+        log_warn("io_uring_enter: %s", strerror(errno));
+        return false;
+      }
+      continue;
+    }
+    if (cqe.user_data < URING_ENTRIES)
+      res[cqe.user_data] = cqe.res;
+    got++;
+  }
+
+  return true;
+}
+
+/* send_file() with io_uring.  Each batch is a single chain of linked entries
+   reading a chunk of the file into a registered buffer then sending it, for
+   up to URING_BUFS chunks, so the kernel sends them in order while we make one
+   system call per batch.  A short read or send breaks the chain; we pick up
+   from wherever it got to.
+
+   Returns bytes sent, as send_file does, or -1 if io_uring can't be used.
+ */
+off_t uring_send_file(int sock_fd, int file_fd, off_t offset, off_t len) {
+  Uring *r = get_ring();
+  struct io_uring_sqe *sqe = NULL;
+  int res[URING_ENTRIES];
+  unsigned chunk[URING_BUFS];
+  unsigned count;
+  off_t sent = 0, queued;
+
+  if (r == NULL)
+    return -1;
+
+  while (sent < len) {
+    queued = 0;
+    sqe = NULL;
+    for (count = 0; count < URING_BUFS && sent + queued < len; count++) {
+      chunk[count] = len - sent - queued < URING_BUF_SIZE
+                         ? (unsigned)(len - sent - queued)
+                         : URING_BUF_SIZE;
+
+      sqe = uring_sqe(r);
+      sqe->opcode = IORING_OP_READ_FIXED;
+      sqe->fd = file_fd;
+      sqe->addr = (unsigned long)uring_buffer(r, count);
+      sqe->len = chunk[count];
+      sqe->off = (unsigned long long)(offset + sent + queued);
+      sqe->buf_index = (unsigned short)count;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = 2 * count;
+
+      sqe = uring_sqe(r);
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = sock_fd;
+      sqe->addr = (unsigned long)uring_buffer(r, count);
+      sqe->len = chunk[count];
+      sqe->msg_flags = MSG_WAITALL;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = 2 * count + 1;
+
+      queued += chunk[count];
+    }
+    /* The last entry queued ends the chain. */
+    if (sqe != NULL)
+      sqe->flags = 0;
+
+    if (!reap_batch(r, res, 2 * count))
+      return sent;
+
+    /* Count what made it out, in order, up to the first short or failed
+       entry. */
+    for (unsigned i = 0; i < count; i++) {
+      int got = res[2 * i], out = res[2 * i + 1];
+
+      if (out > 0)
+        sent += out;
+      if (out == (int)chunk[i])
+        continue;
+
+      if (got == 0) {
+        log_warn("file truncated while sending: %lld/%lldB", (long long)sent,
+                 (long long)len);
+        errno = EIO;
+        return sent;
+      }
+      if (got < 0 && got != -ECANCELED) {
+        errno = -got;
+        log_warn("read: %s", strerror(errno));
+        return sent;
+      }
+      if (out < 0 && out != -ECANCELED && out != -EINTR) {
+        errno = -out;
+        log_warn("send: %s", strerror(errno));
+        return sent;
+      }
+      break;
+    }
+    log_debug("sent %lld/%lldB", (long long)sent, (long long)len);
+  }
+
+  return sent;
+}
+
+/* recv_file() with io_uring, after anything buffered has been written.  Each
+   batch is a chain of linked entries receiving a chunk into a registered
+   buffer then writing it to the file from there.
+
+   Returns bytes written, as recv_file does, or -1 if io_uring can't be used.
+ */
+off_t uring_recv_file(Connection *conn, int file_fd, off_t offset, off_t len) {
+  Uring *r = get_ring();
+  struct io_uring_sqe *sqe = NULL;
+  int res[URING_ENTRIES];
+  unsigned chunk[URING_BUFS];
+  unsigned count;
+  off_t received = 0, queued;
+  ssize_t written;
+
+  if (r == NULL)
+    return -1;
+
+  while (received < len) {
+    queued = 0;
+    sqe = NULL;
+    for (count = 0; count < URING_BUFS && received + queued < len; count++) {
+      chunk[count] = len - received - queued < URING_BUF_SIZE
+                         ? (unsigned)(len - received - queued)
+                         : URING_BUF_SIZE;
+
+      sqe = uring_sqe(r);
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = conn->fd;
+      sqe->addr = (unsigned long)uring_buffer(r, count);
+      sqe->len = chunk[count];
+      sqe->msg_flags = MSG_WAITALL;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = 2 * count;
+
+      sqe = uring_sqe(r);
+      sqe->opcode = IORING_OP_WRITE_FIXED;
+      sqe->fd = file_fd;
+      sqe->addr = (unsigned long)uring_buffer(r, count);
+      sqe->len = chunk[count];
+      sqe->off = (unsigned long long)(offset + received + queued);
+      sqe->buf_index = (unsigned short)count;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = 2 * count + 1;
+
+      queued += chunk[count];
+    }
+    /* The last entry queued ends the chain. */
+    if (sqe != NULL)
+      sqe->flags = 0;
+
+    if (!reap_batch(r, res, 2 * count))
+      return received;
+
+    for (unsigned i = 0; i < count; i++) {
+      int got = res[2 * i], out = res[2 * i + 1];
+
+      if (out == (int)chunk[i]) {
+        received += out;
+        continue;
+      }
+
+      if (got == 0) {
+        log_warn("connection ended abruptly after %lld/%lldB",
+                 (long long)received, (long long)len);
+        errno = ECONNRESET;
+        return received;
+      }
+      if (got < 0 && got != -ECANCELED && got != -EINTR) {
+        errno = -got;
+        log_warn("recv: %s", strerror(errno));
+        return received;
+      }
+      if (out < 0 && out != -ECANCELED) {
+        errno = -out;
+        log_warn("write: %s", strerror(errno));
+        return received;
+      }
+
+      /* Whatever was received but not written has to be written now, or
+         it's lost. */
+      if (out < 0)
+        out = 0;
+      while (got > out) {
+        written = pwrite(file_fd, uring_buffer(r, i) + out, (size_t)(got - out),
+                         offset + received + out);
+        if (written < 0 && errno == EINTR)
+          continue;
+        if (written <= 0) {
+          log_warn("write: %s", written < 0 ? strerror(errno) : "short write");
+          return received + out;
+        }
+        out += (int)written;
+      }
+      received += out;
+      break;
+    }
+    log_debug("received %lld/%lldB", (long long)received, (long long)len);
+  }
+
+  return received;
+}
+#endif
+
+/* Let go of the pipe and ring inherited from our parent after a fork(), as
+   sharing them with it would mix up our data with its. */
+void transfer_forked(void) {
+  drop_splice_pipe();
+#ifdef SFTP_URING
+  if (ring_state > 0)
+    uring_free(&ring);
+  ring_state = 0;
+#endif
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "compress.h"
+#include "sftp.h"
+
+/* Largest amount handed to the kernel in a single sendfile() call. */
+#define SENDFILE_CHUNK 0x7ffff000
+
+/* How big we ask the kernel to make the pipe used to splice from a socket. */
+#define SPLICE_PIPE_SIZE (1 << 20)
+
+/* The flags on a GET or PUT asking for a DATA frame to be sent a certain way
+   that we can go along with. */
+#define DATA_FLAGS (FLAG_CHECKSUM | (can_compress ? FLAG_COMPRESS : 0))
+
+/* Bytes of a file sent or received before going back to checksum them, while
+   they're likely still in the CPU's caches. */
+#define CHECKSUM_STEP (1024 * 1024)
+
+/* Files of at least this many bytes are mapped to checksum them as they're
+   sent, and the kernel's told to read ahead of them however they're sent.
+   Mapping and unmapping a smaller one costs more than reading it. */
+#define MMAP_MIN (256 * 1024)
+
+/* Most bytes of a file the kernel is asked to start reading in at once. */
+#define READAHEAD_MAX (16 * 1024 * 1024)
+
+/* Mappings at least this big are offered huge pages. */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* With -W, files of at least this many bytes are received by one thread and
+   written out by another, through WRITE_BUFFERS buffers of WRITE_BUFFER_SIZE
+   bytes, so that a stalled disk doesn't stop us reading the socket. */
+#define WRITE_BEHIND_MIN (1024 * 1024)
+#define WRITE_BUFFERS 4
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+
+/* When many files go out as a frame each, as the entries of a tree and the
+   files of an MGET do, those up to SMALL_FILE bytes are read into the send
+   buffer right behind their frame header, and GATHER_SIZE bytes of frames
+   are gathered up to go out in one send(). */
+#define SMALL_FILE (64 * 1024)
+#define GATHER_SIZE (256 * 1024)
+
+/* Part of a file mapped into memory: data holds its bytes from offset.  If
+   data is NULL it isn't mapped, and has to be read instead. */
+typedef struct FileMap_t {
+  char *data;
+  off_t offset;
+  void *base; /* Where the mapping starts, on a page boundary. */
+  size_t size;
+} FileMap;
+
+/* Frames being gathered up to be sent on sock many at a time. */
+typedef struct Gather_t {
+  int sock;
+  char *buf; /* GATHER_SIZE bytes, used of them taken. */
+  size_t used;
+} Gather;
+
+/* Move file data with io_uring where it's available. */
+extern bool use_uring;
+
+/* Write received files behind the socket, on a thread of their own. */
+extern bool write_behind;
+
+/* With write_behind, start writing back each step of this many bytes as
+   soon as it's written, and wait for the one before, or 0 not to. */
+extern off_t writeback_step;
+
+off_t send_file(int, int, off_t, off_t);
+off_t send_file_copy(int, int, off_t, off_t);
+
+off_t recv_file(Connection *, int, off_t, off_t);
+off_t recv_file_copy(Connection *, int, off_t, off_t);
+off_t recv_file_behind(Connection *, int, off_t, off_t, uint32_t *);
+off_t discard_data(Connection *, off_t);
+off_t send_data(int, uint32_t, uint16_t, int, off_t, off_t);
+void advise_sequential(int, off_t, off_t);
+void map_file(FileMap *, int, off_t, off_t);
+void unmap_file(FileMap *);
+bool checksum_file(uint32_t *, FileMap *, int, off_t, off_t);
+off_t recv_data(Connection *, Header *, int, off_t);
+void transfer_forked(void);
+
+ssize_t read_small(int *, char *, off_t, char *);
+void finish_file(int, char *, int64_t);
+void gather_init(Gather *, int);
+char *gather_room(Gather *, size_t);
+bool gather_flush(Gather *);
+bool gather_file(Gather *, int, char *, off_t);
+void gather_free(Gather *);
+
+#ifdef SFTP_URING
+off_t uring_send_file(int, int, off_t, off_t);
+off_t uring_recv_file(Connection *, int, off_t, off_t);
+#endif
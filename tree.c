@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "sftp.h"
+#include "transfer.h"
+#include "tree.h"
+
+/* Start walking the tree under root.  Returns false, with errno set, if root
+   can't be opened as a directory. */
+bool tree_open(TreeWalk *walk, char *root) {
+  int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  walk->depth = 0;
+  walk->path[0] = '\0';
+  if (fd < 0)
+    return false;
+  if ((walk->dirs[0] = fdopendir(fd)) == NULL) {
+    close(fd);
+    return false;
+  }
+  walk->ends[0] = 0;
+  walk->depth = 1;
+  return true;
+}
+
+/* Stop walking, closing whatever directories are still open. */
+void tree_close(TreeWalk *walk) {
+  while (walk->depth > 0)
+    closedir(walk->dirs[--walk->depth]);
+}
+
+/* Find the next directory or regular file in the walk.  A directory comes
+   before everything in it, so it can be made before anything is put in it.
+   Files are left open for the caller to send and close.  Anything we can't
+   open, and anything other than files and directories, is skipped.  Returns
+   1 with the entry filled in, or 0 when the walk is over.
+ */
+int tree_next(TreeWalk *walk, TreeEntry *entry) {
+  struct dirent *d;
+  struct stat fs;
+  size_t end, len;
+  int dir_fd, fd, flags;
+
+  while (walk->depth > 0) {
+    errno = 0;
+    if ((d = readdir(walk->dirs[walk->depth - 1])) == NULL) {
+      if (errno != 0)
+        log_warn("%s: readdir: %s", walk->path, strerror(errno));
+      closedir(walk->dirs[--walk->depth]);
+      if (walk->depth > 0)
+        walk->path[walk->ends[walk->depth - 1]] = '\0';
+      continue;
+    }
+    if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+      continue;
+    if (d->d_type != DT_DIR && d->d_type != DT_REG && d->d_type != DT_UNKNOWN)
+      continue;
+
+    end = walk->ends[walk->depth - 1];
+    len = strlen(d->d_name);
+    if (end + len + 2 > sizeof walk->path) {
+      log_warn("%s/%s: path too long", walk->path, d->d_name);
+      continue;
+    }
+    if (end > 0)
+      walk->path[end++] = '/';
+    memcpy(walk->path + end, d->d_name, len + 1);
+
+    dir_fd = dirfd(walk->dirs[walk->depth - 1]);
+    /* Not blocking, in case what the directory called unknown is a FIFO. */
+    flags = O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC;
+    if (d->d_type == DT_DIR)
+      flags |= O_DIRECTORY;
+    if ((fd = openat(dir_fd, d->d_name, flags)) < 0 || fstat(fd, &fs) != 0) {
+      if (errno != ELOOP)
+        log_warn("%s: %s", walk->path, strerror(errno));
+      goto skip;
+    }
+
+    memcpy(entry->path, walk->path, end + len + 1);
+    entry->mode = fs.st_mode;
+    entry->mtime = mtime_ns(&fs);
+    entry->size = 0;
+    entry->fd = -1;
+
+    if (S_ISREG(fs.st_mode)) {
+      entry->size = fs.st_size;
+      entry->fd = fd;
+      walk->path[walk->ends[walk->depth - 1]] = '\0';
+      return 1;
+    }
+    if (!S_ISDIR(fs.st_mode))
+      goto skip;
+
+    if (walk->depth == TREE_MAX_DEPTH) {
+      log_warn("%s: too deep, skipping", walk->path);
+      goto skip;
+    }
+    if ((walk->dirs[walk->depth] = fdopendir(fd)) == NULL) {
+      log_warn("%s: %s", walk->path, strerror(errno));
+      goto skip;
+    }
+    walk->ends[walk->depth++] = end + len;
+    return 1;
+
+  skip:
+    if (fd >= 0)
+      close(fd);
+    walk->path[walk->ends[walk->depth - 1]] = '\0';
+  }
+
+  return 0;
+}
+
+/* Bytes an entry takes on the wire, not counting the file's data. */
+size_t entry_size(TreeEntry *entry) {
+  return HEADER_SIZE + ENTRY_FIXED + strlen(entry->path) + 1;
+}
+
+/* Write the ENTRY frame header, fixed part and path for an entry into buf,
+   which must have room for entry_size() bytes.  The file's data follows. */
+void pack_entry(char *buf, uint32_t id, TreeEntry *entry) {
+  size_t path_len = strlen(entry->path) + 1;
+  Header header = {OP_ENTRY, 0, id,
+                   ENTRY_FIXED + path_len + (uint64_t)entry->size};
+  uint32_t mode = htobe32((uint32_t)entry->mode);
+  uint32_t be_len = htobe32((uint32_t)path_len);
+  uint64_t mtime = htobe64((uint64_t)entry->mtime);
+
+  pack_header(buf, &header);
+  buf += HEADER_SIZE;
+  memcpy(buf, &mode, 4);
+  memcpy(buf + 4, &be_len, 4);
+  memcpy(buf + 8, &mtime, 8);
+  memcpy(buf + ENTRY_FIXED, entry->path, path_len);
+}
+
+/* How long the path is, with its nil, from the fixed part of an ENTRY. */
+size_t entry_path_len(char *fixed) {
+  uint32_t len;
+
+  memcpy(&len, fixed + 4, 4);
+  return be32toh(len);
+}
+
+/* Read an entry out of an ENTRY payload, of which at least the fixed part
+   and the path must be at hand.  Returns false if it's malformed or its path
+   would take it outside the tree. */
+bool unpack_entry(TreeEntry *entry, Header *header, char *payload) {
+  size_t path_len = entry_path_len(payload);
+  uint32_t mode;
+  uint64_t mtime;
+
+  if (path_len == 0 || path_len > sizeof entry->path ||
+      header->length < ENTRY_FIXED + path_len ||
+      payload[ENTRY_FIXED + path_len - 1] != '\0')
+    return false;
+
+  memcpy(&mode, payload, 4);
+  memcpy(&mtime, payload + 8, 8);
+  entry->mode = be32toh(mode);
+  entry->mtime = (int64_t)be64toh(mtime);
+  entry->size = (off_t)(header->length - ENTRY_FIXED - path_len);
+  entry->fd = -1;
+  memcpy(entry->path, payload + ENTRY_FIXED, path_len);
+
+  if (!tree_path_ok(entry->path)) {
+    log_warn("refusing tree entry %s", entry->path);
+    return false;
+  }
+  return S_ISDIR(entry->mode) ? entry->size == 0 : S_ISREG(entry->mode);
+}
+
+/* Is path relative and free of .. components, so it stays inside the tree? */
+bool tree_path_ok(char *path) {
+  char *p = path;
+
+  if (*path == '\0' || *path == '/')
+    return false;
+  while (p != NULL) {
+    if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+      return false;
+    if ((p = strchr(p, '/')) != NULL)
+      p++;
+  }
+  return true;
+}
+
+/* Make the directory a tree is received into, if it isn't there already, and
+   open it.  Returns the directory or -1. */
+int tree_mkroot(char *path) {
+  if (mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO) != 0 && errno != EEXIST)
+    return -1;
+  return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/* Make a received entry under the tree's directory.  A file is left open in
+   fd for writing its data into; a directory has none, so fd is -1.  Returns
+   false, with errno set, if the entry couldn't be made. */
+bool tree_create(int root_fd, TreeEntry *entry, int *fd) {
+  *fd = -1;
+  if (S_ISDIR(entry->mode)) {
+    if (mkdirat(root_fd, entry->path, (entry->mode & 07777) | S_IRWXU) != 0)
+      return errno == EEXIST;
+    return true;
+  }
+
+  *fd = openat(root_fd, entry->path,
+               O_CREAT | O_WRONLY | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+               (entry->mode & 07777) | S_IRUSR | S_IWUSR);
+  return *fd >= 0;
+}
+
+/* Send every entry in the walk as an ENTRY frame.  Small files are gathered
+   up with their entries and sent many at a time; bigger ones go out with
+   send_file() on their own.  The caller ends the tree with an OK.  Returns the
+   number of entries sent, or -1 if the connection failed.
+ */
+ssize_t send_tree(int sock, uint32_t id, TreeWalk *walk) {
+  TreeEntry entry;
+  Gather gather;
+  size_t head;
+  ssize_t count = 0, got;
+  char *out;
+
+  gather_init(&gather, sock);
+  while (tree_next(walk, &entry) > 0) {
+    head = entry_size(&entry);
+    if (entry.fd >= 0 && entry.size > SMALL_FILE) {
+      if ((out = gather_room(&gather, head)) == NULL)
+        goto fail;
+      pack_entry(out, id, &entry);
+      gather.used += head;
+      if (!gather_file(&gather, entry.fd, entry.path, entry.size))
+        goto fail;
+      count++;
+      continue;
+    }
+
+    /* The file may shrink as we read it, so its entry is packed after. */
+    if ((out = gather_room(&gather, head + (size_t)entry.size)) == NULL)
+      goto fail;
+    if (entry.fd >= 0) {
+      got = read_small(&entry.fd, entry.path, entry.size, out + head);
+      if (got < 0)
+        continue;
+      entry.size = got;
+    }
+    pack_entry(out, id, &entry);
+    gather.used += head + (size_t)entry.size;
+    count++;
+  }
+
+  if (!gather_flush(&gather))
+    goto fail;
+  gather_free(&gather);
+  return count;
+
+fail:
+  gather_free(&gather);
+  return -1;
+}
+
+/* Receive ENTRY frames into the directory root_fd, recreating the tree as it
+   arrives, until some other frame (normally OK) ends it.  That frame is left
+   in end and payload.  Returns how many entries couldn't be written, or -1
+   if the connection failed.
+ */
+ssize_t recv_tree(Connection *conn, int root_fd, Header *end, char **payload) {
+  TreeEntry entry;
+  size_t path_len;
+  ssize_t failed = 0;
+  off_t written;
+  int fd;
+
+  for (;;) {
+    if (recv_header(conn, end) < 0)
+      return -1;
+    if (end->opcode != OP_ENTRY)
+      return recv_payload(conn, end, payload) < 0 ? -1 : failed;
+
+    if (end->length < ENTRY_FIXED || conn_need(conn, ENTRY_FIXED) < 0)
+      return -1;
+    path_len = entry_path_len(conn->buf + conn->start);
+    if (path_len > PATH_MAX ||
+        conn_need(conn, ENTRY_FIXED + path_len) < 0 ||
+        !unpack_entry(&entry, end, conn->buf + conn->start)) {
+      log_warn("bad tree entry");
+      return -1;
+    }
+    conn->start += ENTRY_FIXED + path_len;
+
+    if (!tree_create(root_fd, &entry, &fd)) {
+      log_warn("%s: %s", entry.path, strerror(errno));
+      failed++;
+      if (discard_data(conn, entry.size) != entry.size)
+        return -1;
+      continue;
+    }
+
+    written = fd >= 0 ? recv_file(conn, fd, 0, entry.size) : 0;
+    /* A directory has no fd, and keeps the mtime it gets as it's filled. */
+    finish_file(fd, entry.path, entry.mtime);
+    if (written != entry.size)
+      return -1;
+  }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sftp.h"
+
+/* Size of the fixed part of an ENTRY payload, before the path. */
+#define ENTRY_FIXED 16
+
+/* Deepest directory we'll walk into. */
+#define TREE_MAX_DEPTH 64
+
+/* One file or directory in a tree being sent or received. */
+typedef struct TreeEntry_t {
+  char path[PATH_MAX]; /* Relative to the top of the tree. */
+  mode_t mode;
+  int64_t mtime;
+  off_t size; /* Bytes of data, 0 for a directory. */
+  int fd;     /* Open on a regular file being sent, otherwise -1. */
+} TreeEntry;
+
+/* A walk over a directory tree, depth first, with the directories we're part
+   way through open on a stack. */
+typedef struct TreeWalk_t {
+  DIR *dirs[TREE_MAX_DEPTH];
+  size_t ends[TREE_MAX_DEPTH]; /* Length of path inside each directory. */
+  int depth;
+  char path[PATH_MAX];
+} TreeWalk;
+
+bool tree_open(TreeWalk *, char *);
+void tree_close(TreeWalk *);
+int tree_next(TreeWalk *, TreeEntry *);
+
+size_t entry_size(TreeEntry *);
+void pack_entry(char *, uint32_t, TreeEntry *);
+bool unpack_entry(TreeEntry *, Header *, char *);
+size_t entry_path_len(char *);
+
+bool tree_path_ok(char *);
+int tree_mkroot(char *);
+bool tree_create(int, TreeEntry *, int *);
+
+ssize_t send_tree(int, uint32_t, TreeWalk *);
+ssize_t recv_tree(Connection *, int, Header *, char **);
@@ -0,0 +1,165 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "sftp.h"
+#include "uring.h"
+
+/* Set up a ring and register its buffers with the kernel.  Returns false,
+   leaving nothing to free, if the kernel won't let us have one: it may be too
+   old, io_uring may be disabled, or we may be over RLIMIT_MEMLOCK.
+ */
+bool uring_init(Uring *r) {
+  struct io_uring_params p;
+  struct iovec iov[URING_BUFS];
+  char *sq, *cq;
+
+  memset(r, 0, sizeof *r);
+  memset(&p, 0, sizeof p);
+
+  r->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (r->fd < 0) {
+    log_debug("io_uring_setup: %s", strerror(errno));
+    return false;
+  }
+
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_ring_size > r->sq_ring_size)
+      r->sq_ring_size = r->cq_ring_size;
+    r->cq_ring_size = r->sq_ring_size;
+  }
+
+  r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED)
+    goto fail;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ring = r->sq_ring;
+  else
+    r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  if (r->cq_ring == MAP_FAILED)
+    goto fail;
+
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    goto fail;
+
+  sq = r->sq_ring;
+  cq = r->cq_ring;
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  r->tail = *r->sq_tail;
+
+  r->buffers = mmap(NULL, URING_BUFS * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r->buffers == MAP_FAILED) {
+    r->buffers = NULL;
+    goto fail;
+  }
+
+  for (unsigned i = 0; i < URING_BUFS; i++) {
+    iov[i].iov_base = uring_buffer(r, i);
+    iov[i].iov_len = URING_BUF_SIZE;
+  }
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov,
+              URING_BUFS) < 0) {
+    log_debug("io_uring_register: %s", strerror(errno));
+    goto fail;
+  }
+
+  return true;
+
+fail:
+  if (r->sqes == MAP_FAILED)
+    r->sqes = NULL;
+  if (r->cq_ring == MAP_FAILED)
+    r->cq_ring = NULL;
+  if (r->sq_ring == MAP_FAILED)
+    r->sq_ring = NULL;
+  uring_free(r);
+  return false;
+}
+
+/* Tear the ring down. */
+void uring_free(Uring *r) {
+  if (r->buffers != NULL)
+    munmap(r->buffers, URING_BUFS * URING_BUF_SIZE);
+  if (r->sqes != NULL)
+    munmap(r->sqes, r->sqes_size);
+  if (r->cq_ring != NULL && r->cq_ring != r->sq_ring)
+    munmap(r->cq_ring, r->cq_ring_size);
+  if (r->sq_ring != NULL)
+    munmap(r->sq_ring, r->sq_ring_size);
+  if (r->fd >= 0)
+    close(r->fd);
+  memset(r, 0, sizeof *r);
+  r->fd = -1;
+}
+
+/* The i'th registered buffer. */
+char *uring_buffer(Uring *r, unsigned i) {
+  return r->buffers + (size_t)i * URING_BUF_SIZE;
+}
+
+/* Get a cleared submission queue entry to fill in.  It is handed to the
+   kernel by the next uring_submit_wait(). */
+struct io_uring_sqe *uring_sqe(Uring *r) {
+  unsigned index = r->tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[index];
+
+  r->sq_array[index] = index;
+  r->tail++;
+  r->to_submit++;
+
+  memset(sqe, 0, sizeof *sqe);
+  return sqe;
+}
+
+/* Submit everything queued and wait until at least wait_nr completions are
+   ready, all in one system call.  Returns 0 or -1 on error. */
+int uring_submit_wait(Uring *r, unsigned wait_nr) {
+  int n;
+
+  __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+
+  for (;;) {
+    n = (int)syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait_nr,
+                     IORING_ENTER_GETEVENTS, NULL, 0);
+    if (n >= 0) {
+      r->to_submit -= (unsigned)n < r->to_submit ? (unsigned)n : r->to_submit;
+      if (r->to_submit == 0)
+        return 0;
+    } else if (errno != EINTR) {
+      return -1;
+    }
+  }
+}
+
+/* Take the next completion, if there is one. */
+bool uring_cqe(Uring *r, struct io_uring_cqe *cqe) {
+  unsigned head = *r->cq_head;
+
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    return false;
+
+  *cqe = r->cqes[head & *r->cq_mask];
+  __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
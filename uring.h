@@ -0,0 +1,46 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Number of registered buffers, so the most chunks of a transfer in flight
+   at once. */
+#define URING_BUFS 16
+
+/* Size of each registered buffer. */
+#define URING_BUF_SIZE (64 * 1024)
+
+/* Submission queue entries: a read and a write for every buffer. */
+#define URING_ENTRIES (2 * URING_BUFS)
+
+/* An io_uring instance, set up with raw system calls, along with its
+   registered buffers. */
+typedef struct Uring_t {
+  int fd;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  unsigned tail;
+  unsigned to_submit;
+  char *buffers;
+} Uring;
+
+bool uring_init(Uring *);
+void uring_free(Uring *);
+char *uring_buffer(Uring *, unsigned);
+struct io_uring_sqe *uring_sqe(Uring *);
+int uring_submit_wait(Uring *, unsigned);
+bool uring_cqe(Uring *, struct io_uring_cqe *);